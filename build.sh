@@ -1 +1,5 @@
-g++ -std=c++11 -ggdb -I include/  test/predict_test.cc -o gbdt_predict
+g++ -std=c++11 -ggdb -pthread -I include/  tools/gbdt_codegen.cc -o gbdt_codegen
+g++ -std=c++11 -ggdb -pthread -I include/  tools/gbdt_score.cc -o gbdt_score
+g++ -std=c++11 -ggdb -pthread -I include/  test/predict_test.cc -o gbdt_predict
+./gbdt_codegen data/0002.model 0002.model.cc
+g++ -std=c++11 -ggdb -pthread -I include/  test/codegen_test.cc 0002.model.cc -o gbdt_codegen_test
@@ -0,0 +1,135 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file codegen.h
+ * \brief emit a C++ translation unit that evaluates a forest with nested branches
+ */
+#ifndef XGBOOST_CODEGEN_H_
+#define XGBOOST_CODEGEN_H_
+
+#include <cmath>
+#include <cstdio>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include "compiled_forest.h"
+#include "flat_tree.h"
+#include "gbtree_model.h"
+
+namespace xgboost {
+    namespace codegen {
+/*!
+ * \brief trees with at most this many leaves are emitted as branch-free bitvector
+ *  updates, larger ones as nested branches where only one path is evaluated
+ */
+        const size_t kMaxMaskLeaves = 32;
+
+/*! \brief C++ literal that reads back as exactly the same float */
+        inline std::string FloatLiteral(bst_float value) {
+            if (std::isnan(value)) return "std::numeric_limits<float>::quiet_NaN()";
+            if (std::isinf(value)) {
+                return value > 0 ? "std::numeric_limits<float>::infinity()" :
+                       "-std::numeric_limits<float>::infinity()";
+            }
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%.9g", value);
+            std::string literal(buf);
+            if (literal.find_first_of(".e") == std::string::npos) literal += ".0";
+            return literal + "f";
+        }
+
+/*!
+ * \brief condition of going left at a split. A missing value has flag -1 and takes
+ *  the default branch, a NaN fails the comparison and goes right, exactly as
+ *  FlatTree::GetLeafIndex. Both sides are evaluated without short circuit,
+ *  so the condition costs no extra branch.
+ */
+        inline std::string GoLeft(const FlatTree::Node& node) {
+            std::string feat = "f[" + std::to_string(node.split_index()) + "]";
+            std::string less = "(" + feat + ".fvalue < " + FloatLiteral(node.split_cond()) + ")";
+            if (node.default_left()) {
+                return "(" + feat + ".flag == -1) | " + less;
+            }
+            return "(" + feat + ".flag != -1) & " + less;
+        }
+
+/*! \brief emit the subtree at nid as nested if/else returning the leaf value */
+        inline void EmitNode(const FlatTree& tree, int nid, int depth, std::ostream& os) {
+            std::string indent(2 * depth, ' ');
+            const FlatTree::Node& node = tree[nid];
+            if (node.is_leaf()) {
+                os << indent << "return " << FloatLiteral(node.leaf_value()) << ";\n";
+                return;
+            }
+            os << indent << "if (" << GoLeft(node) << ") {\n";
+            EmitNode(tree, node.cleft(nid), depth + 1, os);
+            os << indent << "} else {\n";
+            EmitNode(tree, node.cright(), depth + 1, os);
+            os << indent << "}\n";
+        }
+
+/*!
+ * \brief emit the splits of the subtree at nid as branch-free bitvector updates,
+ *  see QuickScorer: leaves are numbered left to right and a split that goes right
+ *  clears the leaves of its left subtree
+ * \return one past the last leaf of the subtree
+ */
+        inline int EmitMasks(const FlatTree& tree, int nid, int* nleaf, std::ostream& os,
+                             std::string* leaves) {
+            const FlatTree::Node& node = tree[nid];
+            if (node.is_leaf()) {
+                *leaves += (leaves->empty() ? "" : ", ") + FloatLiteral(node.leaf_value());
+                return ++(*nleaf);
+            }
+            int begin = *nleaf;
+            int mid = EmitMasks(tree, node.cleft(nid), nleaf, os, leaves);
+            int end = EmitMasks(tree, node.cright(), nleaf, os, leaves);
+            uint64_t left = (mid - begin == 64 ? ~static_cast<uint64_t>(0) :
+                             ((static_cast<uint64_t>(1) << (mid - begin)) - 1)) << begin;
+            os << "  m &= " << ~left << "ULL | (0ULL - static_cast<uint64_t>(" << GoLeft(node) << "));\n";
+            return end;
+        }
+
+/*!
+ * \brief write a translation unit that registers the compiled forest of a model.
+ *  Trees are added in model order, so the margins are bit identical to the
+ *  interpreted forest.
+ * \param model the loaded model
+ * \param os output stream of the generated source
+ */
+        inline void Generate(const gbm::GBTreeModel& model, std::ostream& os) {
+            const size_t ntree = model.num_trees();
+            os << "// generated by gbdt_codegen, do not edit\n"
+               << "#include <limits>\n"
+               << "#include \"compiled_forest.h\"\n\n"
+               << "namespace {\n"
+               << "using xgboost::FVec;\n\n";
+            for (size_t i = 0; i < ntree; ++i) {
+                const FlatTree tree = model.forest[i];
+                os << "bst_float Tree" << i << "(const FVec::Entry* f) {\n";
+                if ((tree.size() + 1) / 2 > kMaxMaskLeaves) {
+                    EmitNode(tree, 0, 1, os);
+                } else {
+                    // small trees evaluate every split, which avoids mispredicted branches
+                    std::ostringstream masks;
+                    std::string leaves;
+                    int nleaf = 0;
+                    EmitMasks(tree, 0, &nleaf, masks, &leaves);
+                    os << "  static const bst_float leaf[] = {" << leaves << "};\n"
+                       << "  uint64_t m = ~0ULL;\n" << masks.str()
+                       << "  return leaf[__builtin_ctzll(m)];\n";
+                }
+                os << "}\n\n";
+            }
+            os << "void PredictForest(const FVec::Entry* f, bst_float* out_margin, size_t stride) {\n";
+            for (size_t i = 0; i < ntree; ++i) {
+                os << "  out_margin[" << model.tree_info[i] << " * stride] += Tree" << i << "(f);\n";
+            }
+            os << "}\n\n"
+               << "const xgboost::CompiledForestRegistrar registrar({" << model.Fingerprint()
+               << "ULL, " << ntree << ", " << model.param.num_feature << ", PredictForest});\n"
+               << "}  // namespace\n";
+        }
+    }  // namespace codegen
+}  // namespace xgboost
+
+#endif  // XGBOOST_CODEGEN_H_
@@ -0,0 +1,296 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file compact_leaf.h
+ * \brief forest with leaf values stored in 16 bits apart from the splits
+ */
+#ifndef XGBOOST_COMPACT_LEAF_H_
+#define XGBOOST_COMPACT_LEAF_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "logging.h"
+#include "fvec.h"
+#include "flat_tree.h"
+
+namespace xgboost {
+/*! \brief storage format of leaf values */
+    enum LeafFormat {
+        kLeafFloat32 = 0,
+        kLeafFloat16 = 1,
+        kLeafBFloat16 = 2,
+        kLeafInt16 = 3
+    };
+
+/*!
+ * \brief parse the leaf_precision parameter
+ * \param name one of fp32, fp16, bf16, int16
+ */
+    inline LeafFormat ParseLeafFormat(const std::string& name) {
+        if (name == "fp16") return kLeafFloat16;
+        if (name == "bf16") return kLeafBFloat16;
+        if (name == "int16") return kLeafInt16;
+        CHECK(name == "fp32") << "unknown leaf precision: " << name;
+        return kLeafFloat32;
+    }
+
+/*!
+ * \brief forest whose leaf values live in a table of 16 bit codes.
+ *
+ *  Splits keep float thresholds in 12 byte nodes whose 16 bit child references
+ *  point either to another split or, when negative, into the leaf table of the
+ *  tree, so leaves take 2 bytes instead of a whole node. Leaves are stored as
+ *  IEEE half floats, bfloat16, or int16 codes times a per tree scale, rounded
+ *  to nearest. Each leaf is decoded as it is added to the margin. Margins are
+ *  approximate: Build measures the rounding error of every leaf against the
+ *  float model, see max_leaf_error and max_margin_error.
+ */
+    class CompactLeafForest {
+    public:
+        /*! \brief split node */
+        struct Node {
+            /*! \brief split feature with the default left bit on top */
+            uint32_t sindex;
+            /*! \brief split condition */
+            bst_float cond;
+            /*! \brief children, a negative reference r is leaf -1 - r of the tree */
+            int16_t left;
+            int16_t right;
+        };
+
+        /*!
+         * \brief build the compact layout of a forest
+         * \param forest the compiled forest
+         * \param tree_group output group of each tree
+         * \param format storage format of the leaves, not kLeafFloat32
+         * \return whether every tree fits 16 bit child references and every leaf and margin
+         *  error stays finite in the format, on false the layout is empty
+         */
+        inline bool Build(const FlatForest& forest, const std::vector<int>& tree_group,
+                          LeafFormat format) {
+            static_assert(sizeof(Node) == 12, "CompactLeafForest::Node: packed layout");
+            this->Clear();
+            format_ = format;
+            std::vector<bst_float> group_error;
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                const FlatTree tree = forest[i];
+                Tree dst;
+                dst.node_begin = nodes_.size();
+                dst.leaf_begin = codes_.size();
+                bst_float max_abs = 0.0f;
+                for (size_t nid = 0; nid < tree.size(); ++nid) {
+                    const FlatTree::Node& node = tree[static_cast<int>(nid)];
+                    if (node.is_leaf()) max_abs = std::max(max_abs, std::abs(node.leaf_value()));
+                }
+                dst.scale = max_abs / 32767.0f;
+                if (!std::isfinite(dst.scale)) dst.scale = 0.0f;
+                std::vector<int> ref(tree.size());
+                size_t nsplit = 0, nleaf = 0;
+                for (size_t nid = 0; nid < tree.size(); ++nid) {
+                    ref[nid] = tree[static_cast<int>(nid)].is_leaf() ? -1 - static_cast<int>(nleaf++) :
+                               static_cast<int>(nsplit++);
+                }
+                if (nsplit > 0x8000 || nleaf > 0x8000) {
+                    this->Clear();
+                    return false;
+                }
+                dst.root = ref[0];
+                bst_float tree_error = 0.0f;
+                for (size_t nid = 0; nid < tree.size(); ++nid) {
+                    const FlatTree::Node& src = tree[static_cast<int>(nid)];
+                    if (src.is_leaf()) {
+                        uint16_t code = Encode(src.leaf_value(), dst.scale);
+                        codes_.push_back(code);
+                        bst_float value = Decode(code, dst.scale);
+                        if (!std::isfinite(value)) {
+                            // e.g. a half float leaf of 65520 or more, keep the float leaves
+                            this->Clear();
+                            return false;
+                        }
+                        bst_float error = std::abs(value - src.leaf_value());
+                        if (!(error <= tree_error)) tree_error = error;
+                        continue;
+                    }
+                    Node node;
+                    node.sindex = src.split_index() | (src.default_left() ? 1U << 31 : 0U);
+                    node.cond = src.split_cond();
+                    node.left = static_cast<int16_t>(ref[src.cleft(static_cast<int>(nid))]);
+                    node.right = static_cast<int16_t>(ref[src.cright()]);
+                    nodes_.push_back(node);
+                }
+                trees_.push_back(dst);
+                if (!(tree_error <= max_leaf_error_)) max_leaf_error_ = tree_error;
+                size_t group = static_cast<size_t>(tree_group[i]);
+                if (group_error.size() <= group) group_error.resize(group + 1, 0.0f);
+                group_error[group] += tree_error;
+            }
+            for (bst_float error : group_error) {
+                if (!std::isfinite(error)) {
+                    this->Clear();
+                    return false;
+                }
+                if (!(error <= max_margin_error_)) max_margin_error_ = error;
+            }
+            return true;
+        }
+
+        /*! \brief drop the layout */
+        inline void Clear() {
+            nodes_.clear();
+            codes_.clear();
+            trees_.clear();
+            max_leaf_error_ = 0.0f;
+            max_margin_error_ = 0.0f;
+        }
+
+        /*!
+         * \brief leaf value of tree i for a dense feature vector
+         * \param i index of the tree
+         * \param feat entries of the dense feature vector
+         */
+        inline bst_float Predict(size_t i, const FVec::Entry* feat) const {
+            const Tree& tree = trees_[i];
+            const Node* nodes = nodes_.data() + tree.node_begin;
+            int ref = tree.root;
+            while (ref >= 0) {
+                const Node& node = nodes[ref];
+                const FVec::Entry& e = feat[node.sindex & ((1U << 31) - 1U)];
+                bool go_left = e.flag == -1 ? (node.sindex >> 31) != 0 : e.fvalue < node.cond;
+                ref = go_left ? node.left : node.right;
+            }
+            return Decode(codes_[tree.leaf_begin + static_cast<size_t>(-1 - ref)], tree.scale);
+        }
+
+        /*! \brief number of trees, 0 if the forest was not built */
+        inline size_t num_trees() const {
+            return trees_.size();
+        }
+
+        /*! \brief storage format of the leaves */
+        inline LeafFormat format() const {
+            return format_;
+        }
+
+        /*! \brief largest difference between a stored leaf and its float value */
+        inline bst_float max_leaf_error() const {
+            return max_leaf_error_;
+        }
+
+        /*!
+         * \brief sum of the largest leaf errors of the trees of an output group, maximized
+         *  over groups: bounds the margin error up to the float rounding of the sum
+         */
+        inline bst_float max_margin_error() const {
+            return max_margin_error_;
+        }
+
+        /*! \brief bytes used by splits and leaves */
+        inline size_t MemoryBytes() const {
+            return nodes_.size() * sizeof(Node) + codes_.size() * sizeof(uint16_t);
+        }
+
+        /*! \brief round a float to the nearest half float */
+        inline static uint16_t FloatToHalf(bst_float value) {
+            uint32_t x = FloatBits(value);
+            uint16_t sign = static_cast<uint16_t>((x >> 16) & 0x8000);
+            uint32_t mag = x & 0x7FFFFFFF;
+            if (mag > 0x7F800000) return sign | 0x7E00;  // NaN
+            if (mag >= 0x477FF000) return sign | 0x7C00;  // 65520 and above round to infinity
+            if (mag < 0x38800000) {
+                // subnormal half, scaling by 2^24 is exact and nearbyint rounds to even
+                return sign | static_cast<uint16_t>(std::nearbyint(std::abs(value) * 16777216.0f));
+            }
+            // rebias the exponent and round the mantissa to 10 bits, ties to even
+            uint32_t m = mag - (112U << 23);
+            m += 0xFFF + ((m >> 13) & 1);
+            return sign | static_cast<uint16_t>(m >> 13);
+        }
+
+        /*! \brief the float value of a half float */
+        inline static bst_float HalfToFloat(uint16_t h) {
+            uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+            uint32_t exp = (h >> 10) & 0x1F;
+            uint32_t man = h & 0x3FF;
+            if (exp == 0) {
+                bst_float value = static_cast<bst_float>(man) / 16777216.0f;
+                return sign ? -value : value;
+            }
+            uint32_t bits = sign | (exp == 31 ? 0x7F800000 : (exp + 112) << 23) | (man << 13);
+            return BitsFloat(bits);
+        }
+
+        /*! \brief round a float to the nearest bfloat16 */
+        inline static uint16_t FloatToBFloat16(bst_float value) {
+            uint32_t x = FloatBits(value);
+            if ((x & 0x7FFFFFFF) > 0x7F800000) return static_cast<uint16_t>((x >> 16) | 0x40);
+            return static_cast<uint16_t>((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+        }
+
+        /*! \brief the float value of a bfloat16 */
+        inline static bst_float BFloat16ToFloat(uint16_t h) {
+            return BitsFloat(static_cast<uint32_t>(h) << 16);
+        }
+
+    private:
+        struct Tree {
+            // first split and first leaf of the tree
+            size_t node_begin;
+            size_t leaf_begin;
+            // root reference, negative when the tree is a single leaf
+            int root;
+            // value of one int16 step
+            bst_float scale;
+        };
+
+        inline uint16_t Encode(bst_float value, bst_float scale) const {
+            switch (format_) {
+                case kLeafFloat16: return FloatToHalf(value);
+                case kLeafBFloat16: return FloatToBFloat16(value);
+                default: {
+                    if (scale == 0.0f) return 0;
+                    bst_float q = std::nearbyint(value / scale);
+                    q = std::min(std::max(q, -32767.0f), 32767.0f);
+                    return static_cast<uint16_t>(static_cast<int16_t>(q));
+                }
+            }
+        }
+
+        inline bst_float Decode(uint16_t code, bst_float scale) const {
+            switch (format_) {
+                case kLeafFloat16: return HalfToFloat(code);
+                case kLeafBFloat16: return BFloat16ToFloat(code);
+                default: return static_cast<int16_t>(code) * scale;
+            }
+        }
+
+        inline static uint32_t FloatBits(bst_float value) {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        inline static bst_float BitsFloat(uint32_t bits) {
+            bst_float value;
+            std::memcpy(&value, &bits, sizeof(value));
+            return value;
+        }
+
+        // splits of all trees
+        std::vector<Node> nodes_;
+        // leaf codes of all trees
+        std::vector<uint16_t> codes_;
+        // layout of each tree
+        std::vector<Tree> trees_;
+        // storage format of the leaves
+        LeafFormat format_ = kLeafFloat32;
+        // largest rounding error of a leaf
+        bst_float max_leaf_error_ = 0.0f;
+        // largest sum of the leaf errors of the trees of an output group
+        bst_float max_margin_error_ = 0.0f;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_COMPACT_LEAF_H_
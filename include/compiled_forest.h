@@ -0,0 +1,97 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file compiled_forest.h
+ * \brief registry of forests compiled ahead of time into C++ by gbdt_codegen
+ */
+#ifndef XGBOOST_COMPILED_FOREST_H_
+#define XGBOOST_COMPILED_FOREST_H_
+
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include "base.h"
+#include "fvec.h"
+
+namespace xgboost {
+/*!
+ * \brief a forest compiled into native code.
+ *
+ *  gbdt_codegen turns a model into a translation unit holding one function
+ *  per tree and a CompiledForestRegistrar. Linking that unit into a program
+ *  registers the forest under the fingerprint of the model, and a loaded
+ *  model with the same fingerprint predicts through the native code.
+ */
+    struct CompiledForest {
+        /*!
+         * \brief add the leaf values of all trees for one row to the margins of its groups
+         * \param feat entries of the dense feature vector, at least num_feature of them
+         * \param out_margin margins of the row, group g is at out_margin[g * stride]
+         * \param stride distance between the margins of two groups
+         */
+        typedef void (*PredictFunction)(const FVec::Entry* feat, bst_float* out_margin,
+                                        size_t stride);
+
+        /*! \brief fingerprint of the model, see Fingerprint */
+        uint64_t fingerprint;
+        /*! \brief number of trees */
+        size_t num_trees;
+        /*! \brief number of features the dense feature vector must hold */
+        size_t num_feature;
+        /*! \brief prediction function */
+        PredictFunction predict;
+
+        /*!
+         * \brief find the compiled forest of a model
+         * \param fingerprint fingerprint of the model
+         * \return the forest, nullptr if none was linked in
+         */
+        inline static const CompiledForest* Find(uint64_t fingerprint) {
+            std::lock_guard<std::mutex> lock(RegistryMutex());
+            auto it = Registry().find(fingerprint);
+            return it == Registry().end() ? nullptr : &it->second;
+        }
+
+        /*! \brief register a compiled forest, done by the generated code */
+        inline static void Register(const CompiledForest& forest) {
+            std::lock_guard<std::mutex> lock(RegistryMutex());
+            Registry()[forest.fingerprint] = forest;
+        }
+
+        /*!
+         * \brief 64 bit FNV-1a hash, used to fingerprint the compiled inference
+         *  layout of a model so generated code only serves the model it came from
+         * \param data bytes to hash
+         * \param size number of bytes
+         * \param hash hash of the preceding bytes
+         */
+        inline static uint64_t Fingerprint(const void* data, size_t size,
+                                           uint64_t hash = 14695981039346656037ULL) {
+            const unsigned char* bytes = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < size; ++i) {
+                hash = (hash ^ bytes[i]) * 1099511628211ULL;
+            }
+            return hash;
+        }
+
+    private:
+        inline static std::unordered_map<uint64_t, CompiledForest>& Registry() {
+            static std::unordered_map<uint64_t, CompiledForest> registry;
+            return registry;
+        }
+
+        inline static std::mutex& RegistryMutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+    };
+
+/*! \brief registers a compiled forest during static initialization */
+    struct CompiledForestRegistrar {
+        explicit CompiledForestRegistrar(const CompiledForest& forest) {
+            CompiledForest::Register(forest);
+        }
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_COMPILED_FOREST_H_
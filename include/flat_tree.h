@@ -0,0 +1,382 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file flat_tree.h
+ * \brief packed inference layout of a regression tree
+ */
+#ifndef XGBOOST_FLAT_TREE_H_
+#define XGBOOST_FLAT_TREE_H_
+
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "logging.h"
+#include "fvec.h"
+#include "tree_model.h"
+
+namespace xgboost {
+/*! \brief how the leaf reached in a tree is reported by leaf prediction */
+    enum LeafIndexFormat {
+        /*! \brief node id of the leaf in the original RegTree, as xgboost pred_leaf */
+        kLeafNodeId = 0,
+        /*! \brief rank of the leaf among the leaves of its tree, 0 to num_leaves(i) - 1 */
+        kLeafOrdinal = 1,
+        /*! \brief rank of the leaf among the leaves of the forest, a one-hot column index */
+        kLeafColumn = 2
+    };
+
+/*!
+ * \brief inference-only copy of a RegTree.
+ *
+ *  Nodes reachable from root 0 are laid out depth first, so the left
+ *  child of an internal node is always the next node and only the right
+ *  child needs an index. Parent links, deleted slots and node statistics
+ *  are dropped, which leaves 12 bytes per node. A FlatTree is a view,
+ *  the nodes themselves live in the arena of a FlatForest.
+ */
+    class FlatTree {
+    public:
+        /*! \brief packed tree node */
+        class Node {
+        public:
+            /*! \brief whether current node is leaf node */
+            inline bool is_leaf() const {
+                return cright_ < 0;
+            }
+
+            /*! \brief index of left child, always the next node */
+            inline int cleft(int nid) const {
+                return nid + 1;
+            }
+
+            /*! \brief index of right child */
+            inline int cright() const {
+                return cright_;
+            }
+
+            /*! \brief feature index of split condition */
+            inline unsigned split_index() const {
+                return sindex_ & ((1U << 31) - 1U);
+            }
+
+            /*! \brief when feature is unknown, whether goes to left child */
+            inline bool default_left() const {
+                return (sindex_ >> 31) != 0;
+            }
+
+            /*! \return get split condition of the node */
+            inline bst_float split_cond() const {
+                return info_.split_cond;
+            }
+
+            /*! \return get leaf value of leaf node */
+            inline bst_float leaf_value() const {
+                return info_.leaf_value;
+            }
+
+            /*! \return node id of the leaf in the original RegTree */
+            inline int leaf_id() const {
+                return -1 - cright_;
+            }
+
+        private:
+            friend class FlatTree;
+            friend class FlatForest;
+
+            union Info {
+                bst_float leaf_value;
+                bst_float split_cond;
+            };
+            // split feature index, highest bit is the default direction
+            unsigned sindex_;
+            // split condition or leaf value
+            Info info_;
+            // right child of internal node, -1 - original node id of leaf node
+            int cright_;
+        };
+
+        FlatTree() : nodes_(nullptr), size_(0) {}
+
+        /*!
+         * \brief view a range of packed nodes as a tree
+         * \param nodes the packed nodes, root first
+         * \param size number of nodes
+         */
+        FlatTree(const Node* nodes, size_t size) : nodes_(nodes), size_(size) {}
+
+        /*!
+         * \brief append the packed layout of a tree to a node buffer
+         * \param tree the tree to compile, only root 0 is used
+         * \param out buffer the nodes are appended to, node indices are relative to its old size
+         */
+        inline static void Compile(const RegTree& tree, std::vector<Node>* out) {
+            static_assert(sizeof(Node) == 3 * sizeof(int), "FlatTree::Node: packed layout");
+            CompileNode(tree, 0, out->size(), out);
+        }
+
+        /*!
+         * \brief get the index of the leaf reached by a dense feature vector
+         * \param feat entries of the dense feature vector
+         * \return index of the leaf in this flat tree
+         */
+        inline int GetLeafIndex(const FVec::Entry* feat) const {
+            int nid = 0;
+            while (!nodes_[nid].is_leaf()) {
+                const Node& node = nodes_[nid];
+                const FVec::Entry& e = feat[node.split_index()];
+                bool go_left = e.flag == -1 ? node.default_left() : e.fvalue < node.split_cond();
+                nid = go_left ? node.cleft(nid) : node.cright();
+            }
+            return nid;
+        }
+
+        /*! \brief get the index of the leaf reached by a dense feature vector */
+        inline int GetLeafIndex(const FVec& feat) const {
+            return this->GetLeafIndex(feat.entries());
+        }
+
+        /*! \brief get the prediction of the tree */
+        inline bst_float Predict(const FVec::Entry* feat) const {
+            return nodes_[this->GetLeafIndex(feat)].leaf_value();
+        }
+
+        /*! \brief get the prediction of the tree */
+        inline bst_float Predict(const FVec& feat) const {
+            return nodes_[this->GetLeafIndex(feat.entries())].leaf_value();
+        }
+
+        /*! \brief get node given nid */
+        inline const Node& operator[](int nid) const {
+            return nodes_[nid];
+        }
+
+        /*!
+         * \brief check that every child index stays inside the tree and points
+         *  forward, so traversal always terminates, and that split indices are in range.
+         *  Leaves must have a zero split word, which vector kernels may read.
+         * \param num_feature number of features of the model
+         */
+        inline bool IsValid(unsigned num_feature) const {
+            if (size_ == 0) return false;
+            for (size_t nid = 0; nid < size_; ++nid) {
+                const Node& node = nodes_[nid];
+                if (node.is_leaf()) {
+                    if (node.sindex_ != 0) return false;
+                    continue;
+                }
+                if (nid + 1 >= size_ || node.cright() <= static_cast<int>(nid) + 1 ||
+                    static_cast<size_t>(node.cright()) >= size_ ||
+                    node.split_index() >= num_feature) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /*! \brief number of nodes in the flat tree */
+        inline size_t size() const {
+            return size_;
+        }
+
+    private:
+        // append the subtree rooted at nid in depth first order
+        inline static int CompileNode(const RegTree& tree, int nid, size_t base,
+                                      std::vector<Node>* out) {
+            const RegTree::Node& src = tree[nid];
+            int fid = static_cast<int>(out->size() - base);
+            out->push_back(Node());
+            if (src.is_leaf()) {
+                (*out)[base + fid].sindex_ = 0;
+                (*out)[base + fid].info_.leaf_value = src.leaf_value();
+                (*out)[base + fid].cright_ = -1 - nid;
+                return fid;
+            }
+            CHECK(!tree[src.cleft()].is_deleted() && !tree[src.cright()].is_deleted())
+                << "FlatTree: node " << nid << " points to a deleted child";
+            (*out)[base + fid].sindex_ = src.split_index() | (src.default_left() ? (1U << 31) : 0U);
+            (*out)[base + fid].info_.split_cond = src.split_cond();
+            CompileNode(tree, src.cleft(), base, out);
+            int right = CompileNode(tree, src.cright(), base, out);
+            (*out)[base + fid].cright_ = right;
+            return fid;
+        }
+
+        // first node of the tree
+        const Node* nodes_;
+        // number of nodes
+        size_t size_;
+    };
+
+/*!
+ * \brief packed nodes of a whole ensemble in one cache line aligned arena.
+ *
+ *  Trees are stored back to back, tree i occupies nodes
+ *  [offset(i), offset(i + 1)) of the arena.
+ */
+    class FlatForest {
+    public:
+        /*! \brief alignment of the node arena in bytes */
+        static const size_t kAlignment = 64;
+
+        FlatForest() : nodes_(nullptr) {}
+
+        /*!
+         * \brief compile trees into the arena
+         * \param trees trees of the ensemble
+         */
+        inline void Compile(const std::vector<std::unique_ptr<RegTree> >& trees) {
+            std::vector<FlatTree::Node> nodes;
+            size_t num_nodes = 0;
+            for (const auto& tree : trees) {
+                num_nodes += tree->param.num_nodes - tree->param.num_deleted;
+            }
+            nodes.reserve(num_nodes);
+            offset_.assign(1, 0);
+            for (const auto& tree : trees) {
+                FlatTree::Compile(*tree, &nodes);
+                offset_.push_back(nodes.size());
+            }
+            this->Assign(nodes);
+            this->IndexLeaves();
+        }
+
+        /*!
+         * \brief rewrite the split feature of every node, the nodes are copied
+         *  into a new arena so an attached arena is left untouched
+         * \param new_index new index of each feature the forest splits on
+         */
+        inline void RemapFeatures(const std::vector<unsigned>& new_index) {
+            std::vector<FlatTree::Node> nodes(nodes_, nodes_ + (num_trees() == 0 ? 0 : offset_.back()));
+            for (FlatTree::Node& node : nodes) {
+                if (node.is_leaf()) continue;
+                node.sindex_ = new_index[node.split_index()] | (node.sindex_ & (1U << 31));
+            }
+            this->Assign(nodes);
+        }
+
+        /*!
+         * \brief use an existing node arena in place, e.g. inside a mapped file
+         * \param nodes first node of the arena
+         * \param offset node offset of each tree, num_trees + 1 entries
+         * \param holder owner of the arena memory, kept alive by the forest
+         */
+        inline void Attach(const FlatTree::Node* nodes, std::vector<size_t> offset,
+                           std::shared_ptr<const void> holder) {
+            nodes_ = nodes;
+            offset_ = std::move(offset);
+            holder_ = std::move(holder);
+            this->IndexLeaves();
+        }
+
+        /*! \brief release the arena */
+        inline void Clear() {
+            holder_.reset();
+            nodes_ = nullptr;
+            offset_.clear();
+            leaf_rank_.clear();
+            leaf_offset_.clear();
+        }
+
+        /*! \brief get tree i */
+        inline FlatTree operator[](size_t i) const {
+            return FlatTree(nodes_ + offset_[i], offset_[i + 1] - offset_[i]);
+        }
+
+        /*! \brief number of trees */
+        inline size_t num_trees() const {
+            return offset_.empty() ? 0 : offset_.size() - 1;
+        }
+
+        /*! \brief offset of the first node of tree i in the arena */
+        inline size_t offset(size_t i) const {
+            return offset_[i];
+        }
+
+        /*! \brief first node of the arena */
+        inline const FlatTree::Node* nodes() const {
+            return nodes_;
+        }
+
+        /*!
+         * \brief report the leaf at position nid of tree i in the given format
+         * \param i index of the tree
+         * \param nid position of the leaf in the flat tree
+         * \param format what to report, see LeafIndexFormat
+         */
+        inline int LeafIndex(size_t i, int nid, LeafIndexFormat format) const {
+            switch (format) {
+                case kLeafOrdinal:
+                    return leaf_rank_[offset_[i] + nid];
+                case kLeafColumn:
+                    return static_cast<int>(leaf_offset_[i]) + leaf_rank_[offset_[i] + nid];
+                default:
+                    return nodes_[offset_[i] + nid].leaf_id();
+            }
+        }
+
+        /*! \brief number of leaves of tree i */
+        inline size_t num_leaves(size_t i) const {
+            return leaf_offset_[i + 1] - leaf_offset_[i];
+        }
+
+        /*! \brief number of leaves of trees [0, i), the first one-hot column of tree i */
+        inline size_t leaf_offset(size_t i) const {
+            return leaf_offset_[i];
+        }
+
+        /*! \brief hint the cpu to load the root of tree i */
+        inline void Prefetch(size_t i) const {
+#if defined(__GNUC__)
+            if (i < num_trees()) __builtin_prefetch(nodes_ + offset_[i]);
+#endif
+        }
+
+        /*! \brief bytes used by the node arena and the offset table */
+        inline size_t MemoryBytes() const {
+            return (num_trees() == 0 ? 0 : offset_.back() * sizeof(FlatTree::Node)) +
+                   offset_.size() * sizeof(size_t) + leaf_rank_.size() * sizeof(int) +
+                   leaf_offset_.size() * sizeof(size_t);
+        }
+
+    private:
+        // copy nodes into a new aligned arena owned by the forest
+        inline void Assign(const std::vector<FlatTree::Node>& nodes) {
+            std::shared_ptr<char> buffer(new char[nodes.size() * sizeof(FlatTree::Node) + kAlignment],
+                                         std::default_delete<char[]>());
+            size_t addr = reinterpret_cast<size_t>(buffer.get());
+            FlatTree::Node* arena =
+                reinterpret_cast<FlatTree::Node*>((addr + kAlignment - 1) / kAlignment * kAlignment);
+            if (!nodes.empty()) {
+                std::memcpy(arena, &nodes[0], nodes.size() * sizeof(FlatTree::Node));
+            }
+            nodes_ = arena;
+            holder_ = buffer;
+        }
+
+        // number the leaves of each tree in node order, for the ordinal leaf formats
+        inline void IndexLeaves() {
+            leaf_rank_.assign(num_trees() == 0 ? 0 : offset_.back(), -1);
+            leaf_offset_.assign(1, 0);
+            for (size_t i = 0; i < num_trees(); ++i) {
+                int rank = 0;
+                for (size_t k = offset_[i]; k < offset_[i + 1]; ++k) {
+                    if (nodes_[k].is_leaf()) leaf_rank_[k] = rank++;
+                }
+                leaf_offset_.push_back(leaf_offset_.back() + rank);
+            }
+        }
+
+        // owns the arena memory, a heap buffer or the mapped model file
+        std::shared_ptr<const void> holder_;
+        // aligned start of the arena
+        const FlatTree::Node* nodes_;
+        // node offset of each tree, num_trees + 1 entries
+        std::vector<size_t> offset_;
+        // rank of each leaf within its tree, -1 for internal nodes
+        std::vector<int> leaf_rank_;
+        // leaf count of the trees before each tree, num_trees + 1 entries
+        std::vector<size_t> leaf_offset_;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_FLAT_TREE_H_
@@ -1,109 +1,274 @@
 #ifndef XGBOOST_FVEC_H_
 #define XGBOOST_FVEC_H_
 
+#include <vector>
+#include <algorithm>
 #include <unordered_map>
 
+typedef float bst_float;
+
+namespace xgboost {
 /*!
  * \brief dense feature vector that can be taken by RegTree
  * and can be construct from sparse feature vector.
+ *
+ *  The vector keeps every entry marked as missing between uses:
+ *  Fill writes the present entries of one row and Drop resets
+ *  exactly those entries, so both cost O(nnz) instead of O(size).
  */
-
-typedef float bst_float;
-
-namespace xgboost {
-    class FVecBase {
+    class FVec {
     public:
+        /*!
+         * \brief a union value of value and flag
+         *  when flag == -1, this indicate the value is missing
+         */
+        union Entry {
+            bst_float fvalue;
+            int flag;
+        };
+
         /*!
          * \brief initialize the vector with size vector
          * \param size The size of the feature vector.
          */
-        virtual void Init(size_t size);
+        inline void Init(size_t size) {
+            Entry e;
+            e.flag = -1;
+            data.resize(size);
+            std::fill(data.begin(), data.end(), e);
+        }
+
         /*!
-         * \brief fill the vector with sparse vector
-         * \param inst The sparse instance to fill.
+         * \brief fill the vector with sparse vector,
+         *  features beyond size() are never used by the model and are skipped
+         * \param index feature indices of the sparse instance
+         * \param value feature values of the sparse instance
+         * \param length number of entries in the sparse instance
          */
-        //inline void Fill(const RowBatch::Inst& inst);
-        virtual void Set(const std::unordered_map<size_t, bst_float>* feature_map);
+        inline void Fill(const unsigned* index, const bst_float* value, size_t length) {
+            for (size_t i = 0; i < length; ++i) {
+                if (index[i] >= data.size()) continue;
+                data[index[i]].fvalue = value[i];
+            }
+        }
+
         /*!
          * \brief drop the trace after fill, must be called after fill.
-         * \param inst The sparse instance to drop.
+         * \param index feature indices of the sparse instance
+         * \param length number of entries in the sparse instance
+         */
+        inline void Drop(const unsigned* index, size_t length) {
+            for (size_t i = 0; i < length; ++i) {
+                if (index[i] >= data.size()) continue;
+                data[index[i]].flag = -1;
+            }
+        }
+
+        /*!
+         * \brief fill the vector with a feature map
+         * \param feature_map The sparse instance to fill.
+         */
+        inline void Fill(const std::unordered_map<size_t, bst_float>& feature_map) {
+            for (const auto& kv : feature_map) {
+                if (kv.first >= data.size()) continue;
+                data[kv.first].fvalue = kv.second;
+            }
+        }
+
+        /*!
+         * \brief drop the trace after fill, must be called after fill.
+         * \param feature_map The sparse instance to drop.
+         */
+        inline void Drop(const std::unordered_map<size_t, bst_float>& feature_map) {
+            for (const auto& kv : feature_map) {
+                if (kv.first >= data.size()) continue;
+                data[kv.first].flag = -1;
+            }
+        }
+
+        /*!
+         * \brief fill the vector with a feature map whose feature ids are translated
+         *  to dense ids, feature ids past the end of dense_id are skipped
+         * \param feature_map The sparse instance to fill.
+         * \param dense_id dense id of each feature id, unused features share a spare entry
+         */
+        inline void Fill(const std::unordered_map<size_t, bst_float>& feature_map,
+                         const std::vector<unsigned>& dense_id) {
+            for (const auto& kv : feature_map) {
+                if (kv.first >= dense_id.size()) continue;
+                data[dense_id[kv.first]].fvalue = kv.second;
+            }
+        }
+
+        /*!
+         * \brief drop the trace after a fill with dense ids, must be called after fill.
+         * \param feature_map The sparse instance to drop.
+         * \param dense_id dense id of each feature id, as given to Fill
          */
-        //inline void Drop(const RowBatch::Inst& inst);
+        inline void Drop(const std::unordered_map<size_t, bst_float>& feature_map,
+                         const std::vector<unsigned>& dense_id) {
+            for (const auto& kv : feature_map) {
+                if (kv.first >= dense_id.size()) continue;
+                data[dense_id[kv.first]].flag = -1;
+            }
+        }
+
+        /*!
+         * \brief overwrite entry k with entry feature_id[k] of another dense feature vector,
+         *  the vector does not stay all missing afterwards
+         * \param src entries of the source vector
+         * \param src_size number of entries of the source vector, others count as missing
+         * \param feature_id source entry of each entry
+         */
+        inline void Gather(const Entry* src, size_t src_size, const std::vector<unsigned>& feature_id) {
+            if (data.size() < feature_id.size()) data.resize(feature_id.size());
+            for (size_t k = 0; k < feature_id.size(); ++k) {
+                if (feature_id[k] < src_size) {
+                    data[k] = src[feature_id[k]];
+                } else {
+                    data[k].flag = -1;
+                }
+            }
+        }
+
         /*!
          * \brief returns the size of the feature vector
          * \return the size of the feature vector
          */
-        virtual size_t size() const;
+        inline size_t size() const {
+            return data.size();
+        }
+
+        /*!
+         * \brief get the raw entries, used by compiled trees to traverse without copies
+         * \return pointer to the first entry
+         */
+        inline const Entry* entries() const {
+            return data.empty() ? nullptr : &data[0];
+        }
 
         /*!
          * \brief get ith value
          * \param i feature index.
          * \return the i-th feature value
          */
-        virtual bst_float fvalue(size_t i) const;
+        inline bst_float fvalue(size_t i) const {
+            return data[i].fvalue;
+        }
 
         /*!
          * \brief check whether i-th entry is missing
          * \param i feature index.
          * \return whether i-th value is missing.
          */
-        virtual bool is_missing(size_t i) const;
+        inline bool is_missing(size_t i) const {
+            return data[i].flag == -1;
+        }
 
     private:
-        /*!
-         * \brief a union value of value and flag
-         *  when flag == -1, this indicate the value is missing
-         */
-        /*union Entry {
-          bst_float fvalue;
-          int flag;
-          };*/
-        // std::vector<Entry> data;
-        // change inner implementation from vector to unordered map
-        const std::unordered_map<size_t, bst_float>* data = nullptr;
+        std::vector<Entry> data;
     };
 
-    class FVec {
+/*!
+ * \brief a block of dense feature vectors stored one row after another,
+ *  so every row of a batch block can be addressed from a single base pointer.
+ *  Like FVec, entries are kept missing between uses.
+ */
+    class FVecBlock {
     public:
+        /*!
+         * \brief initialize the block
+         * \param nrow number of rows
+         * \param size The size of each feature vector.
+         */
+        inline void Init(size_t nrow, size_t size) {
+            FVec::Entry e;
+            e.flag = -1;
+            stride = size;
+            data.resize(nrow * size);
+            std::fill(data.begin(), data.end(), e);
+        }
 
-        bst_float fvalue(size_t i) const {
-            const auto& res = data->find(i);
-            if (res != data->end()) {
-                return data->at(i);
-            } else {
-                return 0;
+        /*!
+         * \brief fill row r with a sparse instance, features beyond size() are skipped
+         * \param r row in the block
+         * \param index feature indices of the sparse instance
+         * \param value feature values of the sparse instance
+         * \param length number of entries in the sparse instance
+         */
+        inline void Fill(size_t r, const unsigned* index, const bst_float* value, size_t length) {
+            FVec::Entry* row = data.data() + r * stride;
+            for (size_t i = 0; i < length; ++i) {
+                if (index[i] >= stride) continue;
+                row[index[i]].fvalue = value[i];
             }
         }
 
-        void Init(size_t size) {
-            //Entry e;
-            //e.flag = -1;
-            // data.resize(size);
-            // std::fill(data.begin(), data.end(), e);
+        /*!
+         * \brief drop the trace of row r after fill
+         * \param r row in the block
+         * \param index feature indices of the sparse instance
+         * \param length number of entries in the sparse instance
+         */
+        inline void Drop(size_t r, const unsigned* index, size_t length) {
+            FVec::Entry* row = data.data() + r * stride;
+            for (size_t i = 0; i < length; ++i) {
+                if (index[i] >= stride) continue;
+                row[index[i]].flag = -1;
+            }
         }
 
-        void Set(const std::unordered_map<size_t, bst_float>* feature_map) {
-            data = feature_map;
+        /*!
+         * \brief fill row r with a sparse instance whose feature ids are translated to
+         *  dense ids, feature ids past the end of dense_id are skipped. Features the
+         *  model does not use all map to one spare entry of the row, so the loop
+         *  does not branch on which features are used.
+         * \param r row in the block
+         * \param index feature indices of the sparse instance
+         * \param value feature values of the sparse instance
+         * \param length number of entries in the sparse instance
+         * \param dense_id dense id of each feature id, unused features share a spare entry
+         */
+        inline void Fill(size_t r, const unsigned* index, const bst_float* value, size_t length,
+                         const std::vector<unsigned>& dense_id) {
+            FVec::Entry* row = data.data() + r * stride;
+            const size_t nid = dense_id.size();
+            for (size_t i = 0; i < length; ++i) {
+                if (index[i] >= nid) continue;
+                row[dense_id[index[i]]].fvalue = value[i];
+            }
         }
 
+        /*! \brief drop the trace of row r after a fill with dense ids */
+        inline void Drop(size_t r, const unsigned* index, size_t length,
+                         const std::vector<unsigned>& dense_id) {
+            FVec::Entry* row = data.data() + r * stride;
+            const size_t nid = dense_id.size();
+            for (size_t i = 0; i < length; ++i) {
+                if (index[i] >= nid) continue;
+                row[dense_id[index[i]]].flag = -1;
+            }
+        }
 
-        size_t size() const {
-            return data->size();
+        /*! \brief entries of row r */
+        inline const FVec::Entry* row(size_t r) const {
+            return data.data() + r * stride;
         }
 
+        /*! \brief size of each feature vector, also the distance between rows */
+        inline size_t size() const {
+            return stride;
+        }
+
+        /*! \brief number of rows in the block */
+        inline size_t num_row() const {
+            return stride == 0 ? 0 : data.size() / stride;
+        }
 
-        bool is_missing(size_t i) const {
-            const auto& res = data->find(i);
-            if (res != data->end()) {
-                return false;
-            } else {
-                return true;
-            }
-        }    
-    
     private:
-        const std::unordered_map<size_t, bst_float>* data = nullptr;
+        std::vector<FVec::Entry> data;
+        size_t stride = 0;
     };
-}
+}  // namespace xgboost
 
 #endif //XGBOOST_FVEC_H_
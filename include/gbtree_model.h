@@ -9,10 +9,45 @@
 #include <string>
 #include <vector>
 #include <fstream>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include "compact_leaf.h"
+#include "compiled_forest.h"
+#include "flat_tree.h"
+#include "io.h"
+#include "jit.h"
+#include "quantized_tree.h"
+#include "quick_scorer.h"
+#include "simd_tree.h"
 #include "tree_model.h"
+#include "tree_shap.h"
+#include "unrolled_tree.h"
 
 namespace xgboost {
     namespace gbm {
+/*! \brief engine of batch prediction */
+        enum BatchEngine {
+            kBatchAuto = 0,
+            kBatchQuickScorer = 1,
+            kBatchSIMD = 2,
+            kBatchNative = 3
+        };
+
+/*!
+ * \brief parse the batch_engine parameter
+ * \param name one of auto, native, quick_scorer, simd
+ */
+        inline BatchEngine ParseBatchEngine(const std::string& name) {
+            if (name == "quick_scorer") return kBatchQuickScorer;
+            if (name == "simd") return kBatchSIMD;
+            if (name == "native") return kBatchNative;
+            CHECK(name == "auto") << "unknown batch engine: " << name;
+            return kBatchAuto;
+        }
+
 /*! \brief model parameters */
         //struct GBTreeModelParam : public dmlc::Parameter<GBTreeModelParam> {
         struct GBTreeModelParam {
@@ -47,53 +82,719 @@ namespace xgboost {
 
         class GBTreeModel {
         public:
-            explicit GBTreeModel(bst_float base_margin) : base_margin(base_margin) {}
+            explicit GBTreeModel(bst_float base_margin)
+                : base_margin(base_margin), simd_level(simd::DetectLevel()),
+                  batch_engine(kBatchAuto), use_quick_scorer(true), compiled(nullptr),
+                  use_compiled(true), use_jit(false), use_unrolled(true), use_quantized(false),
+                  leaf_format(kLeafFloat32), use_remap(true) {}
 
+            /*!
+             * \brief set inference parameters
+             *  supported parameters:
+             *    simd: instruction set of batch traversal, one of auto, avx512, avx2, none
+             *    batch_engine: auto runs native code, quantized bins and QuickScorer, as
+             *      single predictions do, ahead of the SIMD kernels, native forces native
+             *      code when there is some, the JIT even where QuickScorer applies,
+             *      quick_scorer forces QuickScorer when the forest qualifies, simd forces
+             *      the interleaved kernels of the simd level
+             *    quick_scorer: 0 disables QuickScorer evaluation of forests that qualify
+             *    compiled_code: 0 disables forests compiled by gbdt_codegen
+             *    jit: 1 translates the forest into native code after load, used when
+             *      no compiled code is linked in and the platform allows executable memory
+             *    unrolled_trees: 0 disables the depth specialized kernels of complete trees
+             *    quantized: 1 compares integer bins of feature values and thresholds,
+             *      used when the forest can be quantized. Batches then bin every row once
+             *      and traverse the trees one row at a time instead of in SIMD lanes: the
+             *      nodes are smaller but traversal is scalar, so batch_engine=simd may be
+             *      faster where the nodes fit in cache; the margins are the same
+             *    leaf_precision: fp32, or fp16, bf16, int16 to store leaves in 16 bits,
+             *      which makes predictions approximate, see CompactLeafForest
+             *    remap_features: 0 keeps the feature ids of the model, otherwise the features
+             *      the trees split on are renumbered densely, applied by the next load. A
+             *      compiled file saved the other way is copied and rewritten at load instead
+             *      of used in place
+             */
             void Configure(const std::vector <std::pair<std::string, std::string>> &cfg) {
                 // initialize model parameters if not yet been initialized.
                 if (trees.size() == 0) {
 					// TODO: init
                     //param.InitAllowUnknown(cfg);
                 }
+                for (const auto& kv : cfg) {
+                    if (kv.first == "simd") {
+                        simd_level = simd::ParseLevel(kv.second);
+                    } else if (kv.first == "batch_engine") {
+                        batch_engine = ParseBatchEngine(kv.second);
+                    } else if (kv.first == "quick_scorer") {
+                        use_quick_scorer = std::atoi(kv.second.c_str()) != 0;
+                    } else if (kv.first == "compiled_code") {
+                        use_compiled = std::atoi(kv.second.c_str()) != 0;
+                    } else if (kv.first == "jit") {
+                        use_jit = std::atoi(kv.second.c_str()) != 0;
+                    } else if (kv.first == "unrolled_trees") {
+                        use_unrolled = std::atoi(kv.second.c_str()) != 0;
+                    } else if (kv.first == "quantized") {
+                        use_quantized = std::atoi(kv.second.c_str()) != 0;
+                    } else if (kv.first == "leaf_precision") {
+                        leaf_format = ParseLeafFormat(kv.second);
+                    } else if (kv.first == "remap_features") {
+                        use_remap = std::atoi(kv.second.c_str()) != 0;
+                    }
+                }
+                if (leaf_format == kLeafFloat32) {
+                    compact_leaves.Clear();
+                } else if ((compact_leaves.num_trees() == 0 || compact_leaves.format() != leaf_format) &&
+                           num_trees() != 0) {
+                    compact_leaves.Build(forest, tree_info, leaf_format);
+                }
+                if (!use_quantized) {
+                    quantized.Clear();
+                } else if (quantized.num_trees() == 0 && num_trees() != 0) {
+                    quantized.Build(forest, num_dense_feature());
+                }
+                if (!use_unrolled) {
+                    unrolled.Clear();
+                } else if (unrolled.num_unrolled() == 0 && num_trees() != 0) {
+                    unrolled.Build(forest);
+                }
+                if (!use_jit) {
+                    jit.Clear();
+                } else if (jit.function() == nullptr && num_trees() != 0) {
+                    jit.Build(forest, tree_info);
+                }
             }
 
             void InitTreesToUpdate() {
                 trees.clear();
+                forest.Clear();
+                shap.Clear();
                 param.num_trees = 0;
                 tree_info.clear();
             }
 
-            void Load(std::ifstream& ifile) {
-                if (!ifile.read((char*)&param, sizeof(param))) {
-                    std::cerr << "GBTree:: invalid model file" << std::endl;
+            /*!
+             * \brief load the trees of an xgboost binary model
+             * \param fi input stream positioned after the learner section
+             * \return status of the load, the model is unusable unless it is ok
+             */
+            LoadStatus Load(MemoryStream& fi) {
+                if (!fi.Read(&param, sizeof(param))) return LoadStatus::Truncated("gbtree parameters");
+                if (param.num_trees < 0 || param.num_feature < 0 || param.num_output_group < 0) {
+                    return LoadStatus::Corrupt("invalid gbtree parameters");
                 }
-
                 trees.clear();
 
                 for (int i = 0; i < param.num_trees; ++i) {
                     std::unique_ptr<RegTree> ptr(new RegTree());
-                    ptr->Load(ifile);
+                    LoadStatus status = ptr->Load(fi);
+                    if (!status.ok()) {
+                        status.message = "tree " + std::to_string(i) + ": " + status.message;
+                        return status;
+                    }
+                    // a dense feature vector of num_feature entries must cover every split
+                    for (const auto& node : ptr->GetNodes()) {
+                        if (node.is_leaf() || node.is_deleted()) continue;
+                        if (node.split_index() >= static_cast<unsigned>(param.num_feature)) {
+                            return LoadStatus::Corrupt("tree " + std::to_string(i) +
+                                                       ": split index out of range");
+                        }
+                    }
                     trees.push_back(std::move(ptr));
                 }
-                
+
+                tree_info.resize(param.num_trees);
+                if (!fi.Read(dmlc::BeginPtr(tree_info), sizeof(int) * tree_info.size())) {
+                    return LoadStatus::Truncated("tree info");
+                }
+                if (!this->CheckTreeInfo()) return LoadStatus::Corrupt("tree group out of range");
+                this->Compile();
+                return LoadStatus();
+            }
+
+            /*!
+             * \brief save the compiled forest, tree_info and parameters
+             * \param fo output stream
+             */
+            void SaveCompiled(std::ofstream& fo) const {
+                fo.write(reinterpret_cast<const char*>(&param), sizeof(param));
+                std::vector<uint64_t> offset(forest.num_trees() + 1, 0);
+                for (size_t i = 0; i < forest.num_trees(); ++i) {
+                    offset[i + 1] = forest.offset(i + 1);
+                }
+                if (!tree_info.empty()) {
+                    fo.write(reinterpret_cast<const char*>(&tree_info[0]),
+                             sizeof(int) * tree_info.size());
+                }
+                fo.write(reinterpret_cast<const char*>(&offset[0]), sizeof(uint64_t) * offset.size());
+                // the nodes are saved with dense feature ids, followed by their original ids
+                uint64_t num_used = used_feature.size();
+                fo.write(reinterpret_cast<const char*>(&num_used), sizeof(num_used));
+                if (num_used != 0) {
+                    fo.write(reinterpret_cast<const char*>(&used_feature[0]), sizeof(unsigned) * num_used);
+                }
+                // the node arena starts at an aligned file offset so it can be used in place
+                std::vector<char> pad((FlatForest::kAlignment - static_cast<size_t>(fo.tellp()) %
+                                       FlatForest::kAlignment) % FlatForest::kAlignment, 0);
+                if (!pad.empty()) fo.write(&pad[0], pad.size());
+                fo.write(reinterpret_cast<const char*>(forest.nodes()),
+                         sizeof(FlatTree::Node) * offset.back());
+            }
+
+            /*!
+             * \brief load a compiled forest, nodes are used in place without copies unless
+             *  remap_features asks for other feature ids than the file was saved with
+             * \param fi input stream over the file content
+             * \param file the mapped file, kept alive as long as the forest uses it
+             * \return status of the load, the model is unusable unless it is ok
+             */
+            LoadStatus LoadCompiled(MemoryStream& fi, std::shared_ptr<const MappedFile> file) {
+                if (!fi.Read(&param, sizeof(param))) return LoadStatus::Truncated("gbtree parameters");
+                if (param.num_trees < 0 || param.num_feature < 0 || param.num_output_group < 0) {
+                    return LoadStatus::Corrupt("invalid gbtree parameters");
+                }
+                if (static_cast<size_t>(param.num_trees) >
+                    fi.Remaining() / (sizeof(int) + sizeof(uint64_t) + sizeof(FlatTree::Node))) {
+                    return LoadStatus::Truncated("tree offsets");
+                }
+                trees.clear();
+                shap.Clear();
                 tree_info.resize(param.num_trees);
-                if (param.num_trees != 0) {
-                    ifile.read((char*)&tree_info[0], sizeof(int) * param.num_trees);
+                std::vector<uint64_t> offset(param.num_trees + 1);
+                if (!fi.Read(dmlc::BeginPtr(tree_info), sizeof(int) * tree_info.size()) ||
+                    !fi.Read(&offset[0], sizeof(uint64_t) * offset.size())) {
+                    return LoadStatus::Truncated("tree offsets");
+                }
+                uint64_t num_used;
+                if (!fi.Read(&num_used, sizeof(num_used))) return LoadStatus::Truncated("feature map");
+                if (num_used > static_cast<uint64_t>(param.num_feature)) {
+                    return LoadStatus::Corrupt("invalid feature map");
+                }
+                used_feature.resize(num_used);
+                if (!fi.Read(dmlc::BeginPtr(used_feature), sizeof(unsigned) * num_used) ||
+                    !fi.Skip((FlatForest::kAlignment - fi.Tell() % FlatForest::kAlignment) %
+                             FlatForest::kAlignment)) {
+                    return LoadStatus::Truncated("feature map");
+                }
+                for (size_t k = 0; k < used_feature.size(); ++k) {
+                    if (used_feature[k] >= static_cast<unsigned>(param.num_feature) ||
+                        (k != 0 && used_feature[k] <= used_feature[k - 1])) {
+                        return LoadStatus::Corrupt("invalid feature map");
+                    }
+                }
+                this->IndexFeatures();
+                if (!this->CheckTreeInfo()) return LoadStatus::Corrupt("tree group out of range");
+                if (offset[0] != 0) return LoadStatus::Corrupt("invalid tree offsets");
+                for (int i = 0; i < param.num_trees; ++i) {
+                    if (offset[i] >= offset[i + 1]) return LoadStatus::Corrupt("invalid tree offsets");
+                }
+                if (offset.back() > fi.Remaining() / sizeof(FlatTree::Node)) {
+                    return LoadStatus::Truncated("tree nodes");
+                }
+                const char* nodes = fi.Skip(sizeof(FlatTree::Node) * offset.back());
+                if (reinterpret_cast<size_t>(nodes) % FlatForest::kAlignment != 0) {
+                    return LoadStatus::Corrupt("misaligned tree nodes");
+                }
+                forest.Attach(reinterpret_cast<const FlatTree::Node*>(nodes),
+                              std::vector<size_t>(offset.begin(), offset.end()), file);
+                for (size_t i = 0; i < forest.num_trees(); ++i) {
+                    if (!forest[i].IsValid(static_cast<unsigned>(num_dense_feature()))) {
+                        forest.Clear();
+                        return LoadStatus::Corrupt("tree " + std::to_string(i) + ": invalid nodes");
+                    }
+                }
+                if (!use_remap) {
+                    this->RestoreFeatures();
+                } else if (!remapped()) {
+                    this->RemapFeatures();
+                }
+                this->BuildEngines();
+                return LoadStatus();
+            }
+
+            /*! \brief number of trees available for prediction */
+            inline size_t num_trees() const {
+                return forest.num_trees();
+            }
+
+            /*! \brief number of margins per instance, one per class for multi-class models */
+            inline size_t num_output_group() const {
+                return param.num_output_group > 1 ? static_cast<size_t>(param.num_output_group) : 1;
+            }
+
+            /*! \brief whether every tree belongs to a valid output group */
+            inline bool CheckTreeInfo() const {
+                for (int group : tree_info) {
+                    if (group < 0 || static_cast<size_t>(group) >= num_output_group()) return false;
+                }
+                return true;
+            }
+
+            /*! \brief build the packed inference layout of every tree, called after load */
+            inline void Compile() {
+                forest.Compile(trees);
+                shap.Build(trees);
+                used_feature.clear();
+                this->RemapFeatures();
+                this->BuildEngines();
+            }
+
+            /*!
+             * \brief renumber the features the forest splits on densely, in increasing order
+             *  of their ids, when that drops some feature and remap_features allows it
+             */
+            inline void RemapFeatures() {
+                if (!use_remap) return;
+                std::vector<bool> used(param.num_feature, false);
+                for (size_t i = 0; i < num_trees(); ++i) {
+                    const FlatTree tree = forest[i];
+                    for (size_t nid = 0; nid < tree.size(); ++nid) {
+                        const FlatTree::Node& node = tree[static_cast<int>(nid)];
+                        if (!node.is_leaf()) used[node.split_index()] = true;
+                    }
+                }
+                std::vector<unsigned> used_ids;
+                for (size_t fid = 0; fid < used.size(); ++fid) {
+                    if (used[fid]) used_ids.push_back(static_cast<unsigned>(fid));
+                }
+                if (used_ids.empty() || used_ids.size() == used.size()) return;
+                used_feature = used_ids;
+                this->IndexFeatures();
+                std::vector<unsigned> new_index(param.num_feature, 0);
+                for (size_t k = 0; k < used_feature.size(); ++k) {
+                    new_index[used_feature[k]] = static_cast<unsigned>(k);
+                }
+                forest.RemapFeatures(new_index);
+            }
+
+            /*! \brief give the forest the feature ids of the model back, undoing RemapFeatures */
+            inline void RestoreFeatures() {
+                if (!remapped()) return;
+                forest.RemapFeatures(used_feature);
+                used_feature.clear();
+                this->IndexFeatures();
+            }
+
+            /*! \brief build feature_index from used_feature */
+            inline void IndexFeatures() {
+                feature_index.clear();
+                if (used_feature.empty()) return;
+                feature_index.assign(param.num_feature, static_cast<unsigned>(used_feature.size()));
+                for (size_t k = 0; k < used_feature.size(); ++k) {
+                    feature_index[used_feature[k]] = static_cast<unsigned>(k);
+                }
+            }
+
+            /*! \brief whether the trees split on dense feature ids, see RemapFeatures */
+            inline bool remapped() const {
+                return !used_feature.empty();
+            }
+
+            /*! \brief number of entries of the dense feature vectors the trees read */
+            inline size_t num_dense_feature() const {
+                return remapped() ? used_feature.size() : static_cast<size_t>(param.num_feature);
+            }
+
+            /*!
+             * \brief number of entries of a feature vector filled through feature_index,
+             *  one more than num_dense_feature() for the spare entry of unused features
+             */
+            inline size_t num_fill_feature() const {
+                return num_dense_feature() + (remapped() ? 1 : 0);
+            }
+
+            /*! \brief build the evaluation engines that are derived from the compiled forest */
+            inline void BuildEngines() {
+                this->BuildLeafBounds();
+                quick_scorer = QuickScorer();
+                if (QuickScorer::Qualifies(forest)) {
+                    quick_scorer.Build(forest, tree_info);
+                }
+                compiled = CompiledForest::Find(this->Fingerprint());
+                if (compiled != nullptr && (compiled->num_trees != num_trees() ||
+                                            compiled->num_feature != static_cast<size_t>(param.num_feature))) {
+                    compiled = nullptr;
+                }
+                unrolled.Clear();
+                if (use_unrolled) {
+                    unrolled.Build(forest);
+                }
+                quantized.Clear();
+                if (use_quantized) {
+                    quantized.Build(forest, num_dense_feature());
                 }
-                
+                compact_leaves.Clear();
+                if (leaf_format != kLeafFloat32) {
+                    compact_leaves.Build(forest, tree_info, leaf_format);
+                }
+                jit.Clear();
+                if (use_jit && num_trees() != 0) {
+                    jit.Build(forest, tree_info);
+                }
+            }
+
+            /*!
+             * \brief sum the smallest and the largest leaf of the trees of each output group
+             *  over the group's own trees, so any range of trees is bounded by two binary
+             *  searches in memory linear in the number of trees
+             */
+            inline void BuildLeafBounds() {
+                const size_t ngroup = num_output_group();
+                group_trees.assign(ngroup, std::vector<unsigned>());
+                leaf_min_prefix.assign(ngroup, std::vector<double>(1, 0.0));
+                leaf_max_prefix.assign(ngroup, std::vector<double>(1, 0.0));
+                leaf_abs_prefix.assign(ngroup, std::vector<double>(1, 0.0));
+                for (size_t i = 0; i < num_trees(); ++i) {
+                    const FlatTree tree = forest[i];
+                    bst_float lo = std::numeric_limits<bst_float>::max();
+                    bst_float hi = -std::numeric_limits<bst_float>::max();
+                    for (size_t nid = 0; nid < tree.size(); ++nid) {
+                        if (!tree[nid].is_leaf()) continue;
+                        lo = std::min(lo, tree[nid].leaf_value());
+                        hi = std::max(hi, tree[nid].leaf_value());
+                    }
+                    const size_t g = static_cast<size_t>(tree_info[i]);
+                    group_trees[g].push_back(static_cast<unsigned>(i));
+                    leaf_min_prefix[g].push_back(leaf_min_prefix[g].back() + lo);
+                    leaf_max_prefix[g].push_back(leaf_max_prefix[g].back() + hi);
+                    leaf_abs_prefix[g].push_back(leaf_abs_prefix[g].back() +
+                                                 std::max(std::fabs(lo), std::fabs(hi)));
+                }
+            }
+
+            /*!
+             * \brief bound what trees [tree_begin, tree_end) can add to the margin of an output
+             *  group, whatever the instance. Leaves read from the 16 bit table widen the bounds
+             *  by their largest error.
+             * \param group output group
+             * \param tree_begin first tree
+             * \param tree_end one past the last tree
+             * \param lower receives the smallest sum of leaves
+             * \param upper receives the largest sum of leaves
+             */
+            inline void LeafBounds(size_t group, unsigned tree_begin, unsigned tree_end,
+                                   double* lower, double* upper) const {
+                // positions of the first trees of the group at or after tree_begin and tree_end
+                const std::vector<unsigned>& trees = group_trees[group];
+                const size_t begin = std::lower_bound(trees.begin(), trees.end(), tree_begin) -
+                                     trees.begin();
+                const size_t end = std::lower_bound(trees.begin() + begin, trees.end(), tree_end) -
+                                   trees.begin();
+                *lower = leaf_min_prefix[group][end] - leaf_min_prefix[group][begin];
+                *upper = leaf_max_prefix[group][end] - leaf_max_prefix[group][begin];
+                if (UseCompactLeaves()) {
+                    double slack = static_cast<double>(end - begin) * compact_leaves.max_leaf_error();
+                    *lower -= slack;
+                    *upper += slack;
+                }
+            }
+
+            /*!
+             * \brief bound the float rounding error of a margin of an output group summed over
+             *  trees [0, tree_end) in any order and by any engine: gamma(n - 1) times the
+             *  sum of the absolute values of the base margin and the largest leaves, for the
+             *  n terms of the sum (Higham, Accuracy and Stability of Numerical Algorithms, 4.2)
+             * \param group output group
+             * \param tree_end one past the last tree
+             * \return the bound, 0 when no tree of the group is summed
+             */
+            inline double AccumulationError(size_t group, unsigned tree_end) const {
+                const std::vector<unsigned>& trees = group_trees[group];
+                const size_t count = std::lower_bound(trees.begin(), trees.end(), tree_end) -
+                                     trees.begin();
+                double sum = std::fabs(static_cast<double>(base_margin)) +
+                             leaf_abs_prefix[group][count];
+                if (UseCompactLeaves()) {
+                    sum += static_cast<double>(count) * compact_leaves.max_leaf_error();
+                }
+                const double nu = static_cast<double>(count) *
+                                  std::numeric_limits<bst_float>::epsilon() / 2.0;
+                return nu / (1.0 - nu) * sum;
+            }
+
+            /*!
+             * \brief fingerprint of everything prediction depends on except the base margin:
+             *  the packed nodes, the tree groups and the feature and group counts
+             */
+            inline uint64_t Fingerprint() const {
+                int shape[3] = {param.num_feature, static_cast<int>(num_output_group()),
+                                static_cast<int>(num_trees())};
+                uint64_t hash = CompiledForest::Fingerprint(shape, sizeof(shape));
+                hash = CompiledForest::Fingerprint(dmlc::BeginPtr(tree_info),
+                                                   sizeof(int) * tree_info.size(), hash);
+                for (size_t i = 0; i < num_trees(); ++i) {
+                    FlatTree tree = forest[i];
+                    hash = CompiledForest::Fingerprint(&tree[0], sizeof(FlatTree::Node) * tree.size(),
+                                                       hash);
+                }
+                return hash;
+            }
+
+            /*! \brief whether trees [tree_begin, tree_end) are evaluated by compiled code */
+            inline bool UseCompiled(unsigned tree_begin, unsigned tree_end) const {
+                return use_compiled && compiled != nullptr && tree_begin == 0 &&
+                       tree_end == num_trees();
+            }
+
+            /*! \brief whether leaves are read from the 16 bit leaf table, which overrides other engines */
+            inline bool UseCompactLeaves() const {
+                return leaf_format != kLeafFloat32 && num_trees() != 0 &&
+                       compact_leaves.num_trees() == num_trees();
+            }
+
+            /*! \brief whether the trees are evaluated on binned feature values */
+            inline bool UseQuantized() const {
+                return use_quantized && num_trees() != 0 && quantized.num_trees() == num_trees();
+            }
+
+            /*!
+             * \brief native code evaluating trees [tree_begin, tree_end): the forest compiled
+             *  by gbdt_codegen if linked in, otherwise the JIT unless QuickScorer applies,
+             *  which is faster on the shallow trees it accepts
+             * \param over_quick_scorer whether the JIT is used even where QuickScorer applies
+             * \return the function, nullptr if the trees are evaluated another way
+             */
+            inline CompiledForest::PredictFunction NativeForest(unsigned tree_begin, unsigned tree_end,
+                                                                bool over_quick_scorer = false) const {
+                if (UseCompiled(tree_begin, tree_end)) return compiled->predict;
+                if (!use_jit || tree_begin != 0 || tree_end != num_trees() ||
+                    (!over_quick_scorer && UseQuickScorer(tree_begin, tree_end))) {
+                    return nullptr;
+                }
+                return jit.function();
+            }
+
+            /*! \brief whether trees [tree_begin, tree_end) are evaluated by QuickScorer */
+            inline bool UseQuickScorer(unsigned tree_begin, unsigned tree_end) const {
+                return use_quick_scorer && tree_begin == 0 && num_trees() != 0 &&
+                       tree_end == num_trees() && quick_scorer.num_trees() == num_trees();
             }
             
 
-            inline float PredictInstanceRaw(FVec &feats, unsigned tree_begin, unsigned tree_end) {
-                bst_float psum = this->base_margin;
+            /*!
+             * \brief compute the margins of one instance
+             * \param feats dense feature vector of the instance
+             * \param tree_begin first tree to use
+             * \param tree_end one past the last tree to use
+             * \param out_margin num_output_group() margins of the instance
+             */
+            inline void PredictInstanceRaw(const FVec &feats, unsigned tree_begin, unsigned tree_end,
+                                           bst_float *out_margin) const {
+                const size_t ngroup = num_output_group();
+                std::fill(out_margin, out_margin + ngroup, this->base_margin);
+                // the 16 bit leaves override the other engines
+                if (!UseCompactLeaves()) {
+                    CompiledForest::PredictFunction native = NativeForest(tree_begin, tree_end);
+                    if (native != nullptr) {
+                        native(feats.entries(), out_margin, 1);
+                        return;
+                    }
+                    if (UseQuantized()) {
+                        static thread_local std::vector<uint16_t> bins;
+                        bins.resize(num_dense_feature());
+                        quantized.BinRow(feats.entries(), bins.data());
+                        for (size_t i = tree_begin; i < tree_end; ++i) {
+                            out_margin[tree_info[i]] += quantized.Predict(i, bins.data());
+                        }
+                        return;
+                    }
+                    if (UseQuickScorer(tree_begin, tree_end)) {
+                        static thread_local std::vector<uint64_t> bitvec;
+                        bitvec.resize(num_trees());
+                        quick_scorer.Predict(feats.entries(), bitvec.data(), out_margin, 1);
+                        return;
+                    }
+                }
+                this->AccumulateInstanceRaw(feats, tree_begin, tree_end, out_margin);
+            }
+
+            /*!
+             * \brief add the leaf values of trees [tree_begin, tree_end) to the margins of one
+             *  instance tree by tree, so a range split in two adds up to the same margins.
+             *  The binned forest gives the same leaves but would bin the row for every range,
+             *  so it is not used here.
+             * \param feats dense feature vector of the instance
+             * \param tree_begin first tree to use
+             * \param tree_end one past the last tree to use
+             * \param out_margin num_output_group() margins of the instance, accumulated in place
+             */
+            inline void AccumulateInstanceRaw(const FVec &feats, unsigned tree_begin, unsigned tree_end,
+                                              bst_float *out_margin) const {
+                if (UseCompactLeaves()) {
+                    for (size_t i = tree_begin; i < tree_end; ++i) {
+                        out_margin[tree_info[i]] += compact_leaves.Predict(i, feats.entries());
+                    }
+                    return;
+                }
+                if (num_output_group() == 1) {
+                    bst_float psum = out_margin[0];
+                    for (size_t i = tree_begin; i < tree_end; ++i) {
+                        this->PredictRows(i, false, feats.entries(), 0, 1, &psum, 0);
+                    }
+                    out_margin[0] = psum;
+                    return;
+                }
+                for (size_t i = tree_begin; i < tree_end; ++i) {
+                    this->PredictRows(i, false, feats.entries(), 0, 1, out_margin + tree_info[i], 0);
+                }
+            }
+
+            /*!
+             * \brief add the leaf values of trees [tree_begin, tree_end) to the margins of a block
+             *  of rows, trees are iterated in the outer loop so each tree stays in cache while
+             *  the block traverses it
+             * \param block dense feature vectors of the block
+             * \param nrow number of rows in use, starting at row 0 of the block
+             * \param tree_begin first tree to use
+             * \param tree_end one past the last tree to use
+             * \param out_margin margins of the block, grouped by output group: the margin of
+             *  row r in group g is out_margin[g * nrow + r], accumulated in place
+             */
+            inline void PredictBatchRaw(const FVecBlock &block, size_t nrow,
+                                        unsigned tree_begin, unsigned tree_end,
+                                        bst_float *out_margin) const {
+                if (UseCompactLeaves()) {
+                    for (size_t i = tree_begin; i < tree_end; ++i) {
+                        bst_float *out = out_margin + tree_info[i] * nrow;
+                        for (size_t r = 0; r < nrow; ++r) {
+                            out[r] += compact_leaves.Predict(i, block.row(r));
+                        }
+                    }
+                    return;
+                }
+                // auto follows PredictInstanceRaw, so an engine that was asked for or that
+                // the forest qualifies for runs ahead of the SIMD kernels
+                CompiledForest::PredictFunction native =
+                    NativeForest(tree_begin, tree_end, batch_engine == kBatchNative);
+                if ((batch_engine == kBatchAuto || batch_engine == kBatchNative) &&
+                    native != nullptr) {
+                    for (size_t r = 0; r < nrow; ++r) {
+                        native(block.row(r), out_margin + r, nrow);
+                    }
+                    return;
+                }
+                if (batch_engine == kBatchAuto && UseQuantized()) {
+                    // every row is binned once, then traverses all trees on the bins
+                    const size_t nfeat = block.size();
+                    static thread_local std::vector<uint16_t> bins;
+                    bins.resize(nrow * nfeat);
+                    for (size_t r = 0; r < nrow; ++r) {
+                        quantized.BinRow(block.row(r), &bins[r * nfeat]);
+                    }
+                    for (size_t i = tree_begin; i < tree_end; ++i) {
+                        bst_float *out = out_margin + tree_info[i] * nrow;
+                        for (size_t r = 0; r < nrow; ++r) {
+                            out[r] += quantized.Predict(i, &bins[r * nfeat]);
+                        }
+                    }
+                    return;
+                }
+                if ((batch_engine == kBatchAuto || batch_engine == kBatchQuickScorer) &&
+                    UseQuickScorer(tree_begin, tree_end)) {
+                    std::vector<uint64_t> bitvec(num_trees());
+                    for (size_t r = 0; r < nrow; ++r) {
+                        quick_scorer.Predict(block.row(r), bitvec.data(), out_margin + r, nrow);
+                    }
+                    return;
+                }
+                for (size_t i = tree_begin; i < tree_end; ++i) {
+                    bst_float *out = out_margin + tree_info[i] * nrow;
+                    forest.Prefetch(i + 1);
+                    size_t r = simd::PredictTree(simd_level, forest.nodes() + forest.offset(i),
+                                                 block, nrow, out);
+                    this->PredictRows(i, false, block.row(r), block.size(), nrow - r, out + r, 1);
+                }
+            }
+
+            /*!
+             * \brief report the leaf each row of a block reaches in trees [tree_begin, tree_end),
+             *  and optionally add its value to the margins in the same traversal. Trees are
+             *  iterated in the outer loop as in PredictBatchRaw.
+             * \param block dense feature vectors of the block
+             * \param nrow number of rows in use, starting at row 0 of the block
+             * \param tree_begin first tree to use
+             * \param tree_end one past the last tree to use
+             * \param format what is reported for a leaf, see LeafIndexFormat
+             * \param out_leaf leaf of row r in tree i at out_leaf[r * leaf_stride + i - tree_begin]
+             * \param leaf_stride distance between the leaves of two rows
+             * \param out_margin margins of the block grouped by output group as in PredictBatchRaw,
+             *  accumulated from the float32 leaves, nullptr skips them
+             */
+            template<typename TIndex>
+            inline void PredictLeafRaw(const FVecBlock &block, size_t nrow,
+                                       unsigned tree_begin, unsigned tree_end,
+                                       LeafIndexFormat format, TIndex *out_leaf, size_t leaf_stride,
+                                       bst_float *out_margin) const {
+                for (size_t i = tree_begin; i < tree_end; ++i) {
+                    const FlatTree tree = forest[i];
+                    TIndex *leaf = out_leaf + (i - tree_begin);
+                    bst_float *out = out_margin == nullptr ? nullptr : out_margin + tree_info[i] * nrow;
+                    forest.Prefetch(i + 1);
+                    for (size_t r = 0; r < nrow; ++r) {
+                        int nid = tree.GetLeafIndex(block.row(r));
+                        leaf[r * leaf_stride] = static_cast<TIndex>(forest.LeafIndex(i, nid, format));
+                        if (out != nullptr) out[r] += tree[nid].leaf_value();
+                    }
+                }
+            }
 
+            /*!
+             * \brief add the leaf values of trees [tree_begin, tree_end) to the margins of rows
+             *  that have every feature, so the kernels skip the missing value checks
+             * \param rows num_dense_feature() values per row, one row after another
+             * \param nrow number of rows
+             * \param tree_begin first tree to use
+             * \param tree_end one past the last tree to use
+             * \param out_margin margins of the rows grouped by output group as in PredictBatchRaw
+             */
+            inline void PredictDenseRaw(const bst_float *rows, size_t nrow,
+                                        unsigned tree_begin, unsigned tree_end,
+                                        bst_float *out_margin) const {
+                // a float has the layout of an entry that is present
+                const FVec::Entry* entries = reinterpret_cast<const FVec::Entry*>(rows);
+                const size_t stride = num_dense_feature();
+                if (UseCompactLeaves()) {
+                    for (size_t i = tree_begin; i < tree_end; ++i) {
+                        bst_float *out = out_margin + tree_info[i] * nrow;
+                        for (size_t r = 0; r < nrow; ++r) {
+                            out[r] += compact_leaves.Predict(i, entries + r * stride);
+                        }
+                    }
+                    return;
+                }
                 for (size_t i = tree_begin; i < tree_end; ++i) {
-                    // bst_group = 1, for binary classification
-                    // default root_index=0
-                    int tid = trees[i]->GetLeafIndex(feats);
-                    psum += (*trees[i])[tid].leaf_value();
+                    bst_float *out = out_margin + tree_info[i] * nrow;
+                    forest.Prefetch(i + 1);
+                    size_t r = 0;
+                    // the unrolled kernels are on par with the gather kernels on complete
+                    // trees, the gather kernels serve the others
+                    if (!use_unrolled || !unrolled.has_kernel(i)) {
+                        r = simd::PredictTree(simd_level, forest.nodes() + forest.offset(i),
+                                              entries, stride, nrow, out);
+                    }
+                    this->PredictRows(i, true, entries + r * stride, stride, nrow - r, out + r, 1);
+                }
+            }
+
+            /*!
+             * \brief add the leaf value of tree i to the margins of rows, through the unrolled
+             *  kernel of the tree if it has one and the flat tree otherwise
+             * \param i index of the tree
+             * \param dense whether the rows are known to have no missing values
+             * \param rows entries of the dense feature vector of the first row
+             * \param row_stride distance between the entries of two rows
+             * \param nrow number of rows
+             * \param out margin of the first row
+             * \param out_stride distance between the margins of two rows
+             */
+            inline void PredictRows(size_t i, bool dense, const FVec::Entry *rows, size_t row_stride,
+                                    size_t nrow, bst_float *out, size_t out_stride) const {
+                if (use_unrolled && unrolled.Predict(i, dense, rows, row_stride, nrow, out, out_stride)) {
+                    return;
+                }
+                const FlatTree tree = forest[i];
+                for (size_t r = 0; r < nrow; ++r) {
+                    out[r * out_stride] += tree.Predict(rows + r * row_stride);
                 }
-                return psum;
             }
 
 
@@ -102,12 +803,64 @@ namespace xgboost {
             bst_float base_margin;
             // model parameter
             GBTreeModelParam param;
-            /*! \brief vector of trees stored in the model */
+            /*! \brief vector of trees stored in the model, empty if a compiled model was loaded */
             std::vector <std::unique_ptr<RegTree>> trees;
             /*! \brief for the update process, a place to keep the initial trees */
             //std::vector<std::unique_ptr<RegTree> > trees_to_update;
-            /*! \brief some information indicator of the tree, reserved */
+            /*! \brief output group of each tree */
             std::vector<int> tree_info;
+            /*! \brief packed inference layout of all trees, used by prediction */
+            FlatForest forest;
+            /*! \brief layout of the trees for feature contributions, empty if a compiled model was loaded */
+            ShapForest shap;
+            /*! \brief trees of each output group in increasing order */
+            std::vector<std::vector<unsigned> > group_trees;
+            /*! \brief sum of the smallest leaf of the first k trees of group g, at [g][k] */
+            std::vector<std::vector<double> > leaf_min_prefix;
+            /*! \brief sum of the largest leaf of the first k trees of group g, at [g][k] */
+            std::vector<std::vector<double> > leaf_max_prefix;
+            /*! \brief sum of the largest absolute leaf of the first k trees of group g, at [g][k] */
+            std::vector<std::vector<double> > leaf_abs_prefix;
+            /*! \brief instruction set used by batch prediction */
+            simd::Level simd_level;
+            /*! \brief engine of batch prediction */
+            BatchEngine batch_engine;
+            /*! \brief bitvector evaluation of the forest, empty if some tree has too many leaves */
+            QuickScorer quick_scorer;
+            /*! \brief whether QuickScorer is used when the forest qualifies */
+            bool use_quick_scorer;
+            /*! \brief code generated for this model by gbdt_codegen, nullptr if not linked in */
+            const CompiledForest* compiled;
+            /*! \brief whether compiled code is used when it is available */
+            bool use_compiled;
+            /*! \brief native code generated at load time, empty unless enabled */
+            JitForest jit;
+            /*! \brief whether the forest is translated by the JIT */
+            bool use_jit;
+            /*! \brief complete trees with traversal kernels specialized by depth */
+            UnrolledForest unrolled;
+            /*! \brief whether the unrolled kernels are used for the trees that have one */
+            bool use_unrolled;
+            /*! \brief forest on binned feature values, empty unless enabled and possible */
+            QuantizedForest quantized;
+            /*! \brief whether the quantized forest is used */
+            bool use_quantized;
+            /*! \brief forest with 16 bit leaves, empty unless leaf_precision asks for it */
+            CompactLeafForest compact_leaves;
+            /*! \brief storage format of leaves used for prediction */
+            LeafFormat leaf_format;
+            /*!
+             * \brief original id of each dense feature id, empty when the trees use the
+             *  feature ids of the model
+             */
+            std::vector<unsigned> used_feature;
+            /*!
+             * \brief dense id of each original feature id, num_dense_feature() for unused
+             *  features, empty when not remapped
+             */
+            std::vector<unsigned> feature_index;
+            /*! \brief whether the next load renumbers the features densely */
+            bool use_remap;
         };
     }  // namespace gbm
 }  // namespace xgboost
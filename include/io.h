@@ -0,0 +1,207 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file io.h
+ * \brief memory mapped model files and in-memory parsing
+ */
+#ifndef XGBOOST_IO_H_
+#define XGBOOST_IO_H_
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace xgboost {
+/*! \brief result of loading a model or parsing input data */
+    struct LoadStatus {
+        /*! \brief kind of failure */
+        enum Code {
+            /*! \brief the model was loaded */
+            kOk = 0,
+            /*! \brief the file could not be opened or read */
+            kIOError = 1,
+            /*! \brief the file ends inside a section */
+            kTruncated = 2,
+            /*! \brief a section holds values that cannot be a valid model */
+            kCorrupt = 3,
+            /*! \brief the file is valid but uses a format this library does not read */
+            kUnsupported = 4
+        };
+        /*! \brief kind of failure */
+        Code code;
+        /*! \brief description of the failure, empty on success */
+        std::string message;
+
+        LoadStatus() : code(kOk) {}
+
+        LoadStatus(Code code, const std::string& message) : code(code), message(message) {}
+
+        /*! \brief whether the model was loaded */
+        inline bool ok() const {
+            return code == kOk;
+        }
+
+        /*! \brief shorthand for a truncated section */
+        inline static LoadStatus Truncated(const std::string& section) {
+            return LoadStatus(kTruncated, "unexpected end of file in " + section);
+        }
+
+        /*! \brief shorthand for a corrupt section */
+        inline static LoadStatus Corrupt(const std::string& message) {
+            return LoadStatus(kCorrupt, message);
+        }
+    };
+
+/*!
+ * \brief read-only view of a whole file.
+ *
+ *  The file is memory mapped where the platform supports it, so processes
+ *  that load the same model share one page cache copy. Otherwise it is read
+ *  into a heap buffer. Either way data() is at least 64 byte aligned.
+ */
+    class MappedFile {
+    public:
+        MappedFile() : data_(nullptr), size_(0), mapped_(false) {}
+
+        ~MappedFile() {
+            this->Close();
+        }
+
+        /*!
+         * \brief map a file
+         * \param path path of the file
+         * \return whether the file could be opened
+         */
+        inline bool Open(const std::string& path) {
+            this->Close();
+#if !defined(_WIN32)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+            size_ = static_cast<size_t>(st.st_size);
+            if (size_ != 0) {
+                void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+                if (addr != MAP_FAILED) {
+                    data_ = static_cast<const char*>(addr);
+                    mapped_ = true;
+                }
+            }
+            ::close(fd);
+            if (mapped_ || size_ == 0) return true;
+#endif
+            return this->ReadAll(path);
+        }
+
+        /*! \brief unmap the file */
+        inline void Close() {
+#if !defined(_WIN32)
+            if (mapped_) {
+                ::munmap(const_cast<char*>(data_), size_);
+            }
+#endif
+            buffer_.reset();
+            data_ = nullptr;
+            size_ = 0;
+            mapped_ = false;
+        }
+
+        /*! \brief content of the file */
+        inline const char* data() const {
+            return data_;
+        }
+
+        /*! \brief size of the file in bytes */
+        inline size_t size() const {
+            return size_;
+        }
+
+        /*! \brief whether the content is mapped rather than copied */
+        inline bool mapped() const {
+            return mapped_;
+        }
+
+    private:
+        // fallback when the file cannot be mapped
+        inline bool ReadAll(const std::string& path) {
+            std::ifstream ifile(path, std::ios::binary | std::ios::in);
+            if (!ifile) return false;
+            ifile.seekg(0, std::ios::end);
+            size_ = static_cast<size_t>(ifile.tellg());
+            ifile.seekg(0, std::ios::beg);
+            buffer_.reset(new char[size_ + kAlignment]);
+            size_t addr = reinterpret_cast<size_t>(buffer_.get());
+            char* data = buffer_.get() + (kAlignment - addr % kAlignment) % kAlignment;
+            if (!ifile.read(data, size_)) {
+                this->Close();
+                return false;
+            }
+            data_ = data;
+            return true;
+        }
+
+        static const size_t kAlignment = 64;
+        const char* data_;
+        size_t size_;
+        bool mapped_;
+        std::unique_ptr<char[]> buffer_;
+    };
+
+/*! \brief sequential reader over a memory buffer */
+    class MemoryStream {
+    public:
+        MemoryStream(const char* data, size_t size) : data_(data), size_(size), pos_(0) {}
+
+        /*!
+         * \brief copy the next n bytes
+         * \param dst destination buffer
+         * \param n number of bytes
+         * \return whether n bytes were available, nothing is read otherwise
+         */
+        inline bool Read(void* dst, size_t n) {
+            const char* src = this->Skip(n);
+            if (src == nullptr) return false;
+            if (n != 0) std::memcpy(dst, src, n);
+            return true;
+        }
+
+        /*!
+         * \brief advance over the next n bytes without copying
+         * \param n number of bytes
+         * \return pointer to the skipped bytes, nullptr if fewer than n bytes are left
+         */
+        inline const char* Skip(size_t n) {
+            if (n > size_ - pos_) return nullptr;
+            const char* ptr = data_ + pos_;
+            pos_ += n;
+            return ptr;
+        }
+
+        /*! \brief current position */
+        inline size_t Tell() const {
+            return pos_;
+        }
+
+        /*! \brief number of bytes left */
+        inline size_t Remaining() const {
+            return size_ - pos_;
+        }
+
+    private:
+        const char* data_;
+        size_t size_;
+        size_t pos_;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_IO_H_
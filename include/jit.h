@@ -0,0 +1,210 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file jit.h
+ * \brief just-in-time compilation of a forest into x86-64 machine code
+ */
+#ifndef XGBOOST_JIT_H_
+#define XGBOOST_JIT_H_
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "compiled_forest.h"
+#include "flat_tree.h"
+
+/*! \brief whether the x86-64 JIT is compiled in */
+#ifndef XGBOOST_USE_JIT
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define XGBOOST_USE_JIT 1
+#else
+#define XGBOOST_USE_JIT 0
+#endif
+#endif
+
+#if XGBOOST_USE_JIT
+#include <sys/mman.h>
+#endif
+
+namespace xgboost {
+/*!
+ * \brief a forest translated into native code at load time.
+ *
+ *  Every internal node becomes a compare-and-branch sequence with the split
+ *  feature offset and threshold as immediates: the feature word is checked
+ *  against the missing flag, then compared with ucomiss, and the left child
+ *  follows in place. Leaves add their value to the margin of the tree group.
+ *  The generated function has the signature of CompiledForest::PredictFunction
+ *  and gives bit identical margins to the interpreter. Code is written to
+ *  anonymous memory which is then made executable and no longer writable.
+ */
+    class JitForest {
+    public:
+        JitForest() : predict_(nullptr), code_size_(0) {}
+
+        /*!
+         * \brief compile the forest
+         * \param forest the compiled forest
+         * \param tree_group output group of each tree
+         * \return whether native code is available, false leaves the interpreter in charge
+         */
+        inline bool Build(const FlatForest& forest, const std::vector<int>& tree_group) {
+            this->Clear();
+#if XGBOOST_USE_JIT
+            code_.clear();
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                if (!this->EmitTree(forest[i], tree_group[i])) return false;
+            }
+            Emit8(0xC3);  // ret
+            return this->Install();
+#else
+            return false;
+#endif
+        }
+
+        /*! \brief release the native code */
+        inline void Clear() {
+            code_.clear();
+            holder_.reset();
+            predict_ = nullptr;
+            code_size_ = 0;
+        }
+
+        /*! \brief the native function, nullptr if the forest was not compiled */
+        inline CompiledForest::PredictFunction function() const {
+            return predict_;
+        }
+
+        /*! \brief bytes of native code */
+        inline size_t code_size() const {
+            return code_size_;
+        }
+
+    private:
+#if XGBOOST_USE_JIT
+        // rdi: feature entries, rsi: margins, rdx: group stride
+        inline bool EmitTree(const FlatTree& tree, int group) {
+            // r8 = rsi + group * stride * 4, the margin the leaves add to
+            Emit(0x48, 0x89, 0xD0);  // mov rax, rdx
+            Emit(0x48, 0x69, 0xC0);  // imul rax, rax, imm32
+            Emit32(static_cast<uint32_t>(group));
+            Emit(0x4C, 0x8D, 0x04);  // lea r8, [rsi + rax * 4]
+            Emit8(0x86);
+            std::vector<size_t> exits;
+            if (!this->EmitNode(tree, 0, &exits)) return false;
+            for (size_t pos : exits) {
+                this->Patch(pos, code_.size());
+            }
+            return true;
+        }
+
+        inline bool EmitNode(const FlatTree& tree, int nid, std::vector<size_t>* exits) {
+            const FlatTree::Node& node = tree[nid];
+            if (node.is_leaf()) {
+                Emit(0xF3, 0x41, 0x0F);  // movss xmm0, [r8]
+                Emit(0x10, 0x00);
+                Emit8(0xB9);  // mov ecx, imm32
+                Emit32(FloatBits(node.leaf_value()));
+                Emit(0x66, 0x0F, 0x6E);  // movd xmm1, ecx
+                Emit8(0xC9);
+                Emit(0xF3, 0x0F, 0x58);  // addss xmm0, xmm1
+                Emit8(0xC1);
+                Emit(0xF3, 0x41, 0x0F);  // movss [r8], xmm0
+                Emit(0x11, 0x00);
+                Emit8(0xE9);  // jmp rel32 to the end of the tree
+                exits->push_back(code_.size());
+                Emit32(0);
+                return true;
+            }
+            // feature offsets are 32 bit displacements
+            if (node.split_index() >= (1U << 29)) return false;
+            Emit(0x8B, 0x87);  // mov eax, [rdi + disp32]
+            Emit32(node.split_index() * 4);
+            Emit(0x83, 0xF8, 0xFF);  // cmp eax, -1
+            Emit(0x0F, 0x84);  // je rel32 to the default child
+            size_t missing = code_.size();
+            Emit32(0);
+            Emit(0x66, 0x0F, 0x6E);  // movd xmm0, eax
+            Emit8(0xC0);
+            Emit8(0xB9);  // mov ecx, imm32
+            Emit32(FloatBits(node.split_cond()));
+            Emit(0x66, 0x0F, 0x6E);  // movd xmm1, ecx
+            Emit8(0xC9);
+            // go right unless cond > fvalue, which also sends NaN right
+            Emit(0x0F, 0x2E, 0xC8);  // ucomiss xmm1, xmm0
+            Emit(0x0F, 0x86);  // jbe rel32 to the right child
+            size_t right = code_.size();
+            Emit32(0);
+            size_t left_begin = code_.size();
+            if (!this->EmitNode(tree, node.cleft(nid), exits)) return false;
+            this->Patch(right, code_.size());
+            this->Patch(missing, node.default_left() ? left_begin : code_.size());
+            return this->EmitNode(tree, node.cright(), exits);
+        }
+
+        // copy the code into executable memory
+        inline bool Install() {
+            size_t size = code_.size();
+            void* mem = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (mem == MAP_FAILED) return false;
+            std::memcpy(mem, &code_[0], size);
+            if (::mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+                ::munmap(mem, size);
+                return false;
+            }
+            holder_ = std::shared_ptr<void>(mem, [size](void* p) { ::munmap(p, size); });
+            predict_ = reinterpret_cast<CompiledForest::PredictFunction>(mem);
+            code_size_ = size;
+            code_.clear();
+            code_.shrink_to_fit();
+            return true;
+        }
+
+        // set the rel32 operand at pos to jump to target
+        inline void Patch(size_t pos, size_t target) {
+            int32_t rel = static_cast<int32_t>(static_cast<int64_t>(target) -
+                                               static_cast<int64_t>(pos + 4));
+            std::memcpy(&code_[pos], &rel, sizeof(rel));
+        }
+
+        inline static uint32_t FloatBits(bst_float value) {
+            uint32_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            return bits;
+        }
+
+        inline void Emit8(uint8_t byte) {
+            code_.push_back(byte);
+        }
+
+        inline void Emit(uint8_t b0, uint8_t b1) {
+            Emit8(b0);
+            Emit8(b1);
+        }
+
+        inline void Emit(uint8_t b0, uint8_t b1, uint8_t b2) {
+            Emit8(b0);
+            Emit8(b1);
+            Emit8(b2);
+        }
+
+        inline void Emit32(uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                Emit8(static_cast<uint8_t>(value >> (8 * i)));
+            }
+        }
+#endif  // XGBOOST_USE_JIT
+
+        // machine code being emitted
+        std::vector<uint8_t> code_;
+        // owns the executable mapping
+        std::shared_ptr<void> holder_;
+        // entry point of the native code
+        CompiledForest::PredictFunction predict_;
+        // bytes of native code
+        size_t code_size_;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_JIT_H_
@@ -0,0 +1,391 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file libsvm_parser.h
+ * \brief multi-threaded parser of libsvm text into CSR batches
+ */
+#ifndef XGBOOST_LIBSVM_PARSER_H_
+#define XGBOOST_LIBSVM_PARSER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include "fvec.h"
+#include "io.h"
+#include "thread_pool.h"
+
+namespace xgboost {
+/*! \brief rows in compressed sparse row format with their labels, the input of PredictBatch */
+    struct CSRBatch {
+        /*! \brief row i occupies [row_ptr[i], row_ptr[i + 1]) of col_idx and values */
+        std::vector<size_t> row_ptr;
+        /*! \brief feature index of each stored entry */
+        std::vector<unsigned> col_idx;
+        /*! \brief feature value of each stored entry */
+        std::vector<bst_float> values;
+        /*! \brief label of each row */
+        std::vector<bst_float> labels;
+
+        CSRBatch() : row_ptr(1, 0) {}
+
+        /*! \brief number of rows */
+        inline size_t num_row() const {
+            return labels.size();
+        }
+
+        /*! \brief remove all rows, the buffers keep their capacity */
+        inline void Clear() {
+            row_ptr.resize(1);
+            row_ptr[0] = 0;
+            col_idx.clear();
+            values.clear();
+            labels.clear();
+        }
+    };
+
+/*!
+ * \brief parser of libsvm text: one row per line, a label followed by index:value pairs.
+ *
+ *  An instance weight attached to the label (label:weight) and qid:id tokens are
+ *  skipped, text after # is a comment and lines without a label are ignored.
+ *  Numbers are parsed in place: a decimal with at most 24 significant bits and
+ *  a power of ten within float range is computed exactly with one float
+ *  multiply or divide, anything else goes through strtof, so values are the
+ *  ones strtof gives. Text is cut into chunks at line boundaries that are
+ *  parsed in parallel on a thread pool and concatenated in order. The chunk
+ *  buffers are kept between calls, so parsing blocks of similar size does not
+ *  allocate once the buffers have grown.
+ */
+    class LibSVMParser {
+    public:
+        /*!
+         * \brief create the parser
+         * \param pool thread pool that parses the chunks, nullptr parses on the calling thread
+         */
+        explicit LibSVMParser(std::shared_ptr<ThreadPool> pool = nullptr) : pool_(std::move(pool)) {}
+
+        /*! \brief share a thread pool, nullptr parses on the calling thread */
+        inline void SetThreadPool(std::shared_ptr<ThreadPool> pool) {
+            pool_ = std::move(pool);
+        }
+
+        /*!
+         * \brief parse text made of whole lines, the last one may lack its newline
+         * \param data the text
+         * \param size bytes of text
+         * \param out receives the rows, its previous content is replaced
+         * \param first_line number of the first line of the text in error messages
+         * \return kCorrupt with the line number of the first malformed line, out is then undefined
+         */
+        inline LoadStatus Parse(const char* data, size_t size, CSRBatch* out, size_t first_line = 1) {
+            size_t nthread = pool_ ? static_cast<size_t>(pool_->num_threads()) : 1;
+            // a few chunks per thread balance uneven lines, small texts are not split
+            size_t nchunk = std::min(nthread * 4, size / kMinChunkBytes);
+            if (nthread == 1 || nchunk <= 1) {
+                size_t nline = 0;
+                const char* bad_line = nullptr;
+                out->Clear();
+                bool ok = ParseChunk(data, data + size, out, &nline, &bad_line);
+                num_line_ = nline;
+                if (!ok) return Malformed(first_line + nline - 1, bad_line, data + size);
+                return LoadStatus();
+            }
+            if (chunks_.size() < nchunk) chunks_.resize(nchunk);
+            std::vector<size_t>& bound = bound_;
+            bound.assign(nchunk + 1, size);
+            bound[0] = 0;
+            for (size_t k = 1; k < nchunk; ++k) {
+                bound[k] = std::max(bound[k - 1], NextLine(data, size, size / nchunk * k));
+            }
+            pool_->ParallelFor(nchunk, [&](size_t k, int) {
+                Chunk& chunk = chunks_[k];
+                chunk.rows.Clear();
+                chunk.nline = 0;
+                chunk.bad_line = nullptr;
+                ParseChunk(data + bound[k], data + bound[k + 1], &chunk.rows, &chunk.nline,
+                           &chunk.bad_line);
+            });
+            size_t line = first_line, nrow = 0, nentry = 0;
+            num_line_ = 0;
+            std::vector<size_t>& row_begin = row_begin_;
+            std::vector<size_t>& entry_begin = entry_begin_;
+            row_begin.resize(nchunk);
+            entry_begin.resize(nchunk);
+            for (size_t k = 0; k < nchunk; ++k) {
+                const Chunk& chunk = chunks_[k];
+                if (chunk.bad_line != nullptr) {
+                    num_line_ += chunk.nline;
+                    return Malformed(line + chunk.nline - 1, chunk.bad_line, data + size);
+                }
+                line += chunk.nline;
+                num_line_ += chunk.nline;
+                row_begin[k] = nrow;
+                entry_begin[k] = nentry;
+                nrow += chunk.rows.num_row();
+                nentry += chunk.rows.col_idx.size();
+            }
+            out->row_ptr.resize(nrow + 1);
+            out->col_idx.resize(nentry);
+            out->values.resize(nentry);
+            out->labels.resize(nrow);
+            out->row_ptr[0] = 0;
+            pool_->ParallelFor(nchunk, [&](size_t k, int) {
+                const CSRBatch& rows = chunks_[k].rows;
+                std::copy(rows.col_idx.begin(), rows.col_idx.end(), out->col_idx.begin() + entry_begin[k]);
+                std::copy(rows.values.begin(), rows.values.end(), out->values.begin() + entry_begin[k]);
+                std::copy(rows.labels.begin(), rows.labels.end(), out->labels.begin() + row_begin[k]);
+                for (size_t i = 0; i < rows.num_row(); ++i) {
+                    out->row_ptr[row_begin[k] + i + 1] = entry_begin[k] + rows.row_ptr[i + 1];
+                }
+            });
+            return LoadStatus();
+        }
+
+        /*! \brief number of lines read by the last Parse, up to the malformed one on failure */
+        inline size_t num_line() const {
+            return num_line_;
+        }
+
+        /*!
+         * \brief parse a whole libsvm file
+         * \param path path of the file
+         * \param out receives the rows
+         */
+        inline LoadStatus ParseFile(const std::string& path, CSRBatch* out) {
+            MappedFile file;
+            if (!file.Open(path)) {
+                return LoadStatus(LoadStatus::kIOError, "cannot open " + path);
+            }
+            return this->Parse(file.data(), file.size(), out);
+        }
+
+        /*!
+         * \brief offset of the line following the one that holds data[pos], size if none
+         * \param data the text
+         * \param size bytes of text
+         * \param pos offset in the text
+         */
+        inline static size_t NextLine(const char* data, size_t size, size_t pos) {
+            if (pos >= size) return size;
+            const void* eol = std::memchr(data + pos, '\n', size - pos);
+            return eol == nullptr ? size : static_cast<const char*>(eol) - data + 1;
+        }
+
+        /*!
+         * \brief parse a float that ends at a blank, ':', '#' or end
+         * \param p first character
+         * \param end end of the line
+         * \param out the value, as strtof would give it
+         * \return the character after the number, nullptr if there is no number
+         */
+        inline static const char* ParseFloat(const char* p, const char* end, bst_float* out) {
+            const char* begin = p;
+            bool negative = false;
+            if (p != end && (*p == '-' || *p == '+')) {
+                negative = *p == '-';
+                ++p;
+            }
+            uint64_t mantissa = 0;
+            int ndigit = 0, exp10 = 0;
+            bool any_digit = false;
+            for (; p != end && IsDigit(*p); ++p) {
+                any_digit = true;
+                if (mantissa == 0 && *p == '0') continue;
+                if (++ndigit > kMaxDigits) break;
+                mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+            }
+            if (p != end && *p == '.') {
+                for (++p; p != end && IsDigit(*p); ++p) {
+                    any_digit = true;
+                    if (mantissa == 0 && *p == '0') {
+                        --exp10;
+                        continue;
+                    }
+                    if (++ndigit > kMaxDigits) break;
+                    mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+                    --exp10;
+                }
+            }
+            if (any_digit && ndigit <= kMaxDigits && p != end && (*p == 'e' || *p == 'E')) {
+                const char* q = p + 1;
+                bool exp_negative = false;
+                if (q != end && (*q == '-' || *q == '+')) {
+                    exp_negative = *q == '-';
+                    ++q;
+                }
+                int e = 0;
+                const char* exp_begin = q;
+                for (; q != end && IsDigit(*q) && e < 10000; ++q) {
+                    e = e * 10 + (*q - '0');
+                }
+                if (q != exp_begin) {
+                    exp10 += exp_negative ? -e : e;
+                    p = q;
+                }
+            }
+            if (any_digit && ndigit <= kMaxDigits && IsDelimiter(p, end) &&
+                mantissa <= (1U << 24) && exp10 >= -kMaxExp10 && exp10 <= kMaxExp10) {
+                // both operands are exact, so the single rounding of the result is the one of strtof
+                bst_float value = static_cast<bst_float>(mantissa);
+                value = exp10 < 0 ? value / Pow10(-exp10) : value * Pow10(exp10);
+                *out = negative ? -value : value;
+                return p;
+            }
+            return ParseFloatSlow(begin, end, out);
+        }
+
+        /*!
+         * \brief parse an unsigned 32 bit integer
+         * \param p first character
+         * \param end end of the line
+         * \param out the value
+         * \return the character after the number, nullptr if there is no number or it overflows
+         */
+        inline static const char* ParseUInt(const char* p, const char* end, unsigned* out) {
+            uint64_t value = 0;
+            const char* begin = p;
+            for (; p != end && IsDigit(*p); ++p) {
+                value = value * 10 + static_cast<unsigned>(*p - '0');
+                if (value > 0xFFFFFFFFULL) return nullptr;
+            }
+            if (p == begin) return nullptr;
+            *out = static_cast<unsigned>(value);
+            return p;
+        }
+
+    private:
+        /*! \brief rows of one chunk */
+        struct Chunk {
+            CSRBatch rows;
+            // lines read, up to and including the malformed one
+            size_t nline = 0;
+            // first malformed line, nullptr if every line was parsed
+            const char* bad_line = nullptr;
+        };
+
+        // parse the lines of [p, end) into rows, stops at the first malformed line
+        inline static bool ParseChunk(const char* p, const char* end, CSRBatch* rows, size_t* nline,
+                                      const char** bad_line) {
+            while (p != end) {
+                const void* nl = std::memchr(p, '\n', end - p);
+                const char* eol = nl == nullptr ? end : static_cast<const char*>(nl);
+                ++*nline;
+                if (!ParseLine(p, eol, rows)) {
+                    *bad_line = p;
+                    return false;
+                }
+                p = nl == nullptr ? end : eol + 1;
+            }
+            return true;
+        }
+
+        // error of a malformed line, quoting its beginning
+        inline static LoadStatus Malformed(size_t line, const char* p, const char* end) {
+            const char* eol = p;
+            while (eol != end && *eol != '\n' && eol - p < 64) ++eol;
+            return LoadStatus::Corrupt("line " + std::to_string(line) + ": malformed libsvm row: " +
+                                       std::string(p, eol));
+        }
+
+        // append the row of line [p, eol), a line without label adds no row
+        inline static bool ParseLine(const char* p, const char* eol, CSRBatch* rows) {
+            p = SkipBlank(p, eol);
+            if (p == eol || *p == '#') return true;
+            bst_float label;
+            p = ParseFloat(p, eol, &label);
+            if (p == nullptr) return false;
+            if (p != eol && *p == ':') {
+                bst_float weight;
+                p = ParseFloat(p + 1, eol, &weight);
+                if (p == nullptr) return false;
+            }
+            while (true) {
+                const char* token = SkipBlank(p, eol);
+                if (token == p && token != eol && *token != '#') return false;
+                p = token;
+                if (p == eol || *p == '#') break;
+                if (eol - p > 4 && std::memcmp(p, "qid:", 4) == 0) {
+                    unsigned qid;
+                    p = ParseUInt(p + 4, eol, &qid);
+                    if (p == nullptr) return false;
+                    continue;
+                }
+                unsigned index;
+                bst_float value;
+                p = ParseUInt(p, eol, &index);
+                if (p == nullptr || p == eol || *p != ':') return false;
+                p = ParseFloat(p + 1, eol, &value);
+                if (p == nullptr) return false;
+                rows->col_idx.push_back(index);
+                rows->values.push_back(value);
+            }
+            rows->labels.push_back(label);
+            rows->row_ptr.push_back(rows->col_idx.size());
+            return true;
+        }
+
+        // numbers the fast path does not take: long mantissas, large exponents, inf and nan
+        inline static const char* ParseFloatSlow(const char* p, const char* end, bst_float* out) {
+            const char* q = p;
+            while (!IsDelimiter(q, end)) ++q;
+            if (q == p || static_cast<size_t>(q - p) >= kMaxTokenBytes) return nullptr;
+            char token[kMaxTokenBytes];
+            std::memcpy(token, p, q - p);
+            token[q - p] = '\0';
+            char* parsed;
+            *out = std::strtof(token, &parsed);
+            if (parsed != token + (q - p)) return nullptr;
+            return q;
+        }
+
+        inline static bool IsDigit(char c) {
+            return static_cast<unsigned>(c - '0') < 10U;
+        }
+
+        inline static bool IsBlank(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        inline static bool IsDelimiter(const char* p, const char* end) {
+            return p == end || IsBlank(*p) || *p == ':' || *p == '#';
+        }
+
+        inline static const char* SkipBlank(const char* p, const char* end) {
+            while (p != end && IsBlank(*p)) ++p;
+            return p;
+        }
+
+        // exact powers of ten in float, 10^10 is the largest whose odd part fits 24 bits
+        inline static bst_float Pow10(int e) {
+            static const bst_float kPow10[kMaxExp10 + 1] = {
+                1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+            };
+            return kPow10[e];
+        }
+
+        // chunks are at least this long, so small texts are parsed on one thread
+        static const size_t kMinChunkBytes = 1 << 16;
+        // mantissa digits the fast path accumulates before giving up
+        static const int kMaxDigits = 9;
+        // largest power of ten of the fast path
+        static const int kMaxExp10 = 10;
+        // longest number handed to strtof
+        static const size_t kMaxTokenBytes = 64;
+
+        // parses the chunks
+        std::shared_ptr<ThreadPool> pool_;
+        // rows of each chunk, kept for the next call
+        std::vector<Chunk> chunks_;
+        // text offset where each chunk starts, and its first row and entry in the output
+        std::vector<size_t> bound_;
+        std::vector<size_t> row_begin_;
+        std::vector<size_t> entry_begin_;
+        // lines read by the last Parse
+        size_t num_line_ = 0;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_LIBSVM_PARSER_H_
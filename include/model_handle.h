@@ -0,0 +1,263 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file model_handle.h
+ * \brief hot swappable model shared by concurrent predictions
+ */
+#ifndef XGBOOST_MODEL_HANDLE_H_
+#define XGBOOST_MODEL_HANDLE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "base.h"
+#include "logging.h"
+#include "predictor.h"
+#include "thread_pool.h"
+
+namespace xgboost {
+/*!
+ * \brief a model that can be replaced while predictions are running.
+ *
+ *  Readers pin the current predictor in a hazard slot: the pointer is
+ *  published into a free slot with a compare-and-swap and read again to
+ *  make sure it is still current, so the read path takes no lock. A new
+ *  model is loaded and compiled off the read path, then swapped in
+ *  atomically. The old predictor is retired and deleted once no slot
+ *  holds it, which is checked on every publish and by Reclaim.
+ *  All versions share one thread pool for batch prediction.
+ */
+    class ModelHandle {
+    public:
+        /*! \brief number of hazard slots, bounds the number of concurrent readers */
+        static const size_t kNumSlots = 128;
+
+        /*! \brief a pinned predictor, the model stays alive until the snapshot is destroyed */
+        class Snapshot {
+        public:
+            Snapshot() : slot_(nullptr), pred_(nullptr) {}
+
+            Snapshot(Snapshot&& other) : slot_(other.slot_), pred_(other.pred_) {
+                other.slot_ = nullptr;
+                other.pred_ = nullptr;
+            }
+
+            Snapshot(const Snapshot&) = delete;
+            Snapshot& operator=(const Snapshot&) = delete;
+
+            ~Snapshot() {
+                if (slot_ != nullptr) slot_->store(nullptr);
+            }
+
+            /*! \brief whether a model is pinned */
+            inline explicit operator bool() const {
+                return pred_ != nullptr;
+            }
+
+            inline const Predictor* operator->() const {
+                return pred_;
+            }
+
+            inline const Predictor& operator*() const {
+                return *pred_;
+            }
+
+        private:
+            friend class ModelHandle;
+
+            Snapshot(std::atomic<const Predictor*>* slot, const Predictor* pred)
+                : slot_(slot), pred_(pred) {}
+
+            std::atomic<const Predictor*>* slot_;
+            const Predictor* pred_;
+        };
+
+        ModelHandle() : current_(nullptr), version_(0) {
+            for (size_t i = 0; i < kNumSlots; ++i) {
+                slots_[i].ptr.store(nullptr);
+            }
+        }
+
+        /*! \brief all snapshots must have been released */
+        ~ModelHandle() {
+            delete current_.load();
+            retired_.clear();
+        }
+
+        /*!
+         * \brief set parameters applied to every model loaded from now on
+         *  nthread creates the thread pool shared by all versions, the other
+         *  parameters are passed to Predictor::Configure
+         * \param cfg configurations as key value pairs
+         */
+        void Configure(const std::vector<std::pair<std::string, std::string> >& cfg) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            for (const auto& kv : cfg) {
+                if (kv.first == "nthread") {
+                    int nthread = std::atoi(kv.second.c_str());
+                    pool_.reset();
+                    if (nthread != 1) {
+                        pool_ = std::make_shared<ThreadPool>(nthread);
+                    }
+                } else {
+                    cfg_.push_back(kv);
+                }
+            }
+        }
+
+        /*!
+         * \brief load and compile a model, then publish it. Readers keep using the
+         *  previous version until the new one is published, a failed load keeps it.
+         * \param model_path path of the model file
+         * \return status of the load
+         */
+        LoadStatus Load(const std::string& model_path) {
+            std::unique_ptr<Predictor> pred(new Predictor());
+            {
+                std::lock_guard<std::mutex> lock(write_mutex_);
+                pred->Configure(cfg_);
+                pred->SetThreadPool(pool_);
+            }
+            LoadStatus status = pred->Load(model_path);
+            if (status.ok()) {
+                this->Publish(std::move(pred));
+            }
+            return status;
+        }
+
+        /*!
+         * \brief make a loaded predictor the current model
+         * \param pred the new model, owned by the handle from now on
+         */
+        void Publish(std::unique_ptr<Predictor> pred) {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            const Predictor* old = current_.exchange(pred.release());
+            ++version_;
+            if (old != nullptr) {
+                retired_.emplace_back(old);
+            }
+            this->ReclaimLocked();
+        }
+
+        /*!
+         * \brief pin the current model, the read path is lock free
+         * \return the snapshot, empty if no model was published
+         */
+        Snapshot Acquire() const {
+            const Predictor* pred = current_.load();
+            if (pred == nullptr) return Snapshot();
+            static thread_local size_t hint =
+                std::hash<std::thread::id>()(std::this_thread::get_id()) % kNumSlots;
+            for (size_t i = hint;; ++i) {
+                std::atomic<const Predictor*>& slot = slots_[i % kNumSlots].ptr;
+                const Predictor* expected = nullptr;
+                if (slot.load() != nullptr || !slot.compare_exchange_strong(expected, pred)) {
+                    if ((i + 1 - hint) % kNumSlots == 0) std::this_thread::yield();
+                    continue;
+                }
+                // the writer scans the slots after swapping the model, so a pointer
+                // that is still current after it was published here is protected
+                const Predictor* now = current_.load();
+                if (now == pred) {
+                    hint = i % kNumSlots;
+                    return Snapshot(&slot, pred);
+                }
+                slot.store(nullptr);
+                if (now == nullptr) return Snapshot();
+                pred = now;
+            }
+        }
+
+        /*! \brief predict one instance with the current model, see Predictor::Predict */
+        float Predict(const std::unordered_map<size_t, bst_float>* feats,
+                      bool output_margin, unsigned ntree_limit) const {
+            Snapshot model = this->Acquire();
+            CHECK(model) << "ModelHandle: no model loaded";
+            return model->Predict(feats, output_margin, ntree_limit);
+        }
+
+        /*! \brief predict one instance into a buffer with the current model, see Predictor::Predict */
+        void Predict(const std::unordered_map<size_t, bst_float>* feats, bst_float* out_preds,
+                     bool output_margin, unsigned ntree_limit) const {
+            Snapshot model = this->Acquire();
+            CHECK(model) << "ModelHandle: no model loaded";
+            model->Predict(feats, out_preds, output_margin, ntree_limit);
+        }
+
+        /*! \brief predict a CSR batch with the current model, see Predictor::PredictBatch */
+        void PredictBatch(const size_t* row_ptr, const unsigned* col_idx, const bst_float* values,
+                          size_t num_row, bst_float* out_preds, bool output_margin,
+                          unsigned ntree_limit) const {
+            Snapshot model = this->Acquire();
+            CHECK(model) << "ModelHandle: no model loaded";
+            model->PredictBatch(row_ptr, col_idx, values, num_row, out_preds, output_margin,
+                                ntree_limit);
+        }
+
+        /*! \brief delete retired models that are no longer pinned */
+        void Reclaim() {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            this->ReclaimLocked();
+        }
+
+        /*! \brief number of models published so far */
+        inline size_t version() const {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            return version_;
+        }
+
+        /*! \brief number of replaced models still waiting for readers to finish */
+        inline size_t num_retired() const {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            return retired_.size();
+        }
+
+    private:
+        // a hazard slot on its own cache line
+        struct alignas(64) Slot {
+            std::atomic<const Predictor*> ptr;
+        };
+
+        // delete retired models not held by any slot, write_mutex_ must be held
+        inline void ReclaimLocked() {
+            if (retired_.empty()) return;
+            std::vector<const Predictor*> pinned;
+            for (size_t i = 0; i < kNumSlots; ++i) {
+                const Predictor* pred = slots_[i].ptr.load();
+                if (pred != nullptr) pinned.push_back(pred);
+            }
+            size_t kept = 0;
+            for (size_t i = 0; i < retired_.size(); ++i) {
+                if (std::find(pinned.begin(), pinned.end(), retired_[i].get()) != pinned.end()) {
+                    std::swap(retired_[kept++], retired_[i]);
+                }
+            }
+            retired_.resize(kept);
+        }
+
+        // the published model
+        std::atomic<const Predictor*> current_;
+        // pointers pinned by readers
+        mutable Slot slots_[kNumSlots];
+        // serializes writers
+        mutable std::mutex write_mutex_;
+        // replaced models that may still be pinned
+        std::vector<std::unique_ptr<const Predictor> > retired_;
+        // number of models published so far
+        size_t version_;
+        // configuration applied to loaded models
+        std::vector<std::pair<std::string, std::string> > cfg_;
+        // thread pool shared by all versions
+        std::shared_ptr<ThreadPool> pool_;
+
+        DISALLOW_COPY_AND_ASSIGN(ModelHandle);
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_MODEL_HANDLE_H_
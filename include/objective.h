@@ -0,0 +1,172 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file objective.h
+ * \brief output transforms of the objective functions a model can be trained with
+ */
+#ifndef XGBOOST_OBJECTIVE_H_
+#define XGBOOST_OBJECTIVE_H_
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "base.h"
+#include "simd_math.h"
+
+namespace xgboost {
+/*!
+ * \brief turns the margins of a model into predictions, selected by the
+ *  objective name stored in the model
+ */
+    class ObjFunction {
+    public:
+        /*! \brief function creating an objective */
+        typedef std::function<ObjFunction*()> Factory;
+
+        virtual ~ObjFunction() {}
+
+        /*!
+         * \brief number of predictions per instance
+         * \param ngroup number of margins per instance
+         */
+        virtual size_t NumOutput(size_t ngroup) const {
+            return ngroup;
+        }
+
+        /*!
+         * \brief transform the margins of a batch of instances
+         * \param margin margins, ngroup per instance
+         * \param num_row number of instances
+         * \param ngroup number of margins per instance
+         * \param out_preds NumOutput(ngroup) predictions per instance, may alias margin
+         */
+        virtual void PredTransform(const bst_float* margin, size_t num_row, size_t ngroup,
+                                   bst_float* out_preds) const = 0;
+
+        /*!
+         * \brief create the objective registered under a name
+         * \param name objective name, e.g. binary:logistic
+         * \return the objective, nullptr if the name is unknown
+         */
+        inline static ObjFunction* Create(const std::string& name) {
+            auto it = Registry().find(name);
+            return it == Registry().end() ? nullptr : it->second();
+        }
+
+        /*!
+         * \brief register an objective, replacing an existing one of the same name
+         * \param name objective name
+         * \param factory function creating the objective
+         */
+        inline static void Register(const std::string& name, Factory factory) {
+            Registry()[name] = factory;
+        }
+
+    private:
+        inline static std::unordered_map<std::string, Factory>& Registry();
+    };
+
+/*! \brief margins are the predictions, e.g. regression with squared error and ranking */
+    class IdentityObj : public ObjFunction {
+    public:
+        void PredTransform(const bst_float* margin, size_t num_row, size_t ngroup,
+                           bst_float* out_preds) const override {
+            if (out_preds != margin) std::copy(margin, margin + num_row * ngroup, out_preds);
+        }
+    };
+
+/*! \brief probability of logistic regression */
+    class LogisticObj : public ObjFunction {
+    public:
+        void PredTransform(const bst_float* margin, size_t num_row, size_t ngroup,
+                           bst_float* out_preds) const override {
+            simd::Sigmoid(margin, num_row * ngroup, out_preds);
+        }
+    };
+
+/*! \brief the margin is a log, e.g. of the poisson mean or the gamma scale */
+    class ExpObj : public ObjFunction {
+    public:
+        void PredTransform(const bst_float* margin, size_t num_row, size_t ngroup,
+                           bst_float* out_preds) const override {
+            simd::Exp(margin, num_row * ngroup, out_preds);
+        }
+    };
+
+/*! \brief class label of the hinge loss */
+    class HingeObj : public ObjFunction {
+    public:
+        void PredTransform(const bst_float* margin, size_t num_row, size_t ngroup,
+                           bst_float* out_preds) const override {
+            for (size_t i = 0; i < num_row * ngroup; ++i) {
+                out_preds[i] = margin[i] > 0.0f ? 1.0f : 0.0f;
+            }
+        }
+    };
+
+/*!
+ * \brief multi-class classification, softmax probabilities of the classes
+ *  or, when output_prob is false, the index of the most likely class
+ */
+    class SoftmaxMultiClassObj : public ObjFunction {
+    public:
+        explicit SoftmaxMultiClassObj(bool output_prob) : output_prob_(output_prob) {}
+
+        size_t NumOutput(size_t ngroup) const override {
+            return output_prob_ ? ngroup : 1;
+        }
+
+        void PredTransform(const bst_float* margin, size_t num_row, size_t ngroup,
+                           bst_float* out_preds) const override {
+            for (size_t i = 0; i < num_row; ++i) {
+                const bst_float* row = margin + i * ngroup;
+                size_t best = std::max_element(row, row + ngroup) - row;
+                if (!output_prob_) {
+                    out_preds[i] = static_cast<bst_float>(best);
+                    continue;
+                }
+                bst_float wmax = row[best];
+                bst_float* out = out_preds + i * ngroup;
+                for (size_t g = 0; g < ngroup; ++g) {
+                    out[g] = row[g] - wmax;
+                }
+                simd::Exp(out, ngroup, out);
+                bst_float wsum = 0.0f;
+                for (size_t g = 0; g < ngroup; ++g) {
+                    wsum += out[g];
+                }
+                for (size_t g = 0; g < ngroup; ++g) {
+                    out[g] /= wsum;
+                }
+            }
+        }
+
+    private:
+        bool output_prob_;
+    };
+
+    inline std::unordered_map<std::string, ObjFunction::Factory>& ObjFunction::Registry() {
+        static std::unordered_map<std::string, Factory> registry = [] {
+            std::unordered_map<std::string, Factory> reg;
+            for (const char* name : {"reg:linear", "reg:squarederror", "reg:squaredlogerror",
+                                     "reg:pseudohubererror", "reg:absoluteerror", "binary:logitraw",
+                                     "rank:pairwise", "rank:ndcg", "rank:map"}) {
+                reg[name] = [] { return new IdentityObj(); };
+            }
+            for (const char* name : {"reg:logistic", "binary:logistic"}) {
+                reg[name] = [] { return new LogisticObj(); };
+            }
+            for (const char* name : {"count:poisson", "reg:gamma", "reg:tweedie", "survival:cox"}) {
+                reg[name] = [] { return new ExpObj(); };
+            }
+            reg["binary:hinge"] = [] { return new HingeObj(); };
+            reg["multi:softprob"] = [] { return new SoftmaxMultiClassObj(true); };
+            reg["multi:softmax"] = [] { return new SoftmaxMultiClassObj(false); };
+            return reg;
+        }();
+        return registry;
+    }
+}  // namespace xgboost
+
+#endif  // XGBOOST_OBJECTIVE_H_
@@ -8,6 +8,10 @@
 #define XGBOOST_PREDICTOR_H
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <iomanip>
 #include <limits>
@@ -17,7 +21,12 @@
 #include <vector>
 #include <unordered_map>
 #include <fstream>
+#include <functional>
+#include "codegen.h"
 #include "gbtree_model.h"
+#include "io.h"
+#include "objective.h"
+#include "thread_pool.h"
 #include "tree_model.h"
 
 namespace xgboost {
@@ -43,6 +52,33 @@ namespace xgboost {
     };
 
 
+/*!
+ * \brief partial prediction of one instance, advanced a range of trees at a time with
+ *  Predictor::ContinuePrediction. The instance is kept as the dense feature vector
+ *  the trees read, so continuing only walks the trees not evaluated yet.
+ */
+    class PredictionState {
+    public:
+        /*! \brief number of trees evaluated so far, trees [0, num_tree_done()) */
+        inline unsigned num_tree_done() const {
+            return tree_end_;
+        }
+
+        /*! \brief margins over the trees evaluated so far, one per output group */
+        inline const std::vector<bst_float>& margin() const {
+            return margin_;
+        }
+
+    private:
+        friend class Predictor;
+        // dense features of the instance, indexed as the trees read them
+        FVec feats_;
+        // base margin plus the leaves of the trees evaluated so far
+        std::vector<bst_float> margin_;
+        // one past the last tree evaluated
+        unsigned tree_end_ = 0;
+    };
+
 /*!
  * \brief learner that performs gradient boosting for a specific objective
  * function. It does training and prediction.
@@ -52,86 +88,1158 @@ namespace xgboost {
 
         void InitModel() {}
 
-		int Load(const std::string& model_path) {
-            // TODO: add exception handling
-            std::ifstream ifile(model_path, std::ios::binary|std::ios::in);
-            if (!ifile) {
-                std::cout << "read file error: " << model_path << std::endl;
-            }
-            {
-                ifile.read((char*)&mparam, sizeof(mparam));
-                uint64_t len;
-                ifile.read((char*)&len, sizeof(len));
-                if (len >= std::numeric_limits<unsigned>::max()) {
-                    std::cerr << "len is too large: " << len << std::endl;
-                    int gap;
-                    ifile.read((char*)&gap, sizeof(gap));
-                    len = len >> static_cast<uint64_t>(32UL);
-                }
-                
-                if (len != 0) {
-                    std::cout << "name_obj len: " << len << std::endl;
-                    name_obj_.resize(len);
-                    ifile.read((char*)&name_obj_[0], len);
-                    std::cout << "name_obj: " << name_obj_ << std::endl;
-                }
-                // TODO: check size               
-                ifile.read((char*)&len, sizeof(len));
-                std::cout << "name gbm length: " << len << std::endl;
-                name_gbm_.resize(len);
-                ifile.read((char*)&name_gbm_[0], len);
-                std::cout << "gbm name: " << name_gbm_ << std::endl;
-                gbm_.reset(new gbm::GBTreeModel(mparam.base_score));
-                gbm_->Load(ifile);
-                
-            }
-            ifile.close();
-        }
-        
+        /*!
+         * \brief set parameters of the predictor, can be called before or after Load
+         *  supported parameters:
+         *    nthread: number of threads used by batch prediction, <= 0 means all cores
+         *    tree_shard_size: split batch prediction and interaction values over shards of
+         *      this many trees, 0 disables
+         *  other parameters are passed on to the gbm, see GBTreeModel::Configure
+         * \param cfg configurations as key value pairs
+         */
+        void Configure(const std::vector<std::pair<std::string, std::string> >& cfg) {
+            cfg_.insert(cfg_.end(), cfg.begin(), cfg.end());
+            if (ModelInitialized()) {
+                gbm_->Configure(cfg);
+            }
+            for (const auto& kv : cfg) {
+                if (kv.first == "nthread") {
+                    int nthread = std::atoi(kv.second.c_str());
+                    pool_.reset();
+                    if (nthread != 1) {
+                        pool_ = std::make_shared<ThreadPool>(nthread);
+                    }
+                } else if (kv.first == "tree_shard_size") {
+                    tree_shard_size_ = static_cast<unsigned>(std::atoi(kv.second.c_str()));
+                }
+            }
+        }
+
+        /*!
+         * \brief share a thread pool between predictors, nullptr predicts on the calling thread
+         * \param pool the thread pool used by batch prediction
+         */
+        void SetThreadPool(std::shared_ptr<ThreadPool> pool) {
+            pool_ = std::move(pool);
+        }
+
+        /*! \brief number of threads used by batch prediction */
+        inline int NumThreads() const {
+            return pool_ ? pool_->num_threads() : 1;
+        }
+
+        /*!
+         * \brief load an xgboost binary model or a compiled model, see SaveCompiled.
+         *  Every section is checked against the size of the file and the trees are
+         *  validated before use. On failure the previously loaded model, if any, is kept.
+         * \param model_path path of the model file
+         * \return status of the load with a description of the failure
+         */
+        LoadStatus Load(const std::string& model_path) {
+            std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+            if (!file->Open(model_path)) {
+                return LoadStatus(LoadStatus::kIOError, "cannot read model file " + model_path);
+            }
+            MemoryStream fi(file->data(), file->size());
+            LoadStatus status;
+            if (file->size() >= kCompiledMagicSize &&
+                std::memcmp(file->data(), CompiledMagic(), kCompiledMagicSize) == 0) {
+                fi.Skip(kCompiledMagicSize);
+                status = this->LoadCompiled(fi, file);
+            } else {
+                status = this->LoadBinary(fi);
+            }
+            if (!status.ok()) {
+                status.message = model_path + ": " + status.message;
+            }
+            return status;
+        }
 
+        /*!
+         * \brief save the model in the compiled inference format. Load maps such a file
+         *  and predicts from the mapped nodes directly, so workers loading the same
+         *  file share one page cache copy and skip parsing and compiling the trees.
+         *  The format is tied to the byte order and version of this library.
+         * \param model_path path of the output file
+         */
+        int SaveCompiled(const std::string& model_path) const {
+            std::ofstream fo(model_path, std::ios::binary | std::ios::out);
+            if (!fo) return -1;
+            uint32_t header[2] = {kCompiledVersion, 0};
+            fo.write(CompiledMagic(), kCompiledMagicSize);
+            fo.write(reinterpret_cast<const char*>(header), sizeof(header));
+            fo.write(reinterpret_cast<const char*>(&mparam), sizeof(mparam));
+            for (const std::string* name : {&name_obj_, &name_gbm_}) {
+                uint64_t len = name->length();
+                fo.write(reinterpret_cast<const char*>(&len), sizeof(len));
+                fo.write(name->data(), len);
+            }
+            gbm_->SaveCompiled(fo);
+            return fo ? 0 : -1;
+        }
 
         inline float Sigmoid(float x) const {
             return 1.0f / (1.0f + std::exp(-x));
         }
-		
-		float Predict(const std::unordered_map<uint64_t, bst_float>* feats,
+
+		float Predict(const std::unordered_map<size_t, bst_float>* feats,
 				bool output_margin, unsigned ntree_limit) const {
-			FVec fvec;
-			fvec.Set(feats);
-			return PredictFVec(fvec, output_margin, ntree_limit);
+			CHECK_EQ(NumOutput(output_margin), 1U)
+				<< "model has several outputs per instance, predict into a buffer";
+			float pred;
+			Predict(feats, &pred, output_margin, ntree_limit);
+			return pred;
 		}
 
-        inline float PredictFVec(FVec &feats,
+        /*!
+         * \brief predict one instance
+         * \param feats sparse features of the instance
+         * \param out_preds caller provided buffer that receives NumOutput(output_margin) predictions
+         * \param output_margin whether to output the raw margins
+         * \param ntree_limit limit number of boosting rounds used for prediction, 0 means all
+         */
+        void Predict(const std::unordered_map<size_t, bst_float>* feats, bst_float* out_preds,
+                     bool output_margin, unsigned ntree_limit) const {
+            // dense scratch is kept all-missing between calls, so each
+            // call only touches the entries of the given instance
+            static thread_local FVec fvec;
+            if (fvec.size() < gbm_->num_fill_feature()) {
+                fvec.Init(gbm_->num_fill_feature());
+            }
+            if (gbm_->remapped()) {
+                fvec.Fill(*feats, gbm_->feature_index);
+                PredictInstance(fvec, out_preds, output_margin, ntree_limit);
+                fvec.Drop(*feats, gbm_->feature_index);
+            } else {
+                fvec.Fill(*feats);
+                PredictInstance(fvec, out_preds, output_margin, ntree_limit);
+                fvec.Drop(*feats);
+            }
+        }
+
+        /*! \brief number of features a dense FVec needs to hold for this model */
+        inline size_t NumFeature() const {
+            return static_cast<size_t>(gbm_->param.num_feature);
+        }
+
+        /*!
+         * \brief number of predictions per instance: one margin or probability per
+         *  output group, except multi:softmax that predicts the class index
+         */
+        inline size_t NumOutput(bool output_margin) const {
+            size_t ngroup = gbm_->num_output_group();
+            return output_margin ? ngroup : obj_->NumOutput(ngroup);
+        }
+
+        inline float PredictFVec(const FVec &feats,
                       bool output_margin,
                       unsigned ntree_limit) const {
-            if (ntree_limit == 0 || ntree_limit > gbm_->trees.size()) {
-                ntree_limit = static_cast<unsigned>(gbm_->trees.size());
+            float pred;
+            PredictFVec(feats, &pred, output_margin, ntree_limit);
+            return pred;
+        }
+
+        /*!
+         * \brief predict one dense feature vector indexed by the feature ids of the model
+         *  into NumOutput(output_margin) predictions
+         */
+        inline void PredictFVec(const FVec &feats, bst_float* out_preds,
+                                bool output_margin, unsigned ntree_limit) const {
+            if (gbm_->remapped()) {
+                static thread_local FVec dense;
+                dense.Gather(feats.entries(), feats.size(), gbm_->used_feature);
+                PredictInstance(dense, out_preds, output_margin, ntree_limit);
+            } else {
+                PredictInstance(feats, out_preds, output_margin, ntree_limit);
             }
+        }
 
-            float predict_val = gbm_->PredictInstanceRaw(feats, 0, ntree_limit);
+        /*!
+         * \brief start a prediction that is evaluated a range of trees at a time
+         * \param feats sparse features of the instance
+         * \param state receives the instance with no tree evaluated, can be reused
+         */
+        void BeginPrediction(const std::unordered_map<size_t, bst_float>* feats,
+                             PredictionState* state) const {
+            state->feats_.Init(gbm_->num_fill_feature());
+            if (gbm_->remapped()) {
+                state->feats_.Fill(*feats, gbm_->feature_index);
+            } else {
+                state->feats_.Fill(*feats);
+            }
+            state->margin_.assign(gbm_->num_output_group(), gbm_->base_margin);
+            state->tree_end_ = 0;
+        }
+
+        /*!
+         * \brief start a prediction that is evaluated a range of trees at a time
+         * \param feats dense feature vector indexed by the feature ids of the model
+         * \param state receives the instance with no tree evaluated, can be reused
+         */
+        void BeginPrediction(const FVec& feats, PredictionState* state) const {
+            if (gbm_->remapped()) {
+                state->feats_.Gather(feats.entries(), feats.size(), gbm_->used_feature);
+            } else {
+                state->feats_ = feats;
+            }
+            state->margin_.assign(gbm_->num_output_group(), gbm_->base_margin);
+            state->tree_end_ = 0;
+        }
+
+        /*!
+         * \brief evaluate the trees of a started prediction up to the first ntree_limit
+         *  rounds. Trees are added one after another, so the margins do not depend on
+         *  where the evaluation paused, and after the last tree they are those of
+         *  Predict up to rounding when compiled code or QuickScorer serve Predict.
+         * \param state prediction started by BeginPrediction
+         * \param ntree_limit number of boosting rounds to reach, 0 means all
+         */
+        void ContinuePrediction(PredictionState* state, unsigned ntree_limit) const {
+            const unsigned ntree = TreeLimit(ntree_limit);
+            if (state->tree_end_ >= ntree) return;
+            gbm_->AccumulateInstanceRaw(state->feats_, state->tree_end_, ntree, state->margin_.data());
+            state->tree_end_ = ntree;
+        }
+
+        /*!
+         * \brief range the margin of an output group can end in after the first ntree_limit
+         *  rounds, given the trees evaluated so far and the smallest and largest leaf of
+         *  each remaining tree, which are summed at load; up to the float rounding of
+         *  adding the remaining trees
+         * \param state prediction started by BeginPrediction
+         * \param group output group
+         * \param ntree_limit number of boosting rounds of the final margin, 0 means all
+         * \param lower receives the smallest final margin
+         * \param upper receives the largest final margin
+         */
+        void MarginBounds(const PredictionState& state, size_t group, unsigned ntree_limit,
+                          double* lower, double* upper) const {
+            const unsigned ntree = TreeLimit(ntree_limit);
+            *lower = *upper = state.margin_[group];
+            if (state.tree_end_ >= ntree) return;
+            double rest_lower, rest_upper;
+            gbm_->LeafBounds(group, state.tree_end_, ntree, &rest_lower, &rest_upper);
+            *lower += rest_lower;
+            *upper += rest_upper;
+        }
+
+        /*!
+         * \brief decide whether the margin of a single output model reaches a threshold,
+         *  evaluating trees only until the remaining ones cannot change the answer, so
+         *  instances far from the threshold stop early. The answer is that of the full
+         *  margin, up to its float rounding.
+         * \param state prediction started by BeginPrediction, left where the decision was made
+         * \param threshold margin to compare with, e.g. the logit of a probability
+         * \param ntree_limit number of boosting rounds of the full margin, 0 means all
+         * \param check_rounds number of rounds evaluated between two checks of the bounds
+         * \return whether the margin over the first ntree_limit rounds is at least threshold
+         */
+        bool PredictAbove(PredictionState* state, bst_float threshold, unsigned ntree_limit = 0,
+                          unsigned check_rounds = 1) const {
+            CHECK_EQ(gbm_->num_output_group(), 1U)
+                << "early exit compares a single margin, the model has several output groups";
+            const unsigned ntree = TreeLimit(ntree_limit);
+            const unsigned step = std::max(check_rounds, 1U);
+            while (state->tree_end_ < ntree) {
+                double lower, upper;
+                gbm_->LeafBounds(0, state->tree_end_, ntree, &lower, &upper);
+                if (state->margin_[0] + lower >= threshold) return true;
+                if (state->margin_[0] + upper < threshold) return false;
+                unsigned tree_end = ntree - state->tree_end_ > step ? state->tree_end_ + step : ntree;
+                gbm_->AccumulateInstanceRaw(state->feats_, state->tree_end_, tree_end,
+                                            state->margin_.data());
+                state->tree_end_ = tree_end;
+            }
+            return state->margin_[0] >= threshold;
+        }
+
+        /*!
+         * \brief predictions of the trees evaluated so far
+         * \param state prediction started by BeginPrediction
+         * \param out_preds caller provided buffer that receives NumOutput(output_margin) predictions
+         * \param output_margin whether to output the raw margins
+         */
+        void GetPrediction(const PredictionState& state, bst_float* out_preds,
+                           bool output_margin) const {
+            if (output_margin) {
+                std::copy(state.margin_.begin(), state.margin_.end(), out_preds);
+            } else {
+                PredTransform(state.margin_.data(), 1, out_preds);
+            }
+        }
+
+        /*!
+         * \brief predict a batch of rows stored in CSR format
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of rows in the batch
+         * \param out_preds caller provided buffer that receives num_row * NumOutput(output_margin)
+         *  predictions, the predictions of row i start at out_preds[i * NumOutput(output_margin)]
+         * \param output_margin whether to output the raw margin
+         * \param ntree_limit limit number of boosting rounds used for prediction, 0 means all
+         */
+        void PredictBatch(const size_t* row_ptr,
+                          const unsigned* col_idx,
+                          const bst_float* values,
+                          size_t num_row,
+                          bst_float* out_preds,
+                          bool output_margin,
+                          unsigned ntree_limit) const {
+            const size_t ngroup = gbm_->num_output_group();
+            std::vector<bst_float> margin_buf;
+            bst_float* margin = out_preds;
+            if (NumOutput(output_margin) != ngroup) {
+                margin_buf.resize(num_row * ngroup);
+                margin = margin_buf.data();
+            }
+            PredictBatchMargin(row_ptr, col_idx, values, num_row, margin, ntree_limit);
             if (!output_margin) {
-                return Sigmoid(predict_val);
+                PredTransform(margin, num_row, out_preds);
+            }
+        }
+
+        /*!
+         * \brief predict a batch of dense rows in which every feature is present. Trees that
+         *  are complete enough use kernels compiled without the missing value check, so
+         *  this is faster than PredictBatch for such input. A NaN value goes right as in
+         *  the other predict functions.
+         * \param values num_row rows of NumFeature() values, one row after another
+         * \param num_row number of rows
+         * \param out_preds caller provided buffer that receives num_row * NumOutput(output_margin)
+         *  predictions, laid out as in PredictBatch
+         * \param output_margin whether to output the raw margin
+         * \param ntree_limit limit number of boosting rounds used for prediction, 0 means all
+         */
+        void PredictDense(const bst_float* values, size_t num_row, bst_float* out_preds,
+                          bool output_margin, unsigned ntree_limit) const {
+            const size_t ngroup = gbm_->num_output_group();
+            std::vector<bst_float> margin_buf;
+            bst_float* margin = out_preds;
+            if (NumOutput(output_margin) != ngroup) {
+                margin_buf.resize(num_row * ngroup);
+                margin = margin_buf.data();
+            }
+            const unsigned ntree = TreeLimit(ntree_limit);
+            const size_t block_rows = kMaxBatchBlockRows;
+            const size_t nblock = (num_row + block_rows - 1) / block_rows;
+            std::vector<std::vector<bst_float> > thread_margin(ngroup > 1 ? NumThreads() : 0);
+            // rows reduced to the features the trees split on, when they are remapped
+            std::vector<std::vector<bst_float> > thread_rows(gbm_->remapped() ? NumThreads() : 0);
+            ParallelFor(nblock, [&](size_t task, int tid) {
+                size_t begin = task * block_rows;
+                size_t nrow = std::min(block_rows, num_row - begin);
+                const bst_float* rows = values + begin * NumFeature();
+                if (gbm_->remapped()) {
+                    const std::vector<unsigned>& used = gbm_->used_feature;
+                    std::vector<bst_float>& dense = thread_rows[tid];
+                    dense.resize(block_rows * used.size());
+                    for (size_t i = 0; i < nrow; ++i) {
+                        for (size_t k = 0; k < used.size(); ++k) {
+                            dense[i * used.size() + k] = rows[i * NumFeature() + used[k]];
+                        }
+                    }
+                    rows = dense.data();
+                }
+                bst_float* dst = margin + begin * ngroup;
+                bst_float* out = dst;
+                if (ngroup > 1) {
+                    thread_margin[tid].resize(block_rows * ngroup);
+                    out = thread_margin[tid].data();
+                }
+                std::fill(out, out + nrow * ngroup, gbm_->base_margin);
+                gbm_->PredictDenseRaw(rows, nrow, 0, ntree, out);
+                if (ngroup > 1) {
+                    for (size_t g = 0; g < ngroup; ++g) {
+                        for (size_t i = 0; i < nrow; ++i) {
+                            dst[i * ngroup + g] = out[g * nrow + i];
+                        }
+                    }
+                }
+            });
+            if (!output_margin) {
+                PredTransform(margin, num_row, out_preds);
+            }
+        }
+
+        /*!
+         * \brief margin intervals of a CSR batch after evaluating a prefix of the rounds: the
+         *  margins of the prefix plus the smallest and the largest leaves of the remaining
+         *  trees, which are summed at load. The interval is widened by the worst float
+         *  rounding of the prefix and of the final margin, see
+         *  GBTreeModel::AccumulationError, and rounded outwards to float, so the final
+         *  margin over the first ntree_limit rounds lies in it whatever engine sums it.
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of rows in the batch
+         * \param prefix_rounds number of boosting rounds evaluated, 0 gives the bounds of the model
+         * \param out_lower caller provided buffer of num_row * NumOutput(true) lower bounds,
+         *  laid out as the margins of PredictBatch
+         * \param out_upper caller provided buffer of num_row * NumOutput(true) upper bounds
+         * \param ntree_limit number of boosting rounds of the final margin, 0 means all
+         */
+        void PredictMarginInterval(const size_t* row_ptr, const unsigned* col_idx,
+                                   const bst_float* values, size_t num_row, unsigned prefix_rounds,
+                                   bst_float* out_lower, bst_float* out_upper,
+                                   unsigned ntree_limit = 0) const {
+            const size_t ngroup = gbm_->num_output_group();
+            const unsigned ntree = TreeLimit(ntree_limit);
+            const unsigned rounds = ntree_limit != 0 ? std::min(prefix_rounds, ntree_limit) : prefix_rounds;
+            const unsigned prefix = rounds == 0 ? 0 : TreeLimit(rounds);
+            // the margins of the prefix are computed in place of the lower bounds
+            if (rounds == 0) {
+                std::fill(out_lower, out_lower + num_row * ngroup, gbm_->base_margin);
             } else {
-                return predict_val;
+                PredictBatchMargin(row_ptr, col_idx, values, num_row, out_lower, rounds);
+            }
+            for (size_t g = 0; g < ngroup; ++g) {
+                double rest_lower, rest_upper;
+                gbm_->LeafBounds(g, prefix, ntree, &rest_lower, &rest_upper);
+                const double slack = gbm_->AccumulationError(g, prefix) +
+                                     gbm_->AccumulationError(g, ntree);
+                for (size_t i = 0; i < num_row; ++i) {
+                    double margin = out_lower[i * ngroup + g];
+                    out_lower[i * ngroup + g] = RoundDown(margin + rest_lower - slack);
+                    out_upper[i * ngroup + g] = RoundUp(margin + rest_upper + slack);
+                }
+            }
+        }
+
+        /*!
+         * \brief the k candidates of a CSR batch with the largest margins, for a single output
+         *  model. Candidates are evaluated a stage of rounds at a time; after each stage the
+         *  ones whose margin interval, see PredictMarginInterval, ends below the k-th largest
+         *  lower bound cannot be among the k best and are dropped, so most candidates of a
+         *  large batch only see the first stages. The survivors are evaluated in full and
+         *  ranked, so the result is that of ranking PredictBatch margins, ties included.
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of candidates in the batch
+         * \param k number of candidates to select
+         * \param out_index receives min(k, num_row) candidates by decreasing margin, the
+         *  smaller index first on a tie
+         * \param out_margin nullptr, or receives the margins of the selected candidates
+         * \param ntree_limit limit number of boosting rounds used, 0 means all
+         * \param stage_rounds number of rounds between two prunings, 0 picks an eighth of them;
+         *  every stage fills the rows of the surviving candidates again, so short stages
+         *  only pay off on rows with few entries
+         * \return number of tree evaluations done, num_row * number of trees without pruning
+         */
+        size_t PredictTopK(const size_t* row_ptr, const unsigned* col_idx, const bst_float* values,
+                           size_t num_row, size_t k, std::vector<size_t>* out_index,
+                           std::vector<bst_float>* out_margin, unsigned ntree_limit = 0,
+                           unsigned stage_rounds = 0) const {
+            CHECK_EQ(gbm_->num_output_group(), 1U)
+                << "top-K ranks a single margin, the model has several output groups";
+            const unsigned ntree = TreeLimit(ntree_limit);
+            const unsigned stage = stage_rounds != 0 ? stage_rounds : std::max(ntree / 8, 1U);
+            const size_t block_rows = BatchBlockRows();
+            k = std::min(k, num_row);
+            std::vector<bst_float> margin(num_row, gbm_->base_margin);
+            // candidates not pruned yet, in increasing order
+            std::vector<size_t> alive(num_row);
+            for (size_t i = 0; i < num_row; ++i) alive[i] = i;
+            std::vector<double> lower;
+            std::vector<FVecBlock> thread_feats(NumThreads());
+            std::vector<std::vector<bst_float> > thread_margin(NumThreads());
+            size_t work = 0;
+
+            for (unsigned tree_begin = 0; k != 0 && tree_begin < ntree;) {
+                const unsigned tree_end = ntree - tree_begin > stage ? tree_begin + stage : ntree;
+                const size_t nalive = alive.size();
+                ParallelFor((nalive + block_rows - 1) / block_rows, [&](size_t task, int tid) {
+                    size_t begin = task * block_rows;
+                    size_t nrow = std::min(block_rows, nalive - begin);
+                    FVecBlock& feats = thread_feats[tid];
+                    if (feats.num_row() == 0) {
+                        feats.Init(block_rows, gbm_->num_fill_feature());
+                    }
+                    std::vector<bst_float>& out = thread_margin[tid];
+                    out.resize(block_rows);
+                    for (size_t i = 0; i < nrow; ++i) {
+                        FillRow(&feats, i, row_ptr, col_idx, values, alive[begin + i]);
+                        out[i] = margin[alive[begin + i]];
+                    }
+                    gbm_->PredictBatchRaw(feats, nrow, tree_begin, tree_end, out.data());
+                    for (size_t i = 0; i < nrow; ++i) {
+                        DropRow(&feats, i, row_ptr, col_idx, alive[begin + i]);
+                        margin[alive[begin + i]] = out[i];
+                    }
+                });
+                work += nalive * (tree_end - tree_begin);
+                tree_begin = tree_end;
+                if (tree_begin == ntree || nalive <= k) continue;
+                // drop the candidates that cannot reach the k-th largest lower bound, the
+                // bounds are widened by the rounding of the float margins as in
+                // PredictMarginInterval, so a candidate tied on the final margin survives
+                double rest_lower, rest_upper;
+                gbm_->LeafBounds(0, tree_begin, ntree, &rest_lower, &rest_upper);
+                const double slack = gbm_->AccumulationError(0, tree_begin) +
+                                     gbm_->AccumulationError(0, ntree);
+                rest_lower -= slack;
+                rest_upper += slack;
+                lower.resize(nalive);
+                for (size_t i = 0; i < nalive; ++i) lower[i] = margin[alive[i]] + rest_lower;
+                std::nth_element(lower.begin(), lower.begin() + (k - 1), lower.end(),
+                                 std::greater<double>());
+                const double kth_lower = lower[k - 1];
+                size_t nkeep = 0;
+                for (size_t i : alive) {
+                    if (margin[i] + rest_upper >= kth_lower) alive[nkeep++] = i;
+                }
+                alive.resize(nkeep);
+            }
+
+            std::partial_sort(alive.begin(), alive.begin() + k, alive.end(), [&](size_t a, size_t b) {
+                return margin[a] > margin[b] || (margin[a] == margin[b] && a < b);
+            });
+            out_index->assign(alive.begin(), alive.begin() + k);
+            if (out_margin != nullptr) {
+                out_margin->resize(k);
+                for (size_t i = 0; i < k; ++i) (*out_margin)[i] = margin[alive[i]];
+            }
+            return work;
+        }
+
+        /*!
+         * \brief the leaf each row of a CSR batch reaches in every tree, for models stacked
+         *  on the leaves. The margins, if asked for, come out of the same traversal.
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of rows in the batch
+         * \param out_leaf caller provided buffer of num_row * ntree leaves, ntree being the
+         *  number of trees in the first ntree_limit rounds, the leaf of row i in tree t is at
+         *  out_leaf[i * ntree + t]
+         * \param ntree_limit limit number of boosting rounds used, 0 means all
+         * \param format node ids as xgboost pred_leaf, ordinals within each tree or one-hot
+         *  columns, see LeafIndexFormat and NumLeafColumns
+         * \param out_margin nullptr, or a caller provided buffer of num_row * NumOutput(true)
+         *  margins, computed from the float32 leaves whatever leaf_precision is set
+         */
+        void PredictLeaf(const size_t* row_ptr, const unsigned* col_idx, const bst_float* values,
+                         size_t num_row, int32_t* out_leaf, unsigned ntree_limit,
+                         LeafIndexFormat format = kLeafNodeId, bst_float* out_margin = nullptr) const {
+            PredictLeafIndex(row_ptr, col_idx, values, num_row, out_leaf, TreeLimit(ntree_limit),
+                             format, out_margin);
+        }
+
+        /*!
+         * \brief the leaves of a CSR batch as one-hot rows in CSR format: row i has one entry
+         *  per tree, the column of its leaf among the NumLeafColumns(ntree_limit) leaves of
+         *  the trees, so it can be fed to a linear model as is
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of rows in the batch
+         * \param out_row_ptr receives the num_row + 1 row offsets of the one-hot rows
+         * \param out_col_idx receives the one-hot columns, increasing within each row
+         * \param out_values nullptr, or receives a 1 per entry
+         * \param ntree_limit limit number of boosting rounds used, 0 means all
+         * \param out_margin nullptr, or a buffer of margins as in PredictLeaf
+         */
+        void PredictLeafOneHot(const size_t* row_ptr, const unsigned* col_idx,
+                               const bst_float* values, size_t num_row,
+                               std::vector<size_t>* out_row_ptr, std::vector<unsigned>* out_col_idx,
+                               std::vector<bst_float>* out_values, unsigned ntree_limit,
+                               bst_float* out_margin = nullptr) const {
+            const unsigned ntree = TreeLimit(ntree_limit);
+            out_row_ptr->resize(num_row + 1);
+            for (size_t i = 0; i <= num_row; ++i) (*out_row_ptr)[i] = i * ntree;
+            out_col_idx->resize(num_row * ntree);
+            if (out_values != nullptr) out_values->assign(num_row * ntree, 1.0f);
+            PredictLeafIndex(row_ptr, col_idx, values, num_row, out_col_idx->data(), ntree,
+                             kLeafColumn, out_margin);
+        }
+
+        /*! \brief number of one-hot leaf columns of the first ntree_limit rounds, 0 means all */
+        inline size_t NumLeafColumns(unsigned ntree_limit) const {
+            return gbm_->forest.leaf_offset(TreeLimit(ntree_limit));
+        }
+
+        /*!
+         * \brief feature contributions of a batch of rows stored in CSR format: for each
+         *  output group, one value per feature that the margin owes to it and a last
+         *  column with the bias, so that a row sums to its margin. SHAP values are
+         *  computed by TreeSHAP, approximate ones by the Saabas method, which credits
+         *  each split on the decision path with the change of the node mean and costs
+         *  about as much as a prediction. Needs the trees of an xgboost binary model.
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of rows in the batch
+         * \param out_contribs caller provided buffer of num_row * ngroup * (NumFeature() + 1)
+         *  values with ngroup = NumOutput(true), the contribution of feature f to group g
+         *  of row i is at out_contribs[(i * ngroup + g) * (NumFeature() + 1) + f]
+         * \param ntree_limit limit number of boosting rounds used, 0 means all
+         * \param approximate whether to compute the Saabas approximation instead of SHAP values
+         */
+        void PredictContribution(const size_t* row_ptr, const unsigned* col_idx,
+                                 const bst_float* values, size_t num_row, bst_float* out_contribs,
+                                 unsigned ntree_limit, bool approximate = false) const {
+            const ShapForest& shap = gbm_->shap;
+            CHECK_EQ(shap.num_trees(), gbm_->num_trees())
+                << "feature contributions need the trees of an xgboost model, not a compiled model";
+            const unsigned ntree = TreeLimit(ntree_limit);
+            const size_t ngroup = gbm_->num_output_group();
+            const size_t ncolumn = NumFeature() + 1;
+            const size_t block_rows = ContributionBlockRows();
+            const size_t nblock = (num_row + block_rows - 1) / block_rows;
+            std::fill(out_contribs, out_contribs + num_row * ngroup * ncolumn, 0.0f);
+            // dense rows and path scratch, one per thread, sized once
+            std::vector<FVecBlock> thread_feats(NumThreads());
+            std::vector<std::vector<ShapForest::PathElement> > thread_path(NumThreads());
+
+            ParallelFor(nblock, [&](size_t task, int tid) {
+                size_t begin = task * block_rows;
+                size_t nrow = std::min(block_rows, num_row - begin);
+                FVecBlock& feats = thread_feats[tid];
+                std::vector<ShapForest::PathElement>& path = thread_path[tid];
+                if (feats.num_row() == 0) {
+                    feats.Init(block_rows, NumFeature());
+                    path.resize(shap.path_scratch_size());
+                }
+                for (size_t i = 0; i < nrow; ++i) {
+                    size_t ridx = begin + i;
+                    feats.Fill(i, col_idx + row_ptr[ridx], values + row_ptr[ridx],
+                               row_ptr[ridx + 1] - row_ptr[ridx]);
+                }
+                // tree by tree, so the nodes of a tree stay in cache across the rows of the block
+                bst_float* block_out = out_contribs + begin * ngroup * ncolumn;
+                for (unsigned t = 0; t < ntree; ++t) {
+                    const size_t group = static_cast<size_t>(gbm_->tree_info[t]);
+                    const bst_float expected = shap.expected_value(t);
+                    for (size_t i = 0; i < nrow; ++i) {
+                        bst_float* phi = block_out + (i * ngroup + group) * ncolumn;
+                        if (approximate) {
+                            shap.ApproxContributions(t, feats.row(i), phi);
+                        } else {
+                            shap.Contributions(t, feats.row(i), phi, path.data());
+                        }
+                        phi[ncolumn - 1] += expected;
+                    }
+                }
+                for (size_t i = 0; i < nrow; ++i) {
+                    size_t ridx = begin + i;
+                    feats.Drop(i, col_idx + row_ptr[ridx], row_ptr[ridx + 1] - row_ptr[ridx]);
+                    for (size_t g = 0; g < ngroup; ++g) {
+                        block_out[(i * ngroup + g) * ncolumn + ncolumn - 1] += gbm_->base_margin;
+                    }
+                }
+            });
+        }
+
+        /*!
+         * \brief SHAP interaction values of a batch of rows stored in CSR format: for each
+         *  output group a (NumFeature() + 1) square matrix whose entry (i, j), i != j,
+         *  holds half of the interaction between features i and j and whose diagonal
+         *  holds what is left of the contribution of each feature, so row i of the
+         *  matrix sums to the contribution of feature i and the bias is at the last
+         *  diagonal entry. A tree only conditions on the features it splits on, which
+         *  it keeps sorted, so a row costs 2 |features of the tree| + 1 TreeSHAP passes
+         *  per tree. With tree_shard_size set, the shards of trees of a block of rows
+         *  run as separate tasks and are reduced in shard order, which helps small
+         *  batches at the price of one output sized buffer per extra shard.
+         *  Needs the trees of an xgboost binary model.
+         * \param row_ptr row offsets, row i occupies [row_ptr[i], row_ptr[i + 1])
+         * \param col_idx feature index of each stored entry
+         * \param values feature value of each stored entry
+         * \param num_row number of rows in the batch
+         * \param out_interactions caller provided buffer of num_row * ngroup * ncolumn * ncolumn
+         *  values with ngroup = NumOutput(true) and ncolumn = NumFeature() + 1, entry (i, j)
+         *  of group g of row r is at out_interactions[((r * ngroup + g) * ncolumn + i) * ncolumn + j]
+         * \param ntree_limit limit number of boosting rounds used, 0 means all
+         */
+        void PredictInteractionContribution(const size_t* row_ptr, const unsigned* col_idx,
+                                            const bst_float* values, size_t num_row,
+                                            bst_float* out_interactions, unsigned ntree_limit) const {
+            const ShapForest& shap = gbm_->shap;
+            CHECK_EQ(shap.num_trees(), gbm_->num_trees())
+                << "feature contributions need the trees of an xgboost model, not a compiled model";
+            const unsigned ntree = TreeLimit(ntree_limit);
+            const size_t ngroup = gbm_->num_output_group();
+            const size_t ncolumn = NumFeature() + 1;
+            const size_t row_size = ngroup * ncolumn * ncolumn;
+            const size_t block_rows = ContributionBlockRows();
+            const size_t nblock = (num_row + block_rows - 1) / block_rows;
+            const unsigned shard_size = tree_shard_size_ == 0 || tree_shard_size_ > ntree ?
+                                        std::max(ntree, 1U) : tree_shard_size_;
+            const size_t nshard = std::max<size_t>(1, (ntree + shard_size - 1) / shard_size);
+            std::vector<bst_float> partial(nshard > 1 ? (nshard - 1) * num_row * row_size : 0);
+            std::fill(out_interactions, out_interactions + num_row * row_size, 0.0f);
+            // per thread arena: dense rows, path scratch and the SHAP values of one tree
+            // unconditioned, conditioned on a feature being present and being missing
+            struct Arena {
+                FVecBlock feats;
+                std::vector<ShapForest::PathElement> path;
+                std::vector<bst_float> phi, phi_on, phi_off;
+            };
+            std::vector<Arena> arenas(NumThreads());
+
+            ParallelFor(nblock * nshard, [&](size_t task, int tid) {
+                size_t begin = task / nshard * block_rows;
+                size_t shard = task % nshard;
+                size_t nrow = std::min(block_rows, num_row - begin);
+                Arena& arena = arenas[tid];
+                if (arena.feats.num_row() == 0) {
+                    arena.feats.Init(block_rows, NumFeature());
+                    arena.path.resize(shap.path_scratch_size());
+                    arena.phi.resize(ncolumn, 0.0f);
+                    arena.phi_on.resize(ncolumn, 0.0f);
+                    arena.phi_off.resize(ncolumn, 0.0f);
+                }
+                FVecBlock& feats = arena.feats;
+                bst_float* block_out = out_interactions + begin * row_size;
+                if (shard != 0) block_out = &partial[((shard - 1) * num_row + begin) * row_size];
+                for (size_t i = 0; i < nrow; ++i) {
+                    size_t ridx = begin + i;
+                    feats.Fill(i, col_idx + row_ptr[ridx], values + row_ptr[ridx],
+                               row_ptr[ridx + 1] - row_ptr[ridx]);
+                }
+                unsigned tree_begin = static_cast<unsigned>(shard * shard_size);
+                unsigned tree_end = std::min(ntree, tree_begin + shard_size);
+                for (unsigned t = tree_begin; t < tree_end; ++t) {
+                    const size_t group = static_cast<size_t>(gbm_->tree_info[t]);
+                    const unsigned* features = shap.split_features(t);
+                    const size_t nfeature = shap.num_split_features(t);
+                    const bst_float expected = shap.expected_value(t);
+                    for (size_t r = 0; r < nrow; ++r) {
+                        const FVec::Entry* row = feats.row(r);
+                        bst_float* matrix = block_out + (r * ngroup + group) * ncolumn * ncolumn;
+                        shap.Contributions(t, row, arena.phi.data(), arena.path.data());
+                        for (size_t a = 0; a < nfeature; ++a) {
+                            const unsigned fa = features[a];
+                            bst_float* line = matrix + fa * ncolumn;
+                            line[fa] += arena.phi[fa];
+                            arena.phi[fa] = 0.0f;
+                            shap.Contributions(t, row, arena.phi_on.data(), arena.path.data(), 1, fa);
+                            shap.Contributions(t, row, arena.phi_off.data(), arena.path.data(), -1, fa);
+                            // only the split features of the tree are written by the passes
+                            for (size_t b = 0; b < nfeature; ++b) {
+                                const unsigned fb = features[b];
+                                if (fb != fa) {
+                                    bst_float value = (arena.phi_on[fb] - arena.phi_off[fb]) / 2.0f;
+                                    line[fb] += value;
+                                    line[fa] -= value;
+                                }
+                                arena.phi_on[fb] = 0.0f;
+                                arena.phi_off[fb] = 0.0f;
+                            }
+                        }
+                        matrix[ncolumn * ncolumn - 1] += expected;
+                    }
+                }
+                for (size_t i = 0; i < nrow; ++i) {
+                    size_t ridx = begin + i;
+                    feats.Drop(i, col_idx + row_ptr[ridx], row_ptr[ridx + 1] - row_ptr[ridx]);
+                    for (size_t g = 0; shard == 0 && g < ngroup; ++g) {
+                        block_out[(i * ngroup + g + 1) * ncolumn * ncolumn - 1] += gbm_->base_margin;
+                    }
+                }
+            });
+            // reduce the shards in order, rows in parallel
+            if (nshard > 1) {
+                ParallelFor(nblock, [&](size_t task, int) {
+                    size_t begin = task * block_rows * row_size;
+                    size_t end = std::min(num_row, (task + 1) * block_rows) * row_size;
+                    for (size_t shard = 1; shard < nshard; ++shard) {
+                        const bst_float* src = &partial[(shard - 1) * num_row * row_size];
+                        for (size_t k = begin; k < end; ++k) out_interactions[k] += src[k];
+                    }
+                });
             }
         }
 
+        /*!
+         * \brief write C++ code evaluating the trees of the model, see codegen.h.
+         *  Linking the generated code into a program makes Load of this model
+         *  predict through it.
+         * \param os output stream of the generated source
+         */
+        void GenerateCode(std::ostream& os) const {
+            codegen::Generate(*gbm_, os);
+        }
+
+        /*! \brief whether the loaded model is evaluated by code generated with gbdt_codegen */
+        inline bool HasCompiledCode() const {
+            return gbm_->UseCompiled(0, static_cast<unsigned>(gbm_->num_trees()));
+        }
+
+        /*!
+         * \brief whether single predictions of the loaded model run native code, generated
+         *  with gbdt_codegen or translated by the JIT
+         */
+        inline bool HasNativeCode() const {
+            return !gbm_->UseCompactLeaves() &&
+                   gbm_->NativeForest(0, static_cast<unsigned>(gbm_->num_trees())) != nullptr;
+        }
+
+        /*!
+         * \brief bound on the margin error of leaves stored in 16 bits, up to the float
+         *  rounding of the sums, see leaf_precision; 0 when the leaves are fp32
+         */
+        inline bst_float MarginErrorBound() const {
+            return gbm_->UseCompactLeaves() ? gbm_->compact_leaves.max_margin_error() : 0.0f;
+        }
+
+        /*!
+         * \brief tree i as read from an xgboost binary model, compiled models keep no trees
+         * \param i index of the tree
+         */
+        inline const RegTree& GetTree(size_t i) const {
+            CHECK_LT(i, gbm_->trees.size()) << "no tree " << i << ", compiled models keep no trees";
+            return *gbm_->trees[i];
+        }
+
+        /*! \brief whether the trees of the loaded model split on densely renumbered features */
+        inline bool IsRemapped() const {
+            return gbm_->remapped();
+        }
+
+        /*! \brief whether the loaded model compares quantized bins instead of float thresholds */
+        inline bool IsQuantized() const {
+            return !gbm_->UseCompactLeaves() && gbm_->UseQuantized();
+        }
+
         void DumpModel() {
             std::cout << "base_score: " << mparam.base_score << std::endl;
             std::cout << "number_feature: " << mparam.num_feature << std::endl;
             std::cout << "number_class: " << mparam.num_class << std::endl;
             std::cout << "number_trees: " << gbm_->param.num_trees << std::endl;
+            if (gbm_->remapped()) {
+                std::cout << "used_features: " << gbm_->num_dense_feature() << std::endl;
+            }
+            if (gbm_->UseCompactLeaves()) {
+                const CompactLeafForest& leaves = gbm_->compact_leaves;
+                std::cout << "compact_forest_bytes: " << leaves.MemoryBytes() << " (fp32 "
+                          << gbm_->forest.MemoryBytes() << ")" << std::endl;
+                std::cout << "max_leaf_error: " << leaves.max_leaf_error() << std::endl;
+                std::cout << "max_margin_error: " << leaves.max_margin_error() << std::endl;
+            }
         }
 
     protected:
+        // magic bytes at the start of a compiled model file
+        inline static const char* CompiledMagic() {
+            return "XGBFLAT\n";
+        }
+
+        // read a length prefixed string
+        inline static LoadStatus ReadName(MemoryStream& fi, std::string* name,
+                                          const std::string& section) {
+            uint64_t len;
+            if (!fi.Read(&len, sizeof(len))) return LoadStatus::Truncated(section);
+            // some writers pad the length to 12 bytes with the length in the high word
+            if (len >= std::numeric_limits<unsigned>::max()) {
+                int gap;
+                if (!fi.Read(&gap, sizeof(gap))) return LoadStatus::Truncated(section);
+                len = len >> static_cast<uint64_t>(32UL);
+            }
+            const char* data = fi.Skip(len);
+            if (data == nullptr) return LoadStatus::Truncated(section);
+            name->assign(data, len);
+            return LoadStatus();
+        }
+
+        // parse an xgboost binary model, members are only replaced on success
+        inline LoadStatus LoadBinary(MemoryStream& fi) {
+            if (fi.Remaining() >= 4) {
+                const char* header = fi.Skip(0);
+                if (std::memcmp(header, "binf", 4) == 0) {
+                    fi.Skip(4);
+                } else if (std::memcmp(header, "bs64", 4) == 0) {
+                    return LoadStatus(LoadStatus::kUnsupported, "base64 encoded model");
+                }
+            }
+            LearnerModelParam param;
+            std::string name_obj, name_gbm;
+            if (!fi.Read(&param, sizeof(param))) return LoadStatus::Truncated("learner parameters");
+            LoadStatus status = ReadName(fi, &name_obj, "objective name");
+            if (status.ok()) status = ReadName(fi, &name_gbm, "booster name");
+            if (!status.ok()) return status;
+            if (name_gbm != "gbtree") {
+                return LoadStatus(LoadStatus::kUnsupported, "booster " + name_gbm);
+            }
+            std::unique_ptr<ObjFunction> obj(ObjFunction::Create(name_obj));
+            if (obj == nullptr) return LoadStatus(LoadStatus::kUnsupported, "objective " + name_obj);
+            std::unique_ptr<gbm::GBTreeModel> gbm(new gbm::GBTreeModel(param.base_score));
+            gbm->Configure(cfg_);
+            status = gbm->Load(fi);
+            if (!status.ok()) return status;
+            this->SetModel(param, name_obj, name_gbm, std::move(obj), std::move(gbm));
+            return LoadStatus();
+        }
+
+        // load the rest of a compiled model file after its magic
+        inline LoadStatus LoadCompiled(MemoryStream& fi, std::shared_ptr<const MappedFile> file) {
+            uint32_t header[2];
+            if (!fi.Read(header, sizeof(header))) return LoadStatus::Truncated("compiled header");
+            if (header[0] != kCompiledVersion) {
+                return LoadStatus(LoadStatus::kUnsupported,
+                                  "compiled model version " + std::to_string(header[0]));
+            }
+            LearnerModelParam param;
+            std::string name_obj, name_gbm;
+            if (!fi.Read(&param, sizeof(param))) return LoadStatus::Truncated("learner parameters");
+            LoadStatus status = ReadName(fi, &name_obj, "objective name");
+            if (status.ok()) status = ReadName(fi, &name_gbm, "booster name");
+            if (!status.ok()) return status;
+            std::unique_ptr<ObjFunction> obj(ObjFunction::Create(name_obj));
+            if (obj == nullptr) return LoadStatus(LoadStatus::kUnsupported, "objective " + name_obj);
+            std::unique_ptr<gbm::GBTreeModel> gbm(new gbm::GBTreeModel(param.base_score));
+            gbm->Configure(cfg_);
+            status = gbm->LoadCompiled(fi, file);
+            if (!status.ok()) return status;
+            this->SetModel(param, name_obj, name_gbm, std::move(obj), std::move(gbm));
+            return LoadStatus();
+        }
+
+        // install a loaded model, configured with cfg_ before it was loaded
+        inline void SetModel(const LearnerModelParam& param, const std::string& name_obj,
+                             const std::string& name_gbm, std::unique_ptr<ObjFunction> obj,
+                             std::unique_ptr<gbm::GBTreeModel> gbm) {
+            mparam = param;
+            name_obj_ = name_obj;
+            name_gbm_ = name_gbm;
+            obj_ = std::move(obj);
+            gbm_ = std::move(gbm);
+        }
+
+        // predict one feature vector indexed by the dense feature ids of the trees
+        inline void PredictInstance(const FVec &feats, bst_float* out_preds,
+                                    bool output_margin, unsigned ntree_limit) const {
+            const size_t ngroup = gbm_->num_output_group();
+            static thread_local std::vector<bst_float> margin_buf;
+            bst_float* margin = out_preds;
+            if (NumOutput(output_margin) != ngroup) {
+                margin_buf.resize(ngroup);
+                margin = margin_buf.data();
+            }
+            gbm_->PredictInstanceRaw(feats, 0, TreeLimit(ntree_limit), margin);
+            if (!output_margin) {
+                PredTransform(margin, 1, out_preds);
+            }
+        }
+
+        // turn the margins of num_row instances into predictions, out_preds may alias margin
+        inline void PredTransform(const bst_float* margin, size_t num_row, bst_float* out_preds) const {
+            obj_->PredTransform(margin, num_row, gbm_->num_output_group(), out_preds);
+        }
+
+        // compute the margins of a CSR batch, row i has NumOutputGroup margins at margin[i * ngroup]
+        inline void PredictBatchMargin(const size_t* row_ptr, const unsigned* col_idx,
+                                       const bst_float* values, size_t num_row,
+                                       bst_float* out_margin, unsigned ntree_limit) const {
+            ntree_limit = TreeLimit(ntree_limit);
+            const size_t ngroup = gbm_->num_output_group();
+            const size_t block_rows = BatchBlockRows();
+            const size_t nblock = (num_row + block_rows - 1) / block_rows;
+            // trees are optionally split into fixed shards that run as separate
+            // tasks, partial margins are reduced in shard order afterwards
+            const unsigned shard_size = tree_shard_size_ == 0 || tree_shard_size_ > ntree_limit ?
+                                        std::max(ntree_limit, 1U) : tree_shard_size_;
+            const size_t nshard = std::max<size_t>(1, (ntree_limit + shard_size - 1) / shard_size);
+            std::vector<bst_float> partial(nshard > 1 ? (nshard - 1) * num_row * ngroup : 0);
+            // dense feature scratch, one block per thread
+            std::vector<FVecBlock> thread_feats(NumThreads());
+            // margins of a block grouped by output group, used when there are several groups
+            std::vector<std::vector<bst_float> > thread_margin(ngroup > 1 ? NumThreads() : 0);
+
+            ParallelFor(nblock * nshard, [&](size_t task, int tid) {
+                size_t begin = task / nshard * block_rows;
+                size_t shard = task % nshard;
+                size_t nrow = std::min(block_rows, num_row - begin);
+                FVecBlock& feats = thread_feats[tid];
+                if (feats.num_row() == 0) {
+                    feats.Init(block_rows, gbm_->num_fill_feature());
+                }
+                bst_float* dst = out_margin + begin * ngroup;
+                if (shard != 0) {
+                    dst = &partial[((shard - 1) * num_row + begin) * ngroup];
+                }
+                bst_float* out = dst;
+                if (ngroup > 1) {
+                    thread_margin[tid].resize(block_rows * ngroup);
+                    out = thread_margin[tid].data();
+                }
+                std::fill(out, out + nrow * ngroup, shard == 0 ? gbm_->base_margin : 0.0f);
+                unsigned tree_begin = static_cast<unsigned>(shard * shard_size);
+                unsigned tree_end = std::min(ntree_limit, tree_begin + shard_size);
+
+                if (gbm_->remapped()) {
+                    // features the trees do not split on go to the spare last entry of each row
+                    const std::vector<unsigned>& dense_id = gbm_->feature_index;
+                    for (size_t i = 0; i < nrow; ++i) {
+                        size_t ridx = begin + i;
+                        feats.Fill(i, col_idx + row_ptr[ridx], values + row_ptr[ridx],
+                                   row_ptr[ridx + 1] - row_ptr[ridx], dense_id);
+                    }
+                    gbm_->PredictBatchRaw(feats, nrow, tree_begin, tree_end, out);
+                    for (size_t i = 0; i < nrow; ++i) {
+                        size_t ridx = begin + i;
+                        feats.Drop(i, col_idx + row_ptr[ridx], row_ptr[ridx + 1] - row_ptr[ridx],
+                                   dense_id);
+                    }
+                } else {
+                    for (size_t i = 0; i < nrow; ++i) {
+                        size_t ridx = begin + i;
+                        feats.Fill(i, col_idx + row_ptr[ridx], values + row_ptr[ridx],
+                                   row_ptr[ridx + 1] - row_ptr[ridx]);
+                    }
+                    gbm_->PredictBatchRaw(feats, nrow, tree_begin, tree_end, out);
+                    for (size_t i = 0; i < nrow; ++i) {
+                        size_t ridx = begin + i;
+                        feats.Drop(i, col_idx + row_ptr[ridx], row_ptr[ridx + 1] - row_ptr[ridx]);
+                    }
+                }
+                if (ngroup > 1) {
+                    for (size_t g = 0; g < ngroup; ++g) {
+                        for (size_t i = 0; i < nrow; ++i) {
+                            dst[i * ngroup + g] = out[g * nrow + i];
+                        }
+                    }
+                }
+            });
+            for (size_t shard = 1; shard < nshard; ++shard) {
+                const bst_float* src = &partial[(shard - 1) * num_row * ngroup];
+                for (size_t i = 0; i < num_row * ngroup; ++i) {
+                    out_margin[i] += src[i];
+                }
+            }
+        }
+
+        // report the leaves of a CSR batch in trees [0, ntree), optionally with the margins
+        template<typename TIndex>
+        inline void PredictLeafIndex(const size_t* row_ptr, const unsigned* col_idx,
+                                     const bst_float* values, size_t num_row, TIndex* out_leaf,
+                                     unsigned ntree, LeafIndexFormat format,
+                                     bst_float* out_margin) const {
+            const size_t ngroup = gbm_->num_output_group();
+            const size_t block_rows = BatchBlockRows();
+            const size_t nblock = (num_row + block_rows - 1) / block_rows;
+            std::vector<FVecBlock> thread_feats(NumThreads());
+            std::vector<std::vector<bst_float> > thread_margin(NumThreads());
+
+            ParallelFor(nblock, [&](size_t task, int tid) {
+                size_t begin = task * block_rows;
+                size_t nrow = std::min(block_rows, num_row - begin);
+                FVecBlock& feats = thread_feats[tid];
+                if (feats.num_row() == 0) {
+                    feats.Init(block_rows, gbm_->num_fill_feature());
+                }
+                bst_float* out = nullptr;
+                if (out_margin != nullptr) {
+                    thread_margin[tid].resize(block_rows * ngroup);
+                    out = thread_margin[tid].data();
+                    std::fill(out, out + nrow * ngroup, gbm_->base_margin);
+                }
+                for (size_t i = 0; i < nrow; ++i) {
+                    FillRow(&feats, i, row_ptr, col_idx, values, begin + i);
+                }
+                gbm_->PredictLeafRaw(feats, nrow, 0, ntree, format, out_leaf + begin * ntree, ntree,
+                                     out);
+                for (size_t i = 0; i < nrow; ++i) {
+                    DropRow(&feats, i, row_ptr, col_idx, begin + i);
+                }
+                if (out_margin != nullptr) {
+                    bst_float* dst = out_margin + begin * ngroup;
+                    for (size_t g = 0; g < ngroup; ++g) {
+                        for (size_t i = 0; i < nrow; ++i) {
+                            dst[i * ngroup + g] = out[g * nrow + i];
+                        }
+                    }
+                }
+            });
+        }
+
+        // fill row i of a block with CSR row ridx, through the dense ids if the features are remapped
+        inline void FillRow(FVecBlock* feats, size_t i, const size_t* row_ptr, const unsigned* col_idx,
+                            const bst_float* values, size_t ridx) const {
+            size_t length = row_ptr[ridx + 1] - row_ptr[ridx];
+            if (gbm_->remapped()) {
+                feats->Fill(i, col_idx + row_ptr[ridx], values + row_ptr[ridx], length,
+                            gbm_->feature_index);
+            } else {
+                feats->Fill(i, col_idx + row_ptr[ridx], values + row_ptr[ridx], length);
+            }
+        }
+
+        // reset row i of a block after FillRow with CSR row ridx
+        inline void DropRow(FVecBlock* feats, size_t i, const size_t* row_ptr, const unsigned* col_idx,
+                            size_t ridx) const {
+            size_t length = row_ptr[ridx + 1] - row_ptr[ridx];
+            if (gbm_->remapped()) {
+                feats->Drop(i, col_idx + row_ptr[ridx], length, gbm_->feature_index);
+            } else {
+                feats->Drop(i, col_idx + row_ptr[ridx], length);
+            }
+        }
+
+        // largest float not above x
+        inline static bst_float RoundDown(double x) {
+            bst_float f = static_cast<bst_float>(x);
+            return f > x ? std::nextafter(f, -std::numeric_limits<bst_float>::infinity()) : f;
+        }
+
+        // smallest float not below x
+        inline static bst_float RoundUp(double x) {
+            bst_float f = static_cast<bst_float>(x);
+            return f < x ? std::nextafter(f, std::numeric_limits<bst_float>::infinity()) : f;
+        }
+
         // return whether model is already initialized.
         inline bool ModelInitialized() const { return gbm_.get() != nullptr; }
 
+        // number of trees used by the first ntree_limit boosting rounds, 0 means all trees
+        inline unsigned TreeLimit(unsigned ntree_limit) const {
+            size_t ntree = static_cast<size_t>(ntree_limit) * gbm_->num_output_group();
+            if (ntree == 0 || ntree > gbm_->num_trees()) {
+                ntree = gbm_->num_trees();
+            }
+            return static_cast<unsigned>(ntree);
+        }
+
+        // run fn(task, thread_id) for each task, on the thread pool if there is one
+        inline void ParallelFor(size_t ntask, const ThreadPool::TaskFunction& fn) const {
+            if (pool_) {
+                pool_->ParallelFor(ntask, fn);
+            } else {
+                for (size_t i = 0; i < ntask; ++i) {
+                    fn(i, 0);
+                }
+            }
+        }
+
+        // number of rows that traverse a tree together in batch prediction,
+        // bounded so the dense feature vectors of a block stay small
+        inline size_t BatchBlockRows() const {
+            size_t nrow = kBatchScratchEntries / std::max<size_t>(gbm_->num_fill_feature(), 1);
+            if (nrow > kMaxBatchBlockRows) nrow = kMaxBatchBlockRows;
+            return nrow == 0 ? 1 : nrow;
+        }
+
+        // number of rows explained together, their dense rows are indexed by raw feature ids
+        inline size_t ContributionBlockRows() const {
+            size_t nrow = kBatchScratchEntries / (NumFeature() + 1);
+            if (nrow > kMaxBatchBlockRows) nrow = kMaxBatchBlockRows;
+            return nrow == 0 ? 1 : nrow;
+        }
+
         // model parameter
         LearnerModelParam mparam;
         // temporal storages for prediction
         // std::vector<bst_float> preds_;
         std::unique_ptr<gbm::GBTreeModel> gbm_;
+        // output transform of the objective the model was trained with
+        std::unique_ptr<ObjFunction> obj_;
+        // configurations given so far, applied to the gbm on load
+        std::vector<std::pair<std::string, std::string> > cfg_;
+        // thread pool used by batch prediction, may be shared with other predictors
+        std::shared_ptr<ThreadPool> pool_;
+        // number of trees per task in batch prediction, 0 means all trees
+        unsigned tree_shard_size_ = 0;
         // name of gbm
         std::string name_gbm_;
         // name of objective function
@@ -140,6 +1248,14 @@ namespace xgboost {
     private:
         /*! \brief random number transformation seed. */
         static const int kRandSeedMagic = 127;
+        /*! \brief version of the compiled model format */
+        static const uint32_t kCompiledVersion = 2;
+        /*! \brief size of the magic at the start of a compiled model */
+        static const size_t kCompiledMagicSize = 8;
+        /*! \brief maximum number of rows that traverse a tree together in a batch */
+        static const size_t kMaxBatchBlockRows = 64;
+        /*! \brief budget of dense feature entries held by one batch block */
+        static const size_t kBatchScratchEntries = 1 << 20;
     };
 
 }  // namespace xgboost
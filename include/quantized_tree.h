@@ -0,0 +1,192 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file quantized_tree.h
+ * \brief forest whose splits compare integer bins of the thresholds instead of floats
+ */
+#ifndef XGBOOST_QUANTIZED_TREE_H_
+#define XGBOOST_QUANTIZED_TREE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "fvec.h"
+#include "flat_tree.h"
+
+namespace xgboost {
+/*!
+ * \brief quantized layout of a forest.
+ *
+ *  The distinct split thresholds of each feature are sorted, and a feature value
+ *  is replaced by its bin: the number of thresholds not greater than the value.
+ *  Then fvalue < threshold k holds exactly when bin <= k, so a row is binned once
+ *  and every split compares two 16 bit integers with the same outcome as the
+ *  float comparison. A NaN value gets the last bin and goes right, a missing
+ *  value gets kMissingBin. Splits that send missing values left add one to
+ *  both bins, which wraps kMissingBin to 0, so the default branch needs no
+ *  extra test: kMissingBin is greater than every threshold bin otherwise.
+ *
+ *  Nodes take 8 bytes instead of 12: the bin of the threshold and the distance
+ *  to the right child are 16 bit, the word holding the split feature holds the
+ *  value of a leaf. A forest with a NaN threshold, a feature with more than
+ *  kMaxThresholds thresholds or a right child too far away cannot be quantized.
+ */
+    class QuantizedForest {
+    public:
+        /*! \brief bin of a missing value */
+        static const uint16_t kMissingBin = 0xFFFF;
+        /*! \brief most distinct thresholds per feature, bins stay below kMissingBin */
+        static const size_t kMaxThresholds = 0xFFFE;
+
+        /*! \brief packed node */
+        struct Node {
+            /*! \brief split feature with the default left bit on top, or the leaf value */
+            union {
+                uint32_t sindex;
+                bst_float leaf_value;
+            };
+            /*!
+             * \brief bin of the split threshold plus the default left bit,
+             *  go left when the bin of the value plus that bit is not greater
+             */
+            uint16_t cond_bin;
+            /*! \brief distance from this node to its right child, 0 for a leaf */
+            uint16_t right;
+        };
+
+        /*!
+         * \brief build the quantized layout of a forest
+         * \param forest the compiled forest
+         * \param num_feature number of features of the model
+         * \return whether the forest can be quantized, on false the layout is empty
+         */
+        inline bool Build(const FlatForest& forest, size_t num_feature) {
+            static_assert(sizeof(Node) == 8, "QuantizedForest::Node: packed layout");
+            this->Clear();
+            std::vector<std::vector<bst_float> > cuts(num_feature);
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                const FlatTree tree = forest[i];
+                for (size_t nid = 0; nid < tree.size(); ++nid) {
+                    const FlatTree::Node& node = tree[static_cast<int>(nid)];
+                    if (node.is_leaf()) continue;
+                    if (node.split_cond() != node.split_cond()) return false;
+                    cuts[node.split_index()].push_back(node.split_cond());
+                }
+            }
+            cut_ptr_.resize(num_feature + 1, 0);
+            for (size_t f = 0; f < num_feature; ++f) {
+                std::sort(cuts[f].begin(), cuts[f].end());
+                cuts[f].erase(std::unique(cuts[f].begin(), cuts[f].end()), cuts[f].end());
+                if (cuts[f].size() > kMaxThresholds) {
+                    this->Clear();
+                    return false;
+                }
+                if (!cuts[f].empty()) used_feature_.push_back(static_cast<unsigned>(f));
+                cut_values_.insert(cut_values_.end(), cuts[f].begin(), cuts[f].end());
+                cut_ptr_[f + 1] = cut_values_.size();
+            }
+            offset_.resize(forest.num_trees() + 1, 0);
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                const FlatTree tree = forest[i];
+                for (size_t nid = 0; nid < tree.size(); ++nid) {
+                    const FlatTree::Node& src = tree[static_cast<int>(nid)];
+                    Node node;
+                    if (src.is_leaf()) {
+                        node.leaf_value = src.leaf_value();
+                        node.cond_bin = 0;
+                        node.right = 0;
+                    } else {
+                        size_t right = static_cast<size_t>(src.cright()) - nid;
+                        if (right > 0xFFFF) {
+                            this->Clear();
+                            return false;
+                        }
+                        unsigned fid = src.split_index();
+                        const bst_float* begin = cut_values_.data() + cut_ptr_[fid];
+                        const bst_float* end = cut_values_.data() + cut_ptr_[fid + 1];
+                        node.sindex = fid | (src.default_left() ? 1U << 31 : 0U);
+                        node.cond_bin = static_cast<uint16_t>(
+                            std::lower_bound(begin, end, src.split_cond()) - begin +
+                            (src.default_left() ? 1 : 0));
+                        node.right = static_cast<uint16_t>(right);
+                    }
+                    nodes_.push_back(node);
+                }
+                offset_[i + 1] = nodes_.size();
+            }
+            return true;
+        }
+
+        /*! \brief drop the layout */
+        inline void Clear() {
+            nodes_.clear();
+            offset_.clear();
+            cut_values_.clear();
+            cut_ptr_.clear();
+            used_feature_.clear();
+        }
+
+        /*!
+         * \brief bin the features of a row that the forest splits on, other entries are not written
+         * \param row entries of the dense feature vector
+         * \param bins num_feature bins of the row
+         */
+        inline void BinRow(const FVec::Entry* row, uint16_t* bins) const {
+            for (unsigned fid : used_feature_) {
+                const FVec::Entry& e = row[fid];
+                if (e.flag == -1) {
+                    bins[fid] = kMissingBin;
+                    continue;
+                }
+                const bst_float* begin = cut_values_.data() + cut_ptr_[fid];
+                const bst_float* end = cut_values_.data() + cut_ptr_[fid + 1];
+                // NaN is not less than any threshold, it takes the last bin
+                bins[fid] = static_cast<uint16_t>(e.fvalue != e.fvalue ? end - begin :
+                                                  std::upper_bound(begin, end, e.fvalue) - begin);
+            }
+        }
+
+        /*!
+         * \brief leaf value of tree i for a binned row
+         * \param i index of the tree
+         * \param bins bins of the row, see BinRow
+         */
+        inline bst_float Predict(size_t i, const uint16_t* bins) const {
+            const Node* nodes = &nodes_[0] + offset_[i];
+            const Node* node = nodes;
+            while (node->right != 0) {
+                uint32_t sindex = node->sindex;
+                uint16_t bin = static_cast<uint16_t>(bins[sindex & ((1U << 31) - 1U)] + (sindex >> 31));
+                if (bin <= node->cond_bin) {
+                    ++node;
+                } else {
+                    node += node->right;
+                }
+            }
+            return node->leaf_value;
+        }
+
+        /*! \brief number of trees, 0 if the forest was not quantized */
+        inline size_t num_trees() const {
+            return offset_.empty() ? 0 : offset_.size() - 1;
+        }
+
+        /*! \brief bytes used by the nodes */
+        inline size_t MemoryBytes() const {
+            return nodes_.size() * sizeof(Node);
+        }
+
+    private:
+        // nodes of all trees
+        std::vector<Node> nodes_;
+        // first node of each tree, offset_[num_trees] is the total
+        std::vector<size_t> offset_;
+        // sorted distinct thresholds of all features
+        std::vector<bst_float> cut_values_;
+        // thresholds of feature f are [cut_ptr_[f], cut_ptr_[f + 1])
+        std::vector<size_t> cut_ptr_;
+        // features with at least one threshold
+        std::vector<unsigned> used_feature_;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_QUANTIZED_TREE_H_
@@ -0,0 +1,196 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file quick_scorer.h
+ * \brief bitvector based evaluation of forests with small trees
+ */
+#ifndef XGBOOST_QUICK_SCORER_H_
+#define XGBOOST_QUICK_SCORER_H_
+
+#include <algorithm>
+#include <vector>
+#include "fvec.h"
+#include "flat_tree.h"
+
+namespace xgboost {
+/*!
+ * \brief QuickScorer evaluation of a forest whose trees have at most 64 leaves.
+ *
+ *  The leaves of a tree are numbered left to right and a row keeps one
+ *  64 bit vector per tree, starting with all leaves reachable. Every
+ *  split that sends the row to the right removes the leaves of its left
+ *  subtree, and the exit leaf is the lowest bit still set. The splits of
+ *  the whole forest are grouped by feature and sorted by threshold, so a
+ *  present value x only scans the splits with threshold <= x of its
+ *  feature, instead of chasing nodes from root to leaf. The leaf of each
+ *  tree is added to the margin of the output group of the tree.
+ */
+    class QuickScorer {
+    public:
+        /*! \brief maximum number of leaves of a tree */
+        static const int kMaxLeaves = 64;
+
+        /*!
+         * \brief whether every tree of the forest fits in a bitvector
+         * \param forest the compiled forest
+         */
+        inline static bool Qualifies(const FlatForest& forest) {
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                FlatTree tree = forest[i];
+                // a binary tree with n nodes has (n + 1) / 2 leaves
+                if ((tree.size() + 1) / 2 > static_cast<size_t>(kMaxLeaves)) return false;
+            }
+            return true;
+        }
+
+        /*!
+         * \brief build the per-feature split lists
+         * \param forest the compiled forest, must qualify
+         * \param tree_group output group of each tree
+         */
+        inline void Build(const FlatForest& forest, const std::vector<int>& tree_group) {
+            std::vector<Condition> conds;
+            leaf_ptr_.assign(1, 0);
+            leaf_value_.clear();
+            tree_group_.assign(tree_group.begin(), tree_group.end());
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                int nleaf = 0;
+                this->AddNode(forest[i], 0, static_cast<unsigned>(i), &nleaf, &conds);
+                leaf_ptr_.push_back(leaf_value_.size());
+            }
+            std::stable_sort(conds.begin(), conds.end(), [](const Condition& a, const Condition& b) {
+                if (a.fid != b.fid) return a.fid < b.fid;
+                return a.threshold < b.threshold;
+            });
+
+            feature_.clear();
+            feature_ptr_.assign(1, 0);
+            threshold_.resize(conds.size());
+            tree_.resize(conds.size());
+            mask_.resize(conds.size());
+            for (size_t k = 0; k < conds.size(); ++k) {
+                if (k != 0 && conds[k].fid != conds[k - 1].fid) {
+                    feature_ptr_.push_back(k);
+                }
+                if (k == 0 || conds[k].fid != conds[k - 1].fid) {
+                    feature_.push_back(conds[k].fid);
+                }
+                threshold_[k] = conds[k].threshold;
+                tree_[k] = conds[k].tree;
+                if (conds[k].default_left) tree_[k] |= kDefaultLeft;
+                mask_[k] = conds[k].mask;
+            }
+            if (!conds.empty()) feature_ptr_.push_back(conds.size());
+        }
+
+        /*! \brief number of trees */
+        inline size_t num_trees() const {
+            return leaf_ptr_.empty() ? 0 : leaf_ptr_.size() - 1;
+        }
+
+        /*!
+         * \brief add the leaf values of all trees for one row to the margins of its groups
+         * \param feat entries of the dense feature vector
+         * \param bitvec scratch space of num_trees() words
+         * \param out_margin margins of the row, group g is at out_margin[g * stride]
+         * \param stride distance between the margins of two groups
+         */
+        inline void Predict(const FVec::Entry* feat, uint64_t* bitvec,
+                            bst_float* out_margin, size_t stride) const {
+            const size_t ntree = this->num_trees();
+            std::fill(bitvec, bitvec + ntree, ~static_cast<uint64_t>(0));
+            for (size_t j = 0; j < feature_.size(); ++j) {
+                const FVec::Entry& e = feat[feature_[j]];
+                size_t k = feature_ptr_[j], end = feature_ptr_[j + 1];
+                if (e.flag == -1) {
+                    // missing value takes the default direction of every split
+                    for (; k < end; ++k) {
+                        if ((tree_[k] & kDefaultLeft) == 0) {
+                            bitvec[tree_[k]] &= mask_[k];
+                        }
+                    }
+                } else if (e.fvalue != e.fvalue) {
+                    // NaN never compares less, so every split goes right
+                    for (; k < end; ++k) {
+                        bitvec[tree_[k] & ~kDefaultLeft] &= mask_[k];
+                    }
+                } else {
+                    for (; k < end && threshold_[k] <= e.fvalue; ++k) {
+                        bitvec[tree_[k] & ~kDefaultLeft] &= mask_[k];
+                    }
+                }
+            }
+            for (size_t i = 0; i < ntree; ++i) {
+                out_margin[tree_group_[i] * stride] +=
+                    leaf_value_[leaf_ptr_[i] + CountTrailingZeros(bitvec[i])];
+            }
+        }
+
+    private:
+        /*! \brief a split of the forest */
+        struct Condition {
+            unsigned fid;
+            bst_float threshold;
+            unsigned tree;
+            bool default_left;
+            uint64_t mask;
+        };
+        // flag stored in the tree id of a condition
+        static const unsigned kDefaultLeft = 1U << 31;
+
+        inline static int CountTrailingZeros(uint64_t x) {
+#if defined(__GNUC__)
+            return __builtin_ctzll(x);
+#else
+            int n = 0;
+            while ((x & 1) == 0) {
+                x >>= 1;
+                ++n;
+            }
+            return n;
+#endif
+        }
+
+        // number the leaves of the subtree at nid from *nleaf on and collect its splits,
+        // returns one past the last leaf of the subtree
+        inline int AddNode(const FlatTree& tree, int nid, unsigned tree_id, int* nleaf,
+                           std::vector<Condition>* conds) {
+            const FlatTree::Node& node = tree[nid];
+            if (node.is_leaf()) {
+                leaf_value_.push_back(node.leaf_value());
+                return ++(*nleaf);
+            }
+            int begin = *nleaf;
+            int mid = this->AddNode(tree, node.cleft(nid), tree_id, nleaf, conds);
+            int end = this->AddNode(tree, node.cright(), tree_id, nleaf, conds);
+            Condition c;
+            c.fid = node.split_index();
+            c.threshold = node.split_cond();
+            c.tree = tree_id;
+            c.default_left = node.default_left();
+            // going right removes the leaves [begin, mid) of the left subtree
+            uint64_t left = (mid - begin == 64 ? ~static_cast<uint64_t>(0) :
+                             ((static_cast<uint64_t>(1) << (mid - begin)) - 1)) << begin;
+            c.mask = ~left;
+            conds->push_back(c);
+            return end;
+        }
+
+        // features used by at least one split
+        std::vector<unsigned> feature_;
+        // splits of feature_[j] are [feature_ptr_[j], feature_ptr_[j + 1])
+        std::vector<size_t> feature_ptr_;
+        // split threshold, ascending within a feature
+        std::vector<bst_float> threshold_;
+        // tree of the split, highest bit is the default direction
+        std::vector<unsigned> tree_;
+        // bitvector applied when the split goes right
+        std::vector<uint64_t> mask_;
+        // leaves of tree i are [leaf_ptr_[i], leaf_ptr_[i + 1]), left to right
+        std::vector<size_t> leaf_ptr_;
+        std::vector<bst_float> leaf_value_;
+        // output group of each tree
+        std::vector<size_t> tree_group_;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_QUICK_SCORER_H_
@@ -0,0 +1,336 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file score_pipeline.h
+ * \brief streaming libsvm scoring with overlapped read, parse, predict and format stages
+ */
+#ifndef XGBOOST_SCORE_PIPELINE_H_
+#define XGBOOST_SCORE_PIPELINE_H_
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "io.h"
+#include "libsvm_parser.h"
+#include "predictor.h"
+#include "thread_pool.h"
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+namespace xgboost {
+/*!
+ * \brief write the predictions of rows [begin, end) as text, one line per row, with the
+ *  9 significant digits that read back as the same float
+ * \param preds nout predictions per row
+ * \param nout number of predictions per row
+ * \param begin first row
+ * \param end one past the last row
+ * \param out receives the text, its previous content is replaced
+ */
+    inline void FormatPredictions(const bst_float* preds, size_t nout, size_t begin, size_t end,
+                                  std::string* out) {
+        char buf[32];
+        out->clear();
+        for (size_t i = begin; i < end; ++i) {
+            for (size_t k = 0; k < nout; ++k) {
+                int n = std::snprintf(buf, sizeof(buf), k + 1 == nout ? "%.9g\n" : "%.9g ",
+                                      preds[i * nout + k]);
+                out->append(buf, n);
+            }
+        }
+    }
+
+/*!
+ * \brief bounded lock-free queue between one producer thread and one consumer thread.
+ *
+ *  The producer only writes tail_ and the consumer only writes head_, each
+ *  on its own cache line, so an element is handed over with one release
+ *  store and one acquire load. Waiting on a full or empty queue spins
+ *  briefly, then yields, then sleeps, so an idle stream costs little CPU.
+ */
+    template<typename T>
+    class SPSCQueue {
+    public:
+        /*!
+         * \brief create the queue
+         * \param capacity number of elements the queue holds, rounded up to a power of two
+         */
+        explicit SPSCQueue(size_t capacity) : head_(0), tail_(0) {
+            size_t size = 1;
+            while (size < capacity) size <<= 1;
+            buffer_.resize(size);
+            mask_ = size - 1;
+        }
+
+        /*! \brief append an element, false if the queue is full */
+        inline bool TryPush(const T& value) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+            buffer_[tail & mask_] = value;
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /*! \brief take the oldest element, false if the queue is empty */
+        inline bool TryPop(T* value) {
+            size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tail_.load(std::memory_order_acquire)) return false;
+            *value = buffer_[head & mask_];
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /*! \brief append an element, waiting while the queue is full */
+        inline void Push(const T& value) {
+            for (unsigned spin = 0; !this->TryPush(value); ++spin) Backoff(spin);
+        }
+
+        /*! \brief take the oldest element, waiting while the queue is empty */
+        inline T Pop() {
+            T value;
+            for (unsigned spin = 0; !this->TryPop(&value); ++spin) Backoff(spin);
+            return value;
+        }
+
+    private:
+        inline static void Backoff(unsigned spin) {
+            if (spin < 64) return;
+            if (spin < 1024) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+
+        // ring of elements, size is a power of two
+        std::vector<T> buffer_;
+        size_t mask_;
+        // next element to pop, written by the consumer
+        alignas(64) std::atomic<size_t> head_;
+        // next free slot, written by the producer
+        alignas(64) std::atomic<size_t> tail_;
+    };
+
+/*!
+ * \brief scores a stream of libsvm text with a fixed amount of memory.
+ *
+ *  A reader, a parser, a predictor and a formatter thread pass batches of
+ *  whole lines along SPSC queues to the caller, which writes the output and
+ *  hands the batch back to the reader. Each stage works on one batch at a time
+ *  in arrival order, so the output follows the input order while the stages
+ *  overlap, and only num_batch batches of up to twice block_bytes text are ever
+ *  allocated: a line longer than block_bytes fails the run.
+ *  Parsing, prediction and formatting spread their batch over the parse pool,
+ *  the pool of the predictor and the format pool. A pool runs one job at a
+ *  time, so stages overlap only when their pools are distinct. The reader
+ *  takes what a read returns, so rows arriving slowly on a pipe are scored and
+ *  flushed without waiting for a full block.
+ */
+    class ScorePipeline {
+    public:
+        /*!
+         * \brief set up the pipeline
+         * \param pred the loaded model, it must outlive the pipeline; prediction runs on
+         *  its thread pool
+         * \param parse_pool thread pool for parsing, nullptr parses on the stage thread
+         * \param format_pool thread pool for formatting, nullptr formats on the stage thread
+         * \param output_margin whether to output the raw margins
+         * \param ntree_limit limit number of boosting rounds used for prediction, 0 means all
+         * \param block_bytes largest read of text per batch, and longest line accepted
+         * \param num_batch number of batches in flight
+         */
+        ScorePipeline(const Predictor& pred, std::shared_ptr<ThreadPool> parse_pool,
+                      std::shared_ptr<ThreadPool> format_pool, bool output_margin,
+                      unsigned ntree_limit, size_t block_bytes = 1 << 20, size_t num_batch = 4)
+            : pred_(pred), parse_pool_(std::move(parse_pool)), format_pool_(std::move(format_pool)),
+              output_margin_(output_margin), ntree_limit_(ntree_limit),
+              block_bytes_(std::max<size_t>(block_bytes, 1)),
+              num_batch_(std::max<size_t>(num_batch, 1)) {}
+
+        /*!
+         * \brief score the rows read from a stream until end of input
+         * \param in the libsvm input, read unbuffered where the platform allows
+         * \param out stream receiving one line of predictions per row
+         * \return kCorrupt on a malformed row or a line longer than block_bytes, kIOError on
+         *  a failed read or write;
+         *  the batches before the failing one have been written, the input is read
+         *  up to the end of the read in progress
+         */
+        inline LoadStatus Run(FILE* in, FILE* out) {
+            std::vector<std::unique_ptr<Batch> > batches(num_batch_);
+            SPSCQueue<Batch*> free_queue(num_batch_), text_queue(num_batch_),
+                rows_queue(num_batch_), pred_queue(num_batch_), out_queue(num_batch_);
+            for (auto& batch : batches) {
+                batch.reset(new Batch());
+                free_queue.Push(batch.get());
+            }
+            std::atomic<bool> stop(false);
+            // each stage forwards nullptr once its input ends
+            std::thread reader([&]() { this->ReadStage(in, &stop, &free_queue, &text_queue); });
+            std::thread parser([&]() { this->ParseStage(&text_queue, &rows_queue); });
+            std::thread predictor([&]() { this->PredictStage(&rows_queue, &pred_queue); });
+            std::thread formatter([&]() { this->FormatStage(&pred_queue, &out_queue); });
+            LoadStatus status;
+            for (Batch* batch = out_queue.Pop(); batch != nullptr; batch = out_queue.Pop()) {
+                if (status.ok() && !batch->status.ok()) status = batch->status;
+                for (size_t k = 0; status.ok() && k < batch->num_slice; ++k) {
+                    const std::string& text = batch->out[k];
+                    if (std::fwrite(text.data(), 1, text.size(), out) != text.size()) {
+                        status = LoadStatus(LoadStatus::kIOError, "write failed");
+                    }
+                }
+                if (status.ok() && std::fflush(out) != 0) {
+                    status = LoadStatus(LoadStatus::kIOError, "write failed");
+                }
+                // after a failure the remaining batches are drained without output
+                if (!status.ok()) stop = true;
+                free_queue.Push(batch);
+            }
+            reader.join();
+            parser.join();
+            predictor.join();
+            formatter.join();
+            return status;
+        }
+
+    private:
+        /*! \brief the buffers of one batch of lines, reused from batch to batch */
+        struct Batch {
+            std::string text;
+            CSRBatch rows;
+            std::vector<bst_float> preds;
+            // text of the predictions in slices of rows, num_slice of them in use
+            std::vector<std::string> out;
+            size_t num_slice = 0;
+            LoadStatus status;
+        };
+
+        // read whole lines, a partial last line is carried over to the next batch
+        inline void ReadStage(FILE* in_file, std::atomic<bool>* stop, SPSCQueue<Batch*>* in,
+                              SPSCQueue<Batch*>* out) {
+            std::string pending;
+            bool eof = false;
+            while (!eof && !*stop) {
+                Batch* batch = in->Pop();
+                batch->status = LoadStatus();
+                batch->text.swap(pending);
+                pending.clear();
+                size_t line_end = std::string::npos;
+                // reads stop once the first line outgrows a block, so the text of a batch
+                // stays within two blocks
+                while (line_end == std::string::npos && !eof && batch->text.size() <= block_bytes_) {
+                    size_t size = batch->text.size();
+                    batch->text.resize(size + block_bytes_);
+                    long nread = ReadSome(in_file, &batch->text[size], block_bytes_);
+                    if (nread < 0) {
+                        batch->status = LoadStatus(LoadStatus::kIOError, "read failed");
+                        nread = 0;
+                    }
+                    batch->text.resize(size + static_cast<size_t>(nread));
+                    eof = nread == 0;
+                    line_end = batch->text.rfind('\n');
+                }
+                if (batch->status.ok() &&
+                    std::min(batch->text.find('\n'), batch->text.size()) > block_bytes_) {
+                    batch->status = LoadStatus::Corrupt("line longer than " +
+                                                        std::to_string(block_bytes_) + " bytes");
+                    eof = true;
+                }
+                if (!eof && line_end + 1 < batch->text.size()) {
+                    pending.assign(batch->text, line_end + 1, std::string::npos);
+                    batch->text.resize(line_end + 1);
+                }
+                out->Push(batch);
+            }
+            out->Push(nullptr);
+        }
+
+        inline void ParseStage(SPSCQueue<Batch*>* in, SPSCQueue<Batch*>* out) {
+            LibSVMParser parser(parse_pool_);
+            size_t line = 1;
+            bool failed = false;
+            for (Batch* batch = in->Pop(); batch != nullptr; batch = in->Pop()) {
+                batch->rows.Clear();
+                if (!failed && batch->status.ok()) {
+                    batch->status = parser.Parse(batch->text.data(), batch->text.size(),
+                                                 &batch->rows, line);
+                    line += parser.num_line();
+                }
+                failed = failed || !batch->status.ok();
+                if (failed) batch->rows.Clear();
+                out->Push(batch);
+            }
+            out->Push(nullptr);
+        }
+
+        inline void PredictStage(SPSCQueue<Batch*>* in, SPSCQueue<Batch*>* out) {
+            const size_t nout = pred_.NumOutput(output_margin_);
+            for (Batch* batch = in->Pop(); batch != nullptr; batch = in->Pop()) {
+                const CSRBatch& rows = batch->rows;
+                batch->preds.resize(rows.num_row() * nout);
+                if (rows.num_row() != 0) {
+                    pred_.PredictBatch(rows.row_ptr.data(), rows.col_idx.data(), rows.values.data(),
+                                       rows.num_row(), batch->preds.data(), output_margin_,
+                                       ntree_limit_);
+                }
+                out->Push(batch);
+            }
+            out->Push(nullptr);
+        }
+
+        // format slices of rows in parallel, the writer outputs them in order
+        inline void FormatStage(SPSCQueue<Batch*>* in, SPSCQueue<Batch*>* out) {
+            const size_t nout = pred_.NumOutput(output_margin_);
+            const size_t max_slice =
+                format_pool_ ? static_cast<size_t>(format_pool_->num_threads()) * 4 : 1;
+            for (Batch* batch = in->Pop(); batch != nullptr; batch = in->Pop()) {
+                const size_t nrow = batch->rows.num_row();
+                const bst_float* preds = batch->preds.data();
+                std::vector<std::string>& text = batch->out;
+                const size_t nslice = std::min(max_slice, nrow);
+                if (text.size() < nslice) text.resize(nslice);
+                auto format = [&](size_t k, int) {
+                    FormatPredictions(preds, nout, nrow * k / nslice, nrow * (k + 1) / nslice,
+                                      &text[k]);
+                };
+                if (format_pool_) {
+                    format_pool_->ParallelFor(nslice, format);
+                } else {
+                    for (size_t k = 0; k < nslice; ++k) format(k, 0);
+                }
+                batch->num_slice = nslice;
+                out->Push(batch);
+            }
+            out->Push(nullptr);
+        }
+
+        // read up to size bytes, returns what is available once some is, 0 at end of input
+        inline static long ReadSome(FILE* in, char* dst, size_t size) {
+#if !defined(_WIN32)
+            while (true) {
+                ssize_t n = ::read(fileno(in), dst, size);
+                if (n >= 0 || errno != EINTR) return static_cast<long>(n);
+            }
+#else
+            size_t n = std::fread(dst, 1, size, in);
+            return n == 0 && std::ferror(in) ? -1 : static_cast<long>(n);
+#endif
+        }
+
+        const Predictor& pred_;
+        std::shared_ptr<ThreadPool> parse_pool_;
+        std::shared_ptr<ThreadPool> format_pool_;
+        bool output_margin_;
+        unsigned ntree_limit_;
+        size_t block_bytes_;
+        size_t num_batch_;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_SCORE_PIPELINE_H_
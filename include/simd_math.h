@@ -0,0 +1,160 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file simd_math.h
+ * \brief vectorized exp and logistic functions used by output transforms
+ */
+#ifndef XGBOOST_SIMD_MATH_H_
+#define XGBOOST_SIMD_MATH_H_
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include "base.h"
+#include "simd_tree.h"
+
+namespace xgboost {
+    namespace simd {
+/*!
+ * \brief constants of the exp approximation: exp(x) = 2^n * exp(r) with
+ *  n = round(x / ln 2), r = x - n ln 2 and a degree 5 polynomial for exp(r).
+ *  The relative error is below 2 ulp over the whole float range.
+ */
+        namespace exp_const {
+            // largest input with a finite result, and the input below which the result
+            // rounds to zero even as a denormal, ln(2^-150)
+            const float kHi = 88.72283935546875f;
+            const float kLo = -103.972076416015625f;
+            const float kLog2e = 1.44269504088896341f;
+            // ln 2 split into a part exact in float and the remainder
+            const float kLn2Hi = 0.693359375f;
+            const float kLn2Lo = -2.12194440e-4f;
+            const float kP0 = 1.9875691500E-4f;
+            const float kP1 = 1.3981999507E-3f;
+            const float kP2 = 8.3334519073E-3f;
+            const float kP3 = 4.1665795894E-2f;
+            const float kP4 = 1.6666665459E-1f;
+            const float kP5 = 5.0000001201E-1f;
+        }  // namespace exp_const
+
+/*!
+ * \brief scalar exp, bit identical to the vector kernels so a row gets the
+ *  same prediction whether it lands in a vector or in the tail of a batch
+ */
+        inline float ExpScalar(float x) {
+            using namespace exp_const;
+            if (x != x) return x;
+            if (x > kHi) return std::numeric_limits<float>::infinity();
+            if (x < kLo) return 0.0f;
+            float n = std::floor(x * kLog2e + 0.5f);
+            float r = x - n * kLn2Hi;
+            r = r - n * kLn2Lo;
+            float z = r * r;
+            float y = kP0;
+            y = y * r + kP1;
+            y = y * r + kP2;
+            y = y * r + kP3;
+            y = y * r + kP4;
+            y = y * r + kP5;
+            y = y * z + r + 1.0f;
+            // 2^n is applied in two halves, so results below the normal range stay denormal
+            int n1 = static_cast<int>(n) >> 1;
+            int bits[2] = {(n1 + 127) << 23, (static_cast<int>(n) - n1 + 127) << 23};
+            float scale[2];
+            std::memcpy(scale, bits, sizeof(scale));
+            return y * scale[0] * scale[1];
+        }
+
+#if XGBOOST_USE_SIMD
+/*!
+ * \brief out[i] = exp(in[i]) for 8 values at a time, in and out may alias
+ * \return number of values processed, the remaining values are left to the caller
+ */
+        __attribute__((target("avx2")))
+        inline size_t ExpAVX2(const float* in, size_t n, float* out) {
+            using namespace exp_const;
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m256 x = _mm256_loadu_ps(in + i);
+                __m256 nan = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+                __m256 over = _mm256_cmp_ps(x, _mm256_set1_ps(kHi), _CMP_GT_OQ);
+                __m256 under = _mm256_cmp_ps(x, _mm256_set1_ps(kLo), _CMP_LT_OQ);
+                __m256 v = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(kLo)), _mm256_set1_ps(kHi));
+                __m256 k = _mm256_floor_ps(_mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(kLog2e)),
+                                                         _mm256_set1_ps(0.5f)));
+                __m256 r = _mm256_sub_ps(v, _mm256_mul_ps(k, _mm256_set1_ps(kLn2Hi)));
+                r = _mm256_sub_ps(r, _mm256_mul_ps(k, _mm256_set1_ps(kLn2Lo)));
+                __m256 z = _mm256_mul_ps(r, r);
+                __m256 y = _mm256_set1_ps(kP0);
+                y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(kP1));
+                y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(kP2));
+                y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(kP3));
+                y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(kP4));
+                y = _mm256_add_ps(_mm256_mul_ps(y, r), _mm256_set1_ps(kP5));
+                y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y, z), r), _mm256_set1_ps(1.0f));
+                __m256i n = _mm256_cvttps_epi32(k);
+                __m256i n1 = _mm256_srai_epi32(n, 1);
+                __m256i bias = _mm256_set1_epi32(127);
+                __m256i bits1 = _mm256_slli_epi32(_mm256_add_epi32(n1, bias), 23);
+                __m256i bits2 = _mm256_slli_epi32(_mm256_add_epi32(_mm256_sub_epi32(n, n1), bias), 23);
+                y = _mm256_mul_ps(_mm256_mul_ps(y, _mm256_castsi256_ps(bits1)),
+                                  _mm256_castsi256_ps(bits2));
+                y = _mm256_blendv_ps(y, _mm256_set1_ps(std::numeric_limits<float>::infinity()), over);
+                y = _mm256_blendv_ps(y, _mm256_setzero_ps(), under);
+                y = _mm256_blendv_ps(y, x, nan);
+                _mm256_storeu_ps(out + i, y);
+            }
+            return i;
+        }
+
+/*!
+ * \brief out[i] = 1 / (1 + exp(-in[i])) for 8 values at a time, in and out may alias
+ * \return number of values processed, the remaining values are left to the caller
+ */
+        __attribute__((target("avx2")))
+        inline size_t SigmoidAVX2(const float* in, size_t n, float* out) {
+            const __m256 sign = _mm256_set1_ps(-0.0f);
+            const __m256 one = _mm256_set1_ps(1.0f);
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                _mm256_storeu_ps(out + i, _mm256_xor_ps(_mm256_loadu_ps(in + i), sign));
+            }
+            ExpAVX2(out, i, out);
+            for (size_t j = 0; j < i; j += 8) {
+                __m256 e = _mm256_loadu_ps(out + j);
+                _mm256_storeu_ps(out + j, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+            }
+            return i;
+        }
+#endif  // XGBOOST_USE_SIMD
+
+/*! \brief whether the running cpu has the vector math kernels, detected once */
+        inline bool HasVectorMath() {
+            static const bool avx2 = DetectLevel() >= kAVX2;
+            return avx2;
+        }
+
+/*! \brief out[i] = exp(in[i]), in and out may alias */
+        inline void Exp(const float* in, size_t n, float* out) {
+            size_t i = 0;
+#if XGBOOST_USE_SIMD
+            if (HasVectorMath()) i = ExpAVX2(in, n, out);
+#endif
+            for (; i < n; ++i) {
+                out[i] = ExpScalar(in[i]);
+            }
+        }
+
+/*! \brief out[i] = 1 / (1 + exp(-in[i])), in and out may alias */
+        inline void Sigmoid(const float* in, size_t n, float* out) {
+            size_t i = 0;
+#if XGBOOST_USE_SIMD
+            if (HasVectorMath()) i = SigmoidAVX2(in, n, out);
+#endif
+            for (; i < n; ++i) {
+                out[i] = 1.0f / (1.0f + ExpScalar(-in[i]));
+            }
+        }
+    }  // namespace simd
+}  // namespace xgboost
+
+#endif  // XGBOOST_SIMD_MATH_H_
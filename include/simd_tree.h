@@ -0,0 +1,219 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file simd_tree.h
+ * \brief traversal kernels that move several rows through one tree at a time
+ */
+#ifndef XGBOOST_SIMD_TREE_H_
+#define XGBOOST_SIMD_TREE_H_
+
+#include <limits>
+#include <string>
+#include "logging.h"
+#include "fvec.h"
+#include "flat_tree.h"
+
+/*! \brief whether the x86 SIMD kernels are compiled in */
+#ifndef XGBOOST_USE_SIMD
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XGBOOST_USE_SIMD 1
+#else
+#define XGBOOST_USE_SIMD 0
+#endif
+#endif
+
+#if XGBOOST_USE_SIMD
+#include <immintrin.h>
+#endif
+
+namespace xgboost {
+    namespace simd {
+/*! \brief instruction set used by batch traversal */
+        enum Level {
+            kScalar = 0,
+            kAVX2 = 1,
+            kAVX512 = 2
+        };
+
+/*! \brief the best instruction set supported by the running cpu */
+        inline Level DetectLevel() {
+#if XGBOOST_USE_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) return kAVX512;
+            if (__builtin_cpu_supports("avx2")) return kAVX2;
+#endif
+            return kScalar;
+        }
+
+/*!
+ * \brief parse the simd parameter, auto picks the best level the cpu supports
+ *  and a requested level is capped by what the cpu supports
+ * \param name one of auto, avx512, avx2, none
+ */
+        inline Level ParseLevel(const std::string& name) {
+            Level best = DetectLevel();
+            Level want = best;
+            if (name == "avx512") {
+                want = kAVX512;
+            } else if (name == "avx2") {
+                want = kAVX2;
+            } else if (name == "none" || name == "scalar") {
+                want = kScalar;
+            } else {
+                CHECK(name == "auto") << "unknown simd level: " << name;
+            }
+            return want < best ? want : best;
+        }
+
+/*!
+ * \brief whether rows can be addressed by 32 bit gather offsets
+ * \param stride distance between the entries of two rows
+ * \param nrow number of rows in use
+ */
+        inline bool CanGather(size_t stride, size_t nrow) {
+            return nrow * stride < static_cast<size_t>(std::numeric_limits<int>::max());
+        }
+
+#if XGBOOST_USE_SIMD
+/*!
+ * \brief add the leaf values of one tree to the margins of rows, 8 rows at a time.
+ *  Each lane follows its own row, the child is selected with blends instead of branches.
+ *  Lanes that reached a leaf are masked out of the remaining gathers, so the split
+ *  word of a leaf is never used to address a row.
+ * \param nodes nodes of the flat tree
+ * \param rows entries of the dense feature vector of the first row
+ * \param row_stride distance between the entries of two rows
+ * \param nrow number of rows
+ * \param out_margin margins of the rows
+ * \return number of rows processed, the remaining rows are left to the caller
+ */
+        __attribute__((target("avx2")))
+        inline size_t PredictTreeAVX2(const FlatTree::Node* nodes, const FVec::Entry* rows,
+                                      size_t row_stride, size_t nrow, bst_float* out_margin) {
+            if (!CanGather(row_stride, nrow)) return 0;
+            // nodes are three 32 bit words: split index, split condition or leaf value, right child
+            const int* words = reinterpret_cast<const int*>(nodes);
+            const float* values = reinterpret_cast<const float*>(words + 1);
+            const int* feats = reinterpret_cast<const int*>(rows);
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i one = _mm256_set1_epi32(1);
+            const __m256i three = _mm256_set1_epi32(3);
+            const __m256i missing_flag = _mm256_set1_epi32(-1);
+            const __m256i index_mask = _mm256_set1_epi32(0x7fffffff);
+            const __m256i stride = _mm256_set1_epi32(static_cast<int>(row_stride));
+            const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+            size_t r = 0;
+            for (; r + 8 <= nrow; r += 8) {
+                __m256i row_base = _mm256_mullo_epi32(
+                    _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(r)), lane), stride);
+                __m256i nid = zero;
+                while (true) {
+                    __m256i word = _mm256_mullo_epi32(nid, three);
+                    __m256i cright = _mm256_i32gather_epi32(words + 2, word, 4);
+                    __m256i is_leaf = _mm256_cmpgt_epi32(zero, cright);
+                    if (_mm256_movemask_epi8(is_leaf) == -1) break;
+                    __m256i active = _mm256_xor_si256(is_leaf, missing_flag);
+                    __m256i sindex = _mm256_mask_i32gather_epi32(zero, words, word, active, 4);
+                    __m256 cond = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), values, word,
+                                                           _mm256_castsi256_ps(active), 4);
+                    __m256i fidx = _mm256_add_epi32(row_base, _mm256_and_si256(sindex, index_mask));
+                    __m256i fvalue = _mm256_mask_i32gather_epi32(missing_flag, feats, fidx, active, 4);
+                    __m256i missing = _mm256_cmpeq_epi32(fvalue, missing_flag);
+                    __m256i less = _mm256_castps_si256(
+                        _mm256_cmp_ps(_mm256_castsi256_ps(fvalue), cond, _CMP_LT_OQ));
+                    __m256i default_left = _mm256_cmpgt_epi32(zero, sindex);
+                    __m256i go_left = _mm256_blendv_epi8(less, default_left, missing);
+                    __m256i next = _mm256_blendv_epi8(cright, _mm256_add_epi32(nid, one), go_left);
+                    nid = _mm256_blendv_epi8(next, nid, is_leaf);
+                }
+                __m256 leaf = _mm256_i32gather_ps(values, _mm256_mullo_epi32(nid, three), 4);
+                _mm256_storeu_ps(out_margin + r, _mm256_add_ps(_mm256_loadu_ps(out_margin + r), leaf));
+            }
+            return r;
+        }
+
+/*!
+ * \brief add the leaf values of one tree to the margins of rows, 16 rows at a time.
+ *  Lanes that reached a leaf are masked out of the remaining gathers.
+ * \param nodes nodes of the flat tree
+ * \param rows entries of the dense feature vector of the first row
+ * \param row_stride distance between the entries of two rows
+ * \param nrow number of rows
+ * \param out_margin margins of the rows
+ * \return number of rows processed, the remaining rows are left to the caller
+ */
+        __attribute__((target("avx512f")))
+        inline size_t PredictTreeAVX512(const FlatTree::Node* nodes, const FVec::Entry* rows,
+                                        size_t row_stride, size_t nrow, bst_float* out_margin) {
+            if (!CanGather(row_stride, nrow)) return 0;
+            const int* words = reinterpret_cast<const int*>(nodes);
+            const float* values = reinterpret_cast<const float*>(words + 1);
+            const int* feats = reinterpret_cast<const int*>(rows);
+            const __m512i zero = _mm512_setzero_si512();
+            const __m512i one = _mm512_set1_epi32(1);
+            const __m512i three = _mm512_set1_epi32(3);
+            const __m512i missing_flag = _mm512_set1_epi32(-1);
+            const __m512i index_mask = _mm512_set1_epi32(0x7fffffff);
+            const __m512i stride = _mm512_set1_epi32(static_cast<int>(row_stride));
+            const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                                   8, 9, 10, 11, 12, 13, 14, 15);
+
+            size_t r = 0;
+            for (; r + 16 <= nrow; r += 16) {
+                __m512i row_base = _mm512_mullo_epi32(
+                    _mm512_add_epi32(_mm512_set1_epi32(static_cast<int>(r)), lane), stride);
+                __m512i nid = zero;
+                __mmask16 active = 0xFFFF;
+                while (true) {
+                    __m512i word = _mm512_mullo_epi32(nid, three);
+                    __m512i cright = _mm512_mask_i32gather_epi32(zero, active, word, words + 2, 4);
+                    active &= ~_mm512_mask_cmplt_epi32_mask(active, cright, zero);
+                    if (active == 0) break;
+                    __m512i sindex = _mm512_mask_i32gather_epi32(zero, active, word, words, 4);
+                    __m512 cond = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), active, word, values, 4);
+                    __m512i fidx = _mm512_add_epi32(row_base, _mm512_and_si512(sindex, index_mask));
+                    __m512i fvalue = _mm512_mask_i32gather_epi32(missing_flag, active, fidx, feats, 4);
+                    __mmask16 missing = _mm512_cmpeq_epi32_mask(fvalue, missing_flag);
+                    __mmask16 less = _mm512_cmp_ps_mask(_mm512_castsi512_ps(fvalue), cond, _CMP_LT_OQ);
+                    __mmask16 default_left = _mm512_cmplt_epi32_mask(sindex, zero);
+                    __mmask16 go_left = (missing & default_left) | (~missing & less);
+                    __m512i next = _mm512_mask_blend_epi32(go_left, cright, _mm512_add_epi32(nid, one));
+                    nid = _mm512_mask_mov_epi32(nid, active, next);
+                }
+                // every lane holds a leaf now
+                __m512 leaf = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF,
+                                                       _mm512_mullo_epi32(nid, three), values, 4);
+                _mm512_storeu_ps(out_margin + r, _mm512_add_ps(_mm512_loadu_ps(out_margin + r), leaf));
+            }
+            return r;
+        }
+#endif  // XGBOOST_USE_SIMD
+
+/*!
+ * \brief add the leaf values of one tree to the margins of rows with the given kernel
+ * \param level instruction set to use
+ * \param nodes nodes of the flat tree
+ * \param rows entries of the dense feature vector of the first row
+ * \param row_stride distance between the entries of two rows
+ * \param nrow number of rows
+ * \param out_margin margins of the rows
+ * \return number of rows processed, the remaining rows are left to the caller
+ */
+        inline size_t PredictTree(Level level, const FlatTree::Node* nodes, const FVec::Entry* rows,
+                                  size_t row_stride, size_t nrow, bst_float* out_margin) {
+#if XGBOOST_USE_SIMD
+            if (level == kAVX512) return PredictTreeAVX512(nodes, rows, row_stride, nrow, out_margin);
+            if (level == kAVX2) return PredictTreeAVX2(nodes, rows, row_stride, nrow, out_margin);
+#endif
+            return 0;
+        }
+
+/*! \brief add the leaf values of one tree to the margins of the rows of a block */
+        inline size_t PredictTree(Level level, const FlatTree::Node* nodes, const FVecBlock& block,
+                                  size_t nrow, bst_float* out_margin) {
+            return PredictTree(level, nodes, block.row(0), block.size(), nrow, out_margin);
+        }
+    }  // namespace simd
+}  // namespace xgboost
+
+#endif  // XGBOOST_SIMD_TREE_H_
@@ -0,0 +1,197 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file thread_pool.h
+ * \brief persistent work-stealing thread pool used by batch prediction
+ */
+#ifndef XGBOOST_THREAD_POOL_H_
+#define XGBOOST_THREAD_POOL_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "base.h"
+
+namespace xgboost {
+/*!
+ * \brief a fixed set of worker threads that run ParallelFor jobs.
+ *
+ *  The tasks of a job are split into one contiguous range per thread,
+ *  a thread consumes its own range from the front and steals from the
+ *  back of the other ranges once it runs dry. The calling thread takes
+ *  part in the job as thread 0, so a pool of n threads starts n - 1 workers.
+ */
+    class ThreadPool {
+    public:
+        /*! \brief function run for each task, given task id and thread id */
+        typedef std::function<void(size_t, int)> TaskFunction;
+
+        /*!
+         * \brief create the pool
+         * \param nthread number of threads taking part in a job, <= 0 means hardware concurrency
+         */
+        explicit ThreadPool(int nthread) {
+            if (nthread <= 0) {
+                nthread = static_cast<int>(std::thread::hardware_concurrency());
+            }
+            nthread_ = std::max(nthread, 1);
+            queues_.reset(new TaskQueue[nthread_]);
+            for (int tid = 1; tid < nthread_; ++tid) {
+                workers_.emplace_back(&ThreadPool::WorkerLoop, this, tid);
+            }
+        }
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                shutdown_ = true;
+            }
+            wake_cv_.notify_all();
+            for (std::thread& worker : workers_) {
+                worker.join();
+            }
+        }
+
+        /*! \brief number of threads taking part in a job, thread ids are in [0, num_threads()) */
+        inline int num_threads() const {
+            return nthread_;
+        }
+
+        /*!
+         * \brief run fn(task, thread_id) for every task in [0, ntask) and wait for completion.
+         *  Concurrent calls are serialized; a call made from inside a task runs inline
+         *  on the calling thread with thread id 0. The first exception thrown by a
+         *  task is rethrown to the caller after all tasks are done.
+         * \param ntask number of tasks
+         * \param fn function run for each task
+         */
+        inline void ParallelFor(size_t ntask, const TaskFunction& fn) {
+            if (ntask == 0) return;
+            if (nthread_ == 1 || ntask == 1 || InTask()) {
+                for (size_t i = 0; i < ntask; ++i) {
+                    fn(i, 0);
+                }
+                return;
+            }
+            std::lock_guard<std::mutex> run_lock(run_mutex_);
+            job_ = &fn;
+            error_ = nullptr;
+            for (int tid = 0; tid < nthread_; ++tid) {
+                queues_[tid].begin = ntask * tid / nthread_;
+                queues_[tid].end = ntask * (tid + 1) / nthread_;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_ = nthread_ - 1;
+                ++generation_;
+            }
+            wake_cv_.notify_all();
+
+            InTask() = true;
+            RunTasks(0);
+            InTask() = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_cv_.wait(lock, [this]() { return pending_ == 0; });
+            }
+            job_ = nullptr;
+            if (error_ != nullptr) {
+                std::rethrow_exception(error_);
+            }
+        }
+
+    private:
+        /*! \brief range of task ids owned by one thread */
+        struct TaskQueue {
+            std::mutex mutex;
+            size_t begin = 0;
+            size_t end = 0;
+        };
+
+        // whether the current thread is running a task of any pool
+        static bool& InTask() {
+            static thread_local bool in_task = false;
+            return in_task;
+        }
+
+        inline void WorkerLoop(int tid) {
+            InTask() = true;
+            uint64_t seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_cv_.wait(lock, [&]() { return shutdown_ || generation_ != seen; });
+                    if (shutdown_) return;
+                    seen = generation_;
+                }
+                RunTasks(tid);
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (--pending_ == 0) done_cv_.notify_all();
+                }
+            }
+        }
+
+        inline void RunTasks(int tid) {
+            size_t task;
+            while (PopTask(tid, &task) || StealTask(tid, &task)) {
+                try {
+                    (*job_)(task, tid);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex_);
+                    if (error_ == nullptr) error_ = std::current_exception();
+                }
+            }
+        }
+
+        // take the next task from the front of the own range
+        inline bool PopTask(int tid, size_t* task) {
+            TaskQueue& q = queues_[tid];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.begin == q.end) return false;
+            *task = q.begin++;
+            return true;
+        }
+
+        // take a task from the back of another thread's range
+        inline bool StealTask(int tid, size_t* task) {
+            for (int k = 1; k < nthread_; ++k) {
+                TaskQueue& q = queues_[(tid + k) % nthread_];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if (q.begin == q.end) continue;
+                *task = --q.end;
+                return true;
+            }
+            return false;
+        }
+
+        // number of threads taking part in a job
+        int nthread_;
+        // worker threads, thread ids 1 .. nthread_ - 1
+        std::vector<std::thread> workers_;
+        // per-thread task ranges of the current job
+        std::unique_ptr<TaskQueue[]> queues_;
+        // function of the current job
+        const TaskFunction* job_ = nullptr;
+        // first exception raised by the current job
+        std::exception_ptr error_;
+        std::mutex error_mutex_;
+        // serializes jobs submitted from different threads
+        std::mutex run_mutex_;
+        // protects generation_, pending_ and shutdown_
+        std::mutex mutex_;
+        std::condition_variable wake_cv_;
+        std::condition_variable done_cv_;
+        uint64_t generation_ = 0;
+        int pending_ = 0;
+        bool shutdown_ = false;
+
+        DISALLOW_COPY_AND_ASSIGN(ThreadPool);
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_THREAD_POOL_H_
@@ -13,7 +13,7 @@
 #include <cstring>
 #include <algorithm>
 #include <unordered_map>
-#include <fstream>
+#include "io.h"
 #include "logging.h"
 #include "fvec.h"
 
@@ -207,6 +207,34 @@ namespace xgboost {
         };
 
     protected:
+        // check that the nodes reachable from the roots form disjoint trees whose children
+        // are live nodes in range, visiting a node twice means a cycle or a shared child
+        inline LoadStatus CheckStructure() const {
+            std::vector<char> visited(nodes.size(), 0);
+            std::vector<int> stack;
+            for (int root = 0; root < param.num_roots; ++root) {
+                stack.push_back(root);
+                while (!stack.empty()) {
+                    int nid = stack.back();
+                    stack.pop_back();
+                    if (visited[nid] || nodes[nid].is_deleted()) {
+                        return LoadStatus::Corrupt("node " + std::to_string(nid) +
+                                                   " is reached twice or deleted");
+                    }
+                    visited[nid] = 1;
+                    if (nodes[nid].is_leaf()) continue;
+                    for (int child : {nodes[nid].cleft(), nodes[nid].cright()}) {
+                        if (child < param.num_roots || child >= param.num_nodes) {
+                            return LoadStatus::Corrupt("node " + std::to_string(nid) +
+                                                       " has child out of range");
+                        }
+                        stack.push_back(child);
+                    }
+                }
+            }
+            return LoadStatus();
+        }
+
         // vector of nodes
         std::vector <Node> nodes;
         // free node space, used during training process
@@ -334,19 +362,38 @@ namespace xgboost {
         }
 
         /*!
-         * \brief load model from stream
+         * \brief load model from stream, every section is checked against the bytes left
+         *  and the node links must form trees, so traversal stays in range and terminates
          * \param fi input stream
+         * \return status of the load, the tree is unusable unless it is ok
          */
-        inline void Load(std::ifstream& ifile) {
-            ifile.read((char*)&param, sizeof(TreeParam));
-            nodes.resize(param.num_nodes);
-            stats.resize(param.num_nodes);
+        inline LoadStatus Load(MemoryStream& fi) {
+            if (!fi.Read(&param, sizeof(TreeParam))) return LoadStatus::Truncated("tree parameters");
+            if (param.num_roots < 1 || param.num_nodes < param.num_roots ||
+                param.num_deleted < 0 || param.num_deleted > param.num_nodes - param.num_roots ||
+                param.size_leaf_vector < 0) {
+                return LoadStatus::Corrupt("invalid tree parameters");
+            }
+            size_t num_nodes = static_cast<size_t>(param.num_nodes);
+            if (num_nodes > fi.Remaining() / (sizeof(Node) + sizeof(NodeStat))) {
+                return LoadStatus::Truncated("tree nodes");
+            }
+            nodes.resize(num_nodes);
+            stats.resize(num_nodes);
+            fi.Read(&nodes[0], sizeof(Node) * nodes.size());
+            fi.Read(&stats[0], sizeof(NodeStat) * stats.size());
 
-            ifile.read((char*)&nodes[0], sizeof(Node) * nodes.size());
-            ifile.read((char*)&stats[0], sizeof(NodeStat) * stats.size());
-            
+            leaf_vector.clear();
             if (param.size_leaf_vector != 0) {
-                ifile.read((char*)&leaf_vector[0], param.num_nodes * param.size_leaf_vector);
+                // stored as a length prefixed vector of floats
+                uint64_t len;
+                if (!fi.Read(&len, sizeof(len))) return LoadStatus::Truncated("leaf vector");
+                if (len != static_cast<uint64_t>(num_nodes) * param.size_leaf_vector) {
+                    return LoadStatus::Corrupt("leaf vector size does not match tree");
+                }
+                if (len > fi.Remaining() / sizeof(bst_float)) return LoadStatus::Truncated("leaf vector");
+                leaf_vector.resize(len);
+                fi.Read(dmlc::BeginPtr(leaf_vector), sizeof(bst_float) * leaf_vector.size());
             }
 
             // chg deleted nodes
@@ -354,10 +401,12 @@ namespace xgboost {
             for (int i = param.num_roots; i < param.num_nodes; ++i) {
                 if (nodes[i].is_deleted()) deleted_nodes.push_back(i);
             }
-            CHECK_EQ(static_cast<int>(deleted_nodes.size()), param.num_deleted);
+            if (static_cast<int>(deleted_nodes.size()) != param.num_deleted) {
+                return LoadStatus::Corrupt("number of deleted nodes does not match tree");
+            }
+            return this->CheckStructure();
         }
 
-
         /*!
          * \brief add child nodes to node
          * \param nid node id to add children to
@@ -470,6 +519,14 @@ namespace xgboost {
          */
         inline void FillNodeMeanValues();
 
+        /*!
+         * \brief mean of the leaf values under a node weighted by their cover
+         * \param nid node id, FillNodeMeanValues must have been called
+         */
+        inline bst_float node_mean_value(int nid) const {
+            return node_mean_values[nid];
+        }
+
     private:
         inline bst_float FillNodeMeanValue(int nid);
 
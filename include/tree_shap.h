@@ -0,0 +1,345 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file tree_shap.h
+ * \brief feature contributions of a forest: SHAP values by TreeSHAP and the Saabas approximation
+ */
+#ifndef XGBOOST_TREE_SHAP_H_
+#define XGBOOST_TREE_SHAP_H_
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "fvec.h"
+#include "tree_model.h"
+
+namespace xgboost {
+/*!
+ * \brief trees of a forest laid out for feature contributions.
+ *
+ *  Each node keeps its split, the share of its cover that goes to each child
+ *  and the cover weighted mean of the leaves below it, in preorder so the left
+ *  child follows its parent. TreeSHAP (Lundberg et al., Consistent
+ *  Individualized Feature Attribution for Tree Ensembles) walks a tree once
+ *  per row and keeps the unique features on the path with their permutation
+ *  weights in caller provided scratch; the arithmetic is the one of xgboost,
+ *  so the values agree with it. The Saabas approximation follows the decision
+ *  path and credits each split with the change of the node mean.
+ */
+    class ShapForest {
+    public:
+        /*! \brief element of the unique feature path of TreeSHAP */
+        struct PathElement {
+            /*! \brief feature of the split, -1 for the root element */
+            int feature_index;
+            /*! \brief share of the cover that takes this branch */
+            bst_float zero_fraction;
+            /*! \brief 1 if the row takes this branch, 0 otherwise */
+            bst_float one_fraction;
+            /*! \brief permutation weight of the path */
+            bst_float pweight;
+        };
+
+        /*! \brief node in preorder, the left child of node i is node i + 1 */
+        struct Node {
+            /*! \brief right child, -1 for a leaf */
+            int right;
+            /*! \brief split feature with the default left bit on top */
+            unsigned sindex;
+            /*! \brief split condition, or the leaf value */
+            bst_float cond;
+            /*! \brief cover of each child divided by the cover of the node */
+            bst_float left_fraction;
+            bst_float right_fraction;
+            /*! \brief mean of the leaf values below the node weighted by cover */
+            bst_float mean;
+        };
+
+        /*!
+         * \brief build the layout of the trees
+         * \param trees the trees of the model, their node means are filled
+         */
+        inline void Build(const std::vector<std::unique_ptr<RegTree> >& trees) {
+            this->Clear();
+            max_depth_ = 0;
+            for (const auto& tree : trees) {
+                tree->FillNodeMeanValues();
+                offset_.push_back(nodes_.size());
+                feature_offset_.push_back(features_.size());
+                int depth = 0;
+                this->Pack(*tree, 0, 0, &depth);
+                max_depth_ = std::max(max_depth_, depth);
+                // unique features of the tree, conditioning on any other one changes nothing
+                for (size_t i = offset_.back(); i < nodes_.size(); ++i) {
+                    if (nodes_[i].right >= 0) features_.push_back(nodes_[i].sindex & ((1U << 31) - 1U));
+                }
+                std::sort(features_.begin() + feature_offset_.back(), features_.end());
+                features_.erase(std::unique(features_.begin() + feature_offset_.back(), features_.end()),
+                                features_.end());
+            }
+            offset_.push_back(nodes_.size());
+            feature_offset_.push_back(features_.size());
+        }
+
+        /*! \brief drop the layout */
+        inline void Clear() {
+            nodes_.clear();
+            offset_.clear();
+            features_.clear();
+            feature_offset_.clear();
+            max_depth_ = 0;
+        }
+
+        /*! \brief number of trees, 0 if the forest was not built */
+        inline size_t num_trees() const {
+            return offset_.empty() ? 0 : offset_.size() - 1;
+        }
+
+        /*! \brief number of path elements of the scratch that Contributions needs */
+        inline size_t path_scratch_size() const {
+            size_t maxd = static_cast<size_t>(max_depth_) + 2;
+            return maxd * (maxd + 1) / 2;
+        }
+
+        /*! \brief the distinct features tree i splits on, in increasing order */
+        inline const unsigned* split_features(size_t i) const {
+            return features_.data() + feature_offset_[i];
+        }
+
+        /*! \brief number of distinct features tree i splits on */
+        inline size_t num_split_features(size_t i) const {
+            return feature_offset_[i + 1] - feature_offset_[i];
+        }
+
+        /*! \brief expected value of tree i over the training data, the bias of its contributions */
+        inline bst_float expected_value(size_t i) const {
+            return nodes_[offset_[i]].mean;
+        }
+
+        /*!
+         * \brief add the SHAP values of tree i for a row
+         * \param i index of the tree
+         * \param feat entries of the dense feature vector of the row
+         * \param phi contribution of each feature, the expected value is not added
+         * \param path scratch of path_scratch_size() elements
+         * \param condition 0 for SHAP values; 1 or -1 gives them with condition_feature
+         *  fixed to present or to missing, used for interaction values
+         * \param condition_feature the feature a non zero condition applies to
+         */
+        inline void Contributions(size_t i, const FVec::Entry* feat, bst_float* phi,
+                                  PathElement* path, int condition = 0,
+                                  unsigned condition_feature = 0) const {
+            this->TreeShap(nodes_.data() + offset_[i], feat, phi, 0, 0, path, 1, 1, -1, condition,
+                           condition_feature, 1);
+        }
+
+        /*!
+         * \brief add the Saabas contributions of tree i for a row
+         * \param i index of the tree
+         * \param feat entries of the dense feature vector of the row
+         * \param phi contribution of each feature, the expected value is not added
+         */
+        inline void ApproxContributions(size_t i, const FVec::Entry* feat, bst_float* phi) const {
+            const Node* nodes = nodes_.data() + offset_[i];
+            int nid = 0;
+            unsigned split_index = 0;
+            bst_float node_value = nodes[0].mean;
+            if (nodes[0].right < 0) return;
+            while (nodes[nid].right >= 0) {
+                split_index = nodes[nid].sindex & ((1U << 31) - 1U);
+                nid = this->Next(nodes, nid, feat);
+                bst_float new_value = nodes[nid].mean;
+                phi[split_index] += new_value - node_value;
+                node_value = new_value;
+            }
+            phi[split_index] += nodes[nid].cond - node_value;
+        }
+
+        /*! \brief bytes used by the nodes */
+        inline size_t MemoryBytes() const {
+            return nodes_.size() * sizeof(Node);
+        }
+
+    private:
+        // append the subtree of nid in preorder, depth receives its depth
+        inline void Pack(const RegTree& tree, int nid, int d, int* depth) {
+            const RegTree::Node& src = tree[nid];
+            size_t pos = nodes_.size();
+            nodes_.push_back(Node());
+            nodes_[pos].mean = tree.node_mean_value(nid);
+            *depth = std::max(*depth, d);
+            if (src.is_leaf()) {
+                nodes_[pos].right = -1;
+                nodes_[pos].sindex = 0;
+                nodes_[pos].cond = src.leaf_value();
+                nodes_[pos].left_fraction = 0.0f;
+                nodes_[pos].right_fraction = 0.0f;
+                return;
+            }
+            bst_float cover = tree.stat(nid).sum_hess;
+            nodes_[pos].sindex = src.split_index() | (src.default_left() ? 1U << 31 : 0U);
+            nodes_[pos].cond = src.split_cond();
+            nodes_[pos].left_fraction = tree.stat(src.cleft()).sum_hess / cover;
+            nodes_[pos].right_fraction = tree.stat(src.cright()).sum_hess / cover;
+            this->Pack(tree, src.cleft(), d + 1, depth);
+            nodes_[pos].right = static_cast<int>(nodes_.size() - offset_.back());
+            this->Pack(tree, src.cright(), d + 1, depth);
+        }
+
+        // child of split nid that the row follows
+        inline static int Next(const Node* nodes, int nid, const FVec::Entry* feat) {
+            const Node& node = nodes[nid];
+            unsigned fid = node.sindex & ((1U << 31) - 1U);
+            const FVec::Entry& e = feat[fid];
+            bool go_left = e.flag == -1 ? (node.sindex >> 31) != 0 : e.fvalue < node.cond;
+            return go_left ? nid + 1 : node.right;
+        }
+
+        // extend the path with a fraction of zero and one extensions
+        inline static void ExtendPath(PathElement* unique_path, unsigned unique_depth,
+                                      bst_float zero_fraction, bst_float one_fraction,
+                                      int feature_index) {
+            unique_path[unique_depth].feature_index = feature_index;
+            unique_path[unique_depth].zero_fraction = zero_fraction;
+            unique_path[unique_depth].one_fraction = one_fraction;
+            unique_path[unique_depth].pweight = (unique_depth == 0 ? 1.0f : 0.0f);
+            for (int i = static_cast<int>(unique_depth) - 1; i >= 0; i--) {
+                unique_path[i + 1].pweight += one_fraction * unique_path[i].pweight * (i + 1) /
+                                              static_cast<bst_float>(unique_depth + 1);
+                unique_path[i].pweight = zero_fraction * unique_path[i].pweight * (unique_depth - i) /
+                                         static_cast<bst_float>(unique_depth + 1);
+            }
+        }
+
+        // undo a previous extension of the path
+        inline static void UnwindPath(PathElement* unique_path, unsigned unique_depth,
+                                      unsigned path_index) {
+            const bst_float one_fraction = unique_path[path_index].one_fraction;
+            const bst_float zero_fraction = unique_path[path_index].zero_fraction;
+            bst_float next_one_portion = unique_path[unique_depth].pweight;
+            for (int i = static_cast<int>(unique_depth) - 1; i >= 0; --i) {
+                if (one_fraction != 0) {
+                    const bst_float tmp = unique_path[i].pweight;
+                    unique_path[i].pweight = next_one_portion * (unique_depth + 1) /
+                                             static_cast<bst_float>((i + 1) * one_fraction);
+                    next_one_portion = tmp - unique_path[i].pweight * zero_fraction * (unique_depth - i) /
+                                             static_cast<bst_float>(unique_depth + 1);
+                } else {
+                    unique_path[i].pweight = (unique_path[i].pweight * (unique_depth + 1)) /
+                                             static_cast<bst_float>(zero_fraction * (unique_depth - i));
+                }
+            }
+            for (unsigned i = path_index; i < unique_depth; ++i) {
+                unique_path[i].feature_index = unique_path[i + 1].feature_index;
+                unique_path[i].zero_fraction = unique_path[i + 1].zero_fraction;
+                unique_path[i].one_fraction = unique_path[i + 1].one_fraction;
+            }
+        }
+
+        // total permutation weight if a previous extension of the path were undone
+        inline static bst_float UnwoundPathSum(const PathElement* unique_path, unsigned unique_depth,
+                                               unsigned path_index) {
+            const bst_float one_fraction = unique_path[path_index].one_fraction;
+            const bst_float zero_fraction = unique_path[path_index].zero_fraction;
+            bst_float next_one_portion = unique_path[unique_depth].pweight;
+            bst_float total = 0;
+            for (int i = static_cast<int>(unique_depth) - 1; i >= 0; --i) {
+                if (one_fraction != 0) {
+                    const bst_float tmp = next_one_portion * (unique_depth + 1) /
+                                          static_cast<bst_float>((i + 1) * one_fraction);
+                    total += tmp;
+                    next_one_portion = unique_path[i].pweight - tmp * zero_fraction *
+                                       ((unique_depth - i) / static_cast<bst_float>(unique_depth + 1));
+                } else {
+                    total += (unique_path[i].pweight / zero_fraction) /
+                             ((unique_depth - i) / static_cast<bst_float>(unique_depth + 1));
+                }
+            }
+            return total;
+        }
+
+        // recursive computation of the SHAP values of the subtree of nid
+        inline void TreeShap(const Node* nodes, const FVec::Entry* feat, bst_float* phi, int nid,
+                             unsigned unique_depth, PathElement* parent_unique_path,
+                             bst_float parent_zero_fraction, bst_float parent_one_fraction,
+                             int parent_feature_index, int condition, unsigned condition_feature,
+                             bst_float condition_fraction) const {
+            const Node& node = nodes[nid];
+            // no weight comes down to this node
+            if (condition_fraction == 0) return;
+
+            PathElement* unique_path = parent_unique_path + unique_depth + 1;
+            std::copy(parent_unique_path, parent_unique_path + unique_depth + 1, unique_path);
+            if (condition == 0 || condition_feature != static_cast<unsigned>(parent_feature_index)) {
+                ExtendPath(unique_path, unique_depth, parent_zero_fraction, parent_one_fraction,
+                           parent_feature_index);
+            }
+
+            if (node.right < 0) {
+                for (unsigned i = 1; i <= unique_depth; ++i) {
+                    const bst_float w = UnwoundPathSum(unique_path, unique_depth, i);
+                    const PathElement& el = unique_path[i];
+                    phi[el.feature_index] += w * (el.one_fraction - el.zero_fraction) * node.cond *
+                                             condition_fraction;
+                }
+                return;
+            }
+
+            // the hot branch is the one the row follows
+            const unsigned split_index = node.sindex & ((1U << 31) - 1U);
+            const int hot_index = this->Next(nodes, nid, feat);
+            const int cold_index = hot_index == nid + 1 ? node.right : nid + 1;
+            const bst_float hot_zero_fraction = hot_index == nid + 1 ? node.left_fraction :
+                                                node.right_fraction;
+            const bst_float cold_zero_fraction = hot_index == nid + 1 ? node.right_fraction :
+                                                 node.left_fraction;
+            bst_float incoming_zero_fraction = 1;
+            bst_float incoming_one_fraction = 1;
+
+            // a split on a feature already on the path is undone and redone here
+            unsigned path_index = 0;
+            for (; path_index <= unique_depth; ++path_index) {
+                if (static_cast<unsigned>(unique_path[path_index].feature_index) == split_index) break;
+            }
+            if (path_index != unique_depth + 1) {
+                incoming_zero_fraction = unique_path[path_index].zero_fraction;
+                incoming_one_fraction = unique_path[path_index].one_fraction;
+                UnwindPath(unique_path, unique_depth, path_index);
+                unique_depth -= 1;
+            }
+
+            // divide the condition fraction among the children
+            bst_float hot_condition_fraction = condition_fraction;
+            bst_float cold_condition_fraction = condition_fraction;
+            if (condition > 0 && split_index == condition_feature) {
+                cold_condition_fraction = 0;
+                unique_depth -= 1;
+            } else if (condition < 0 && split_index == condition_feature) {
+                hot_condition_fraction *= hot_zero_fraction;
+                cold_condition_fraction *= cold_zero_fraction;
+                unique_depth -= 1;
+            }
+
+            this->TreeShap(nodes, feat, phi, hot_index, unique_depth + 1, unique_path,
+                           hot_zero_fraction * incoming_zero_fraction, incoming_one_fraction,
+                           static_cast<int>(split_index), condition, condition_feature,
+                           hot_condition_fraction);
+            this->TreeShap(nodes, feat, phi, cold_index, unique_depth + 1, unique_path,
+                           cold_zero_fraction * incoming_zero_fraction, 0,
+                           static_cast<int>(split_index), condition, condition_feature,
+                           cold_condition_fraction);
+        }
+
+        // nodes of all trees, each tree in preorder
+        std::vector<Node> nodes_;
+        // first node of each tree, offset_[num_trees] is the total
+        std::vector<size_t> offset_;
+        // distinct split features of each tree, one run per tree
+        std::vector<unsigned> features_;
+        // first split feature of each tree, feature_offset_[num_trees] is the total
+        std::vector<size_t> feature_offset_;
+        // depth of the deepest tree
+        int max_depth_ = 0;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_TREE_SHAP_H_
@@ -0,0 +1,228 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file unrolled_tree.h
+ * \brief traversal kernels specialized by tree depth for complete trees
+ */
+#ifndef XGBOOST_UNROLLED_TREE_H_
+#define XGBOOST_UNROLLED_TREE_H_
+
+#include <vector>
+#include "fvec.h"
+#include "flat_tree.h"
+
+namespace xgboost {
+    namespace unrolled {
+/*! \brief split of a complete tree stored in heap order, the children of node i are 2i+1 and 2i+2 */
+        struct Node {
+            /*! \brief split feature, the top bit is set when missing values go left */
+            unsigned sindex;
+            /*! \brief split condition */
+            bst_float cond;
+        };
+
+/*!
+ * \brief add the leaf value of a tree to the margin of each row
+ * \param nodes splits of the complete tree in heap order
+ * \param leaves leaf values from left to right
+ * \param rows entries of the dense feature vector of the first row
+ * \param row_stride distance between the entries of two rows
+ * \param nrow number of rows
+ * \param out margin of the first row
+ * \param out_stride distance between the margins of two rows
+ */
+        typedef void (*Kernel)(const Node* nodes, const bst_float* leaves, const FVec::Entry* rows,
+                               size_t row_stride, size_t nrow, bst_float* out, size_t out_stride);
+
+/*!
+ * \brief walk D levels down from nid with the recursion unrolled at compile time.
+ *  kMissing = false drops the missing value check for rows known to be dense.
+ */
+        template<int D, bool kMissing>
+        struct Descend {
+            inline static unsigned Run(const Node* nodes, const FVec::Entry* feat, unsigned nid) {
+                const Node& node = nodes[nid];
+                const FVec::Entry& e = feat[node.sindex & ((1U << 31) - 1U)];
+                bool go_left = kMissing && e.flag == -1 ? (node.sindex >> 31) != 0 :
+                               e.fvalue < node.cond;
+                return Descend<D - 1, kMissing>::Run(nodes, feat, 2 * nid + 2 - go_left);
+            }
+        };
+
+        template<bool kMissing>
+        struct Descend<0, kMissing> {
+            inline static unsigned Run(const Node*, const FVec::Entry*, unsigned nid) {
+                return nid;
+            }
+        };
+
+/*! \brief traversal of a complete tree of depth D without leaf checks */
+        template<int D, bool kMissing>
+        inline void PredictComplete(const Node* nodes, const bst_float* leaves,
+                                    const FVec::Entry* rows, size_t row_stride, size_t nrow,
+                                    bst_float* out, size_t out_stride) {
+            const unsigned first_leaf = (1U << D) - 1U;
+            for (size_t r = 0; r < nrow; ++r) {
+                unsigned nid = Descend<D, kMissing>::Run(nodes, rows + r * row_stride, 0);
+                out[r * out_stride] += leaves[nid - first_leaf];
+            }
+        }
+
+/*! \brief picks the kernel of a depth at run time among depths [0, D] */
+        template<int D>
+        struct KernelTable {
+            inline static Kernel Get(int depth, bool missing) {
+                if (depth == D) {
+                    return missing ? &PredictComplete<D, true> : &PredictComplete<D, false>;
+                }
+                return KernelTable<D - 1>::Get(depth, missing);
+            }
+        };
+
+        template<>
+        struct KernelTable<-1> {
+            inline static Kernel Get(int, bool) {
+                return nullptr;
+            }
+        };
+    }  // namespace unrolled
+
+/*!
+ * \brief complete-tree layout of the trees of a forest that allow it.
+ *
+ *  A tree whose depth is at most kMaxDepth and whose leaves fill at least half
+ *  of the last level is padded to a complete tree: a leaf above the last level
+ *  becomes a split whose subtrees all end in copies of the leaf. Such a tree is
+ *  traversed by a kernel with the depth as template parameter, so the loop is
+ *  unrolled and has neither leaf checks nor data dependent trip count. The
+ *  kernel is chosen per tree at build time, other trees keep the flat layout.
+ */
+    class UnrolledForest {
+    public:
+        /*! \brief deepest tree that is unrolled, padding costs up to 2^kMaxDepth leaves */
+        static const int kMaxDepth = 10;
+
+        /*!
+         * \brief build the layout of every tree that qualifies
+         * \param forest the compiled forest
+         */
+        inline void Build(const FlatForest& forest) {
+            this->Clear();
+            trees_.resize(forest.num_trees());
+            for (size_t i = 0; i < forest.num_trees(); ++i) {
+                const FlatTree tree = forest[i];
+                int depth = Depth(tree);
+                size_t nleaf = (tree.size() + 1) / 2;
+                if (depth > kMaxDepth || (static_cast<size_t>(1) << depth) > 2 * nleaf) continue;
+                Tree& dst = trees_[i];
+                dst.node_begin = nodes_.size();
+                dst.leaf_begin = leaves_.size();
+                dst.kernel[0] = unrolled::KernelTable<kMaxDepth>::Get(depth, false);
+                dst.kernel[1] = unrolled::KernelTable<kMaxDepth>::Get(depth, true);
+                nodes_.resize(nodes_.size() + (static_cast<size_t>(1) << depth) - 1);
+                leaves_.resize(leaves_.size() + (static_cast<size_t>(1) << depth));
+                this->Fill(tree, 0, 0, 0, depth, dst);
+                ++num_unrolled_;
+            }
+        }
+
+        /*! \brief drop all trees */
+        inline void Clear() {
+            nodes_.clear();
+            leaves_.clear();
+            trees_.clear();
+            num_unrolled_ = 0;
+        }
+
+        /*!
+         * \brief add the leaf value of tree i to the margin of each row
+         * \param i index of the tree
+         * \param dense whether the caller guarantees that no row has missing values
+         * \param rows entries of the dense feature vector of the first row
+         * \param row_stride distance between the entries of two rows
+         * \param nrow number of rows
+         * \param out margin of the first row
+         * \param out_stride distance between the margins of two rows
+         * \return false if tree i is not unrolled and nothing was done
+         */
+        inline bool Predict(size_t i, bool dense, const FVec::Entry* rows, size_t row_stride,
+                            size_t nrow, bst_float* out, size_t out_stride) const {
+            if (!this->has_kernel(i)) return false;
+            const Tree& tree = trees_[i];
+            tree.kernel[dense ? 0 : 1](nodes_.data() + tree.node_begin,
+                                       leaves_.data() + tree.leaf_begin,
+                                       rows, row_stride, nrow, out, out_stride);
+            return true;
+        }
+
+        /*! \brief whether tree i is traversed by an unrolled kernel */
+        inline bool has_kernel(size_t i) const {
+            return i < trees_.size() && trees_[i].kernel[0] != nullptr;
+        }
+
+        /*! \brief number of trees traversed by unrolled kernels */
+        inline size_t num_unrolled() const {
+            return num_unrolled_;
+        }
+
+    private:
+        struct Tree {
+            // first split and first leaf of the tree
+            size_t node_begin = 0;
+            size_t leaf_begin = 0;
+            // kernels for dense rows and for rows with missing values, nullptr if not unrolled
+            unrolled::Kernel kernel[2] = {nullptr, nullptr};
+        };
+
+        // depth of the tree, stops counting past kMaxDepth
+        inline static int Depth(const FlatTree& tree) {
+            int depth = 0;
+            std::vector<std::pair<int, int> > stack(1, std::make_pair(0, 0));
+            while (!stack.empty()) {
+                int nid = stack.back().first;
+                int d = stack.back().second;
+                stack.pop_back();
+                if (d > depth) depth = d;
+                if (depth > kMaxDepth) break;
+                if (tree[nid].is_leaf()) continue;
+                stack.push_back(std::make_pair(tree[nid].cleft(nid), d + 1));
+                stack.push_back(std::make_pair(tree[nid].cright(), d + 1));
+            }
+            return depth;
+        }
+
+        // write the subtree of flat node nid at heap position pos and level d
+        inline void Fill(const FlatTree& tree, int nid, size_t pos, int d, int depth,
+                         const Tree& dst) {
+            const FlatTree::Node& node = tree[nid];
+            if (d == depth) {
+                leaves_[dst.leaf_begin + pos - ((static_cast<size_t>(1) << depth) - 1)] =
+                    node.leaf_value();
+                return;
+            }
+            unrolled::Node& out = nodes_[dst.node_begin + pos];
+            if (node.is_leaf()) {
+                // padding: both subtrees end in this leaf, any split will do
+                out.sindex = 0;
+                out.cond = 0.0f;
+                this->Fill(tree, nid, 2 * pos + 1, d + 1, depth, dst);
+                this->Fill(tree, nid, 2 * pos + 2, d + 1, depth, dst);
+                return;
+            }
+            out.sindex = node.split_index() | (node.default_left() ? 1U << 31 : 0U);
+            out.cond = node.split_cond();
+            this->Fill(tree, node.cleft(nid), 2 * pos + 1, d + 1, depth, dst);
+            this->Fill(tree, node.cright(), 2 * pos + 2, d + 1, depth, dst);
+        }
+
+        // splits of all unrolled trees
+        std::vector<unrolled::Node> nodes_;
+        // leaves of all unrolled trees
+        std::vector<bst_float> leaves_;
+        // layout of each tree of the forest
+        std::vector<Tree> trees_;
+        // number of trees with an unrolled layout
+        size_t num_unrolled_ = 0;
+    };
+}  // namespace xgboost
+
+#endif  // XGBOOST_UNROLLED_TREE_H_
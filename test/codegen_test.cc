@@ -0,0 +1,47 @@
+#include "libsvm_parser.h"
+#include "predictor.h"
+
+using namespace xgboost;
+using namespace std;
+
+// linked with the code gbdt_codegen generates for data/0002.model, see build.sh
+int main() {
+    Predictor* native = new Predictor();
+    Predictor* interp = new Predictor();
+    // batches are forced through the generated code on one side and the SIMD kernels
+    // on the other
+    native->Configure({{"batch_engine", "native"}});
+    interp->Configure({{"compiled_code", "0"}, {"quick_scorer", "0"}, {"batch_engine", "simd"}});
+    if (!native->Load("data/0002.model").ok() || !interp->Load("data/0002.model").ok()) return 1;
+    if (!native->HasCompiledCode() || interp->HasCompiledCode()) {
+        cout << "generated code not registered for the model" << endl;
+        return 1;
+    }
+
+    // the generated code predicts the values of the interpreter on every row
+    CSRBatch batch;
+    LibSVMParser parser;
+    if (!parser.ParseFile("data/agaricus.txt", &batch).ok()) return 1;
+    vector<float> native_preds(batch.num_row()), interp_preds(batch.num_row());
+    for (bool margin : {false, true}) {
+        native->PredictBatch(batch.row_ptr.data(), batch.col_idx.data(), batch.values.data(),
+                             batch.num_row(), native_preds.data(), margin, 0);
+        interp->PredictBatch(batch.row_ptr.data(), batch.col_idx.data(), batch.values.data(),
+                             batch.num_row(), interp_preds.data(), margin, 0);
+        for (size_t i = 0; i < batch.num_row(); ++i) {
+            unordered_map<size_t, float> row;
+            for (size_t j = batch.row_ptr[i]; j < batch.row_ptr[i + 1]; ++j) {
+                row[batch.col_idx[j]] = batch.values[j];
+            }
+            if (native_preds[i] != interp_preds[i] ||
+                native->Predict(&row, margin, 0) != interp->Predict(&row, margin, 0)) {
+                cout << "generated code mismatch at row " << i << endl;
+                return 1;
+            }
+        }
+    }
+    cout << "generated code ok on " << batch.num_row() << " rows" << endl;
+    delete native;
+    delete interp;
+    return 0;
+}
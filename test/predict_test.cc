@@ -1,14 +1,82 @@
+#include <atomic>
+#include <cfloat>
+#include <functional>
+#include <thread>
+#include "libsvm_parser.h"
+#include "model_handle.h"
 #include "predictor.h"
+#include "score_pipeline.h"
 #include "tree_model.h"
 
 using namespace xgboost;
 using namespace std;
 
+// split a leaf of a hand built tree on feature < cond, missing values go left
+static void AddSplit(RegTree* tree, int nid, unsigned feature, float cond, float left, float right) {
+    tree->AddChilds(nid);
+    (*tree)[nid].set_split(feature, cond, true);
+    (*tree)[(*tree)[nid].cleft()].set_leaf(left);
+    (*tree)[(*tree)[nid].cright()].set_leaf(right);
+}
+
+// a tree of a single split of feature < cond
+static RegTree Stump(unsigned feature, float cond, float left, float right) {
+    RegTree tree;
+    tree.InitModel();
+    AddSplit(&tree, 0, feature, cond, left, right);
+    return tree;
+}
+
+// write hand built trees as an xgboost binary model with a zero base score, every leaf
+// covers one instance
+static void WriteModel(const string& path, const string& objective, int num_class,
+                       unsigned num_feature, vector<RegTree>& trees, const vector<int>& tree_info) {
+    ofstream out(path, ios::binary);
+    LearnerModelParam mparam;
+    mparam.base_score = 0.0f;
+    mparam.num_feature = num_feature;
+    mparam.num_class = num_class;
+    out.write(reinterpret_cast<const char*>(&mparam), sizeof(mparam));
+    for (const string& name : {objective, string("gbtree")}) {
+        uint64_t len = name.length();
+        out.write(reinterpret_cast<const char*>(&len), sizeof(len));
+        out.write(name.data(), len);
+    }
+    gbm::GBTreeModelParam gparam;
+    gparam.num_trees = static_cast<int>(trees.size());
+    gparam.num_roots = 1;
+    gparam.num_feature = static_cast<int>(num_feature);
+    gparam.num_output_group = std::max(num_class, 1);
+    out.write(reinterpret_cast<const char*>(&gparam), sizeof(gparam));
+    for (RegTree& tree : trees) {
+        tree.param.num_feature = static_cast<int>(num_feature);
+        out.write(reinterpret_cast<const char*>(&tree.param), sizeof(tree.param));
+        const auto& nodes = tree.GetNodes();
+        out.write(reinterpret_cast<const char*>(nodes.data()), sizeof(nodes[0]) * nodes.size());
+        // children follow their parent, so covers sum up from the last node
+        vector<RTreeNodeStat> stats(nodes.size(), RTreeNodeStat());
+        for (int nid = static_cast<int>(nodes.size()) - 1; nid >= 0; --nid) {
+            if (nodes[nid].is_leaf()) {
+                stats[nid].sum_hess = 1.0f;
+            } else {
+                stats[nid].sum_hess = stats[nodes[nid].cleft()].sum_hess +
+                                      stats[nodes[nid].cright()].sum_hess;
+            }
+        }
+        out.write(reinterpret_cast<const char*>(stats.data()), sizeof(stats[0]) * stats.size());
+    }
+    out.write(reinterpret_cast<const char*>(tree_info.data()), sizeof(int) * tree_info.size());
+}
+
 int main() {
     //std::unique_ptr<dmlc::Stream> fi(dmlc::Stream::Create("data/0002.model", "r"));
     
     Predictor*  pred = new Predictor();
-    pred->Load("data/0002.model");
+    LoadStatus status = pred->Load("data/0002.model");
+    if (!status.ok()) {
+        cout << "load failed: " << status.message << endl;
+        return 1;
+    }
     pred->DumpModel();
     cout << "predict test: " << std::endl;
     unordered_map<size_t, float> inst = {{3,1},  {9,1}, {19,1}, {21,1}, {24,1}, {34,1}, {36,1}, {39,1}, {51,1},
@@ -17,7 +85,661 @@ int main() {
 	unordered_map<size_t, float> inst1 = {{56,0}};
     float pred_val1 = pred->Predict(&inst, false, 0);
     cout << "pred_value : " << pred_val1 << endl;
+
+    // batch prediction over CSR rows must agree with single row prediction
+    vector<unordered_map<size_t, float>> rows = {inst, inst1, {}, {{28,1}, {29,1}, {60,1}}};
+    vector<size_t> row_ptr(1, 0);
+    vector<unsigned> col_idx;
+    vector<float> values;
+    for (const auto& row : rows) {
+        for (const auto& kv : row) {
+            col_idx.push_back(static_cast<unsigned>(kv.first));
+            values.push_back(kv.second);
+        }
+        row_ptr.push_back(col_idx.size());
+    }
+    for (const char* nthread : {"1", "2"}) {
+        pred->Configure({{"nthread", nthread}});
+        vector<float> batch_preds(rows.size());
+        pred->PredictBatch(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                           batch_preds.data(), false, 0);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            float expect = pred->Predict(&rows[i], false, 0);
+            cout << "batch pred_value[" << i << "] (nthread=" << nthread << ") : "
+                 << batch_preds[i] << endl;
+            if (batch_preds[i] != expect) {
+                cout << "batch mismatch at row " << i << ": " << expect << endl;
+                return 1;
+            }
+        }
+    }
+
+    // dense rows give the same predictions as the same rows with every feature given
+    {
+        size_t num_feature = pred->NumFeature();
+        vector<float> dense(rows.size() * num_feature, 0.0f);
+        vector<float> dense_preds(rows.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            for (const auto& kv : rows[i]) dense[i * num_feature + kv.first] = kv.second;
+        }
+        pred->PredictDense(dense.data(), rows.size(), dense_preds.data(), false, 0);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            unordered_map<size_t, float> full;
+            for (size_t f = 0; f < num_feature; ++f) full[f] = dense[i * num_feature + f];
+            if (dense_preds[i] != pred->Predict(&full, false, 0)) {
+                cout << "dense mismatch at row " << i << endl;
+                return 1;
+            }
+        }
+        cout << "dense prediction ok" << endl;
+    }
+
+    // feature contributions and their approximation add up to the margin of each row
+    {
+        size_t ncolumn = pred->NumFeature() + 1;
+        vector<float> margin(rows.size()), contribs(rows.size() * ncolumn);
+        pred->PredictBatch(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                           margin.data(), true, 0);
+        for (bool approximate : {false, true}) {
+            pred->PredictContribution(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                                      contribs.data(), 0, approximate);
+            for (size_t i = 0; i < rows.size(); ++i) {
+                double sum = 0;
+                for (size_t f = 0; f < ncolumn; ++f) sum += contribs[i * ncolumn + f];
+                if (std::fabs(sum - margin[i]) > 1e-4) {
+                    cout << "contributions of row " << i << " sum to " << sum << ", margin "
+                         << margin[i] << endl;
+                    return 1;
+                }
+            }
+        }
+        // the interaction matrices are symmetric, and trees split into shards reduce to
+        // the matrices of a single shard
+        vector<float> interactions(rows.size() * ncolumn * ncolumn), sharded(interactions.size());
+        pred->PredictInteractionContribution(row_ptr.data(), col_idx.data(), values.data(),
+                                             rows.size(), interactions.data(), 0);
+        pred->Configure({{"tree_shard_size", "1"}});
+        pred->PredictInteractionContribution(row_ptr.data(), col_idx.data(), values.data(),
+                                             rows.size(), sharded.data(), 0);
+        pred->Configure({{"tree_shard_size", "0"}});
+        for (size_t r = 0; r < rows.size(); ++r) {
+            const float* matrix = &interactions[r * ncolumn * ncolumn];
+            for (size_t k = 0; k < ncolumn * ncolumn; ++k) {
+                size_t a = k / ncolumn, b = k % ncolumn;
+                if (std::fabs(matrix[k] - matrix[b * ncolumn + a]) > 1e-6 ||
+                    std::fabs(matrix[k] - sharded[r * ncolumn * ncolumn + k]) > 1e-5) {
+                    cout << "interaction (" << a << ", " << b << ") of row " << r
+                         << " is not symmetric or differs across shards" << endl;
+                    return 1;
+                }
+            }
+        }
+        // in the first tree, f29 < 0 leads to f56 at cover 924.5 and otherwise to f109 at
+        // cover 703.75, whose left child splits on f67 at cover 690.5 into 679.75 and 10.75
+        // and whose right child is the leaf 1.85965. For the row {29: 1, 109: 1} every set S
+        // of the other four features adds 924.5 / 1628.25 * 690.5 / 703.75 * (1.85965 - E)
+        // to the interaction of f29 and f109, where E is the left leaf of f67, -1.98531, if
+        // f67 is in S and the cover weighted mean of both leaves of f67 otherwise. f67 is
+        // in half of the Shapley weight, so entry (29, 109), half the interaction, is
+        // 0.5 * 0.567787 * 0.981172 * (1.85965 + 0.5 * 1.98531 + 0.5 * 1.941815) = 1.064951
+        {
+            size_t tree_row_ptr[] = {0, 2};
+            unsigned tree_col_idx[] = {29, 109};
+            float tree_values[] = {1.0f, 1.0f};
+            pred->PredictInteractionContribution(tree_row_ptr, tree_col_idx, tree_values, 1,
+                                                 interactions.data(), 1);
+            if (std::fabs(interactions[29 * ncolumn + 109] - 1.064951f) > 1e-5) {
+                cout << "interaction of f29 and f109: " << interactions[29 * ncolumn + 109] << endl;
+                return 1;
+            }
+        }
+        cout << "contributions ok" << endl;
+    }
+
+    // leaf prediction reports one leaf per tree and the margins of the batch prediction
+    {
+        vector<float> margin(rows.size()), leaf_margin(rows.size());
+        pred->PredictBatch(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                           margin.data(), true, 0);
+        vector<size_t> onehot_ptr;
+        vector<unsigned> onehot_col;
+        pred->PredictLeafOneHot(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                                &onehot_ptr, &onehot_col, nullptr, 0, leaf_margin.data());
+        const size_t ntree = onehot_ptr[1];
+        vector<int32_t> ordinal(rows.size() * ntree);
+        pred->PredictLeaf(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                          ordinal.data(), 0, kLeafOrdinal);
+        // node ids are the ones xgboost reports for pred_leaf
+        vector<int32_t> node_id(rows.size() * ntree);
+        pred->PredictLeaf(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                          node_id.data(), 0);
+        FVec feat;
+        feat.Init(pred->NumFeature());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            feat.Fill(rows[i]);
+            for (size_t t = 0; t < ntree; ++t) {
+                if (node_id[i * ntree + t] != pred->GetTree(t).GetLeafIndex(feat)) {
+                    cout << "leaf node id mismatch at row " << i << ", tree " << t << endl;
+                    return 1;
+                }
+            }
+            feat.Drop(rows[i]);
+        }
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (std::fabs(leaf_margin[i] - margin[i]) > 1e-5) {
+                cout << "leaf margin mismatch at row " << i << endl;
+                return 1;
+            }
+            for (size_t t = 0; t < ntree; ++t) {
+                unsigned column = onehot_col[i * ntree + t];
+                if (column >= pred->NumLeafColumns(0) ||
+                    (t != 0 && column - ordinal[i * ntree + t] <= onehot_col[i * ntree + t - 1])) {
+                    cout << "bad one-hot leaf column at row " << i << ", tree " << t << endl;
+                    return 1;
+                }
+            }
+        }
+        cout << "leaf prediction ok" << endl;
+    }
+
+    // a prediction resumed round by round ends at the margin of a single call, and the
+    // early exit gives the answer of the full margin
+    {
+        PredictionState state;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            float margin = pred->Predict(&rows[i], true, 0), resumed;
+            pred->BeginPrediction(&rows[i], &state);
+            for (unsigned round = 1; round <= 3; ++round) pred->ContinuePrediction(&state, round);
+            pred->ContinuePrediction(&state, 0);
+            pred->GetPrediction(state, &resumed, true);
+            for (float threshold : {margin - 1.0f, margin + 1.0f}) {
+                pred->BeginPrediction(&rows[i], &state);
+                if (std::fabs(resumed - margin) > 1e-5 ||
+                    pred->PredictAbove(&state, threshold) != (margin >= threshold)) {
+                    cout << "resumed prediction mismatch at row " << i << endl;
+                    return 1;
+                }
+            }
+        }
+        cout << "resumed prediction ok" << endl;
+    }
+
+    // margin intervals contain the margin, and the pruned top-K ranks the batch margins
+    {
+        vector<float> margin(rows.size()), lower(rows.size()), upper(rows.size());
+        pred->PredictBatch(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                           margin.data(), true, 0);
+        pred->PredictMarginInterval(row_ptr.data(), col_idx.data(), values.data(), rows.size(), 1,
+                                    lower.data(), upper.data());
+        vector<size_t> order(rows.size()), top;
+        for (size_t i = 0; i < rows.size(); ++i) order[i] = i;
+        stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return margin[a] > margin[b]; });
+        pred->PredictTopK(row_ptr.data(), col_idx.data(), values.data(), rows.size(), 2, &top,
+                          nullptr, 0, 1);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (!(lower[i] <= margin[i] && margin[i] <= upper[i]) ||
+                (i < top.size() && top[i] != order[i]) || top.size() != 2) {
+                cout << "margin interval or top-K mismatch at row " << i << endl;
+                return 1;
+            }
+        }
+        // the first tree leaves the rows one float step apart and the second adds 2^25
+        // to both, which rounds both margins to 2^25: the tie goes to the smaller index,
+        // so pruning after the first tree must keep row 0
+        vector<RegTree> trees = {Stump(0, 0.5f, 1.0f, 1.0f + FLT_EPSILON),
+                                 Stump(0, 0.5f, 33554432.0f, 33554432.0f)};
+        WriteModel("tie.model", "reg:squarederror", 0, 1, trees, {0, 0});
+        Predictor tie;
+        if (!tie.Load("tie.model").ok()) return 1;
+        std::remove("tie.model");
+        size_t tie_row_ptr[] = {0, 1, 2};
+        unsigned tie_col_idx[] = {0, 0};
+        float tie_values[] = {0.0f, 1.0f};
+        float tie_margin[2];
+        tie.PredictBatch(tie_row_ptr, tie_col_idx, tie_values, 2, tie_margin, true, 0);
+        tie.PredictTopK(tie_row_ptr, tie_col_idx, tie_values, 2, 1, &top, nullptr, 0, 1);
+        if (tie_margin[0] != tie_margin[1] || top.size() != 1 || top[0] != 0) {
+            cout << "top-K tie went to row " << top[0] << endl;
+            return 1;
+        }
+        cout << "top-K ok" << endl;
+    }
+
+    // a 3 class model keeps the margins of row i at [i * 3, i * 3 + 3), and contributions
+    // and leaves follow the same group-major layout. Class g only splits on feature g, so
+    // the contribution of feature f to class g is zero unless f == g.
+    {
+        vector<RegTree> trees = {Stump(0, 0.5f, 0.1f, 0.7f), Stump(1, 0.5f, -0.3f, 0.4f),
+                                 Stump(2, 0.5f, 0.2f, -0.6f), Stump(0, 0.25f, -0.05f, 0.3f),
+                                 Stump(1, 0.75f, 0.5f, -0.1f), Stump(2, 0.1f, 0.25f, 0.9f)};
+        AddSplit(&trees[5], 2, 2, 0.8f, 0.6f, 1.2f);
+        const vector<int> tree_group = {0, 1, 2, 0, 1, 2};
+        WriteModel("multiclass.model", "multi:softprob", 3, 3, trees, tree_group);
+        Predictor multi;
+        if (!multi.Load("multiclass.model").ok() || multi.NumOutput(true) != 3) return 1;
+        std::remove("multiclass.model");
+        const size_t ngroup = 3, ntree = trees.size(), ncolumn = 4;
+        const vector<unordered_map<size_t, float>> multi_rows = {
+            {{0, 0.0f}, {1, 1.0f}, {2, 0.0f}}, {{0, 1.0f}, {1, 0.0f}, {2, 1.0f}},
+            {{0, 0.3f}, {1, 0.6f}, {2, 0.5f}}};
+        const size_t nrow = multi_rows.size();
+        vector<size_t> m_row_ptr(1, 0);
+        vector<unsigned> m_col_idx;
+        vector<float> m_values, m_dense(nrow * 3);
+        for (size_t i = 0; i < nrow; ++i) {
+            for (const auto& kv : multi_rows[i]) {
+                m_col_idx.push_back(static_cast<unsigned>(kv.first));
+                m_values.push_back(kv.second);
+                m_dense[i * 3 + kv.first] = kv.second;
+            }
+            m_row_ptr.push_back(m_col_idx.size());
+        }
+        vector<float> m_batch(nrow * ngroup), m_first(nrow * ngroup), m_dense_out(nrow * ngroup);
+        vector<float> m_contribs(nrow * ngroup * ncolumn);
+        vector<int32_t> m_leaf(nrow * ntree);
+        multi.PredictBatch(m_row_ptr.data(), m_col_idx.data(), m_values.data(), nrow,
+                           m_batch.data(), true, 0);
+        multi.PredictBatch(m_row_ptr.data(), m_col_idx.data(), m_values.data(), nrow,
+                           m_first.data(), true, 1);
+        multi.PredictDense(m_dense.data(), nrow, m_dense_out.data(), true, 0);
+        multi.PredictLeaf(m_row_ptr.data(), m_col_idx.data(), m_values.data(), nrow,
+                          m_leaf.data(), 0);
+        multi.PredictContribution(m_row_ptr.data(), m_col_idx.data(), m_values.data(), nrow,
+                                  m_contribs.data(), 0);
+        FVec feat;
+        feat.Init(3);
+        for (size_t i = 0; i < nrow; ++i) {
+            feat.Fill(multi_rows[i]);
+            float expect[3] = {0.0f, 0.0f, 0.0f}, first[3] = {0.0f, 0.0f, 0.0f};
+            for (size_t t = 0; t < ntree; ++t) {
+                int nid = trees[t].GetLeafIndex(feat);
+                expect[tree_group[t]] += trees[t][nid].leaf_value();
+                if (t < ngroup) first[tree_group[t]] += trees[t][nid].leaf_value();
+                if (m_leaf[i * ntree + t] != nid) {
+                    cout << "multi-class leaf mismatch at row " << i << ", tree " << t << endl;
+                    return 1;
+                }
+            }
+            feat.Drop(multi_rows[i]);
+            for (size_t g = 0; g < ngroup; ++g) {
+                const float* contrib = &m_contribs[(i * ngroup + g) * ncolumn];
+                double sum = 0;
+                for (size_t f = 0; f < ncolumn; ++f) sum += contrib[f];
+                if (std::fabs(m_batch[i * ngroup + g] - expect[g]) > 1e-6 ||
+                    std::fabs(m_first[i * ngroup + g] - first[g]) > 1e-6 ||
+                    m_dense_out[i * ngroup + g] != m_batch[i * ngroup + g] ||
+                    std::fabs(sum - expect[g]) > 1e-5 ||
+                    contrib[(g + 1) % 3] != 0.0f || contrib[(g + 2) % 3] != 0.0f) {
+                    cout << "multi-class mismatch at row " << i << ", class " << g << endl;
+                    return 1;
+                }
+            }
+        }
+        cout << "multi-class prediction ok" << endl;
+    }
+
+    // every registered objective transforms margins as its scalar formula does, on a
+    // batch long enough for the vector kernels and their scalar tail, with inputs at the
+    // ends of the float range of exp: finite up to 88.72, denormal below -87.34
+    {
+        const vector<float> margins = {-104.0f, -103.9f, -100.0f, -90.0f, -87.5f, -87.3f,
+                                       -87.0f, -20.0f, -1.0f, -0.5f, 0.0f, 0.5f,
+                                       1.0f, 20.0f, 87.0f, 88.5f, 88.7f, 88.72f,
+                                       88.73f, 89.0f, 100.0f, -88.7f, 3.0f};
+        const size_t n = margins.size();
+        auto close = [](float got, double expect) {
+            if (expect > FLT_MAX) return std::isinf(got) && got > 0.0f;
+            // relative error of the exp kernel, plus one step of a denormal result
+            return std::fabs(got - expect) <= 1e-6 * std::fabs(expect) + 3e-45;
+        };
+        auto check = [&](const char* name, size_t ngroup,
+                         std::function<double(const float*, size_t)> expect) {
+            std::unique_ptr<ObjFunction> obj(ObjFunction::Create(name));
+            const size_t nrow = n / ngroup, nout = obj->NumOutput(ngroup);
+            vector<float> out(nrow * nout);
+            obj->PredTransform(margins.data(), nrow, ngroup, out.data());
+            for (size_t i = 0; i < out.size(); ++i) {
+                if (!close(out[i], expect(&margins[i / nout * ngroup], i % nout))) {
+                    cout << name << ": output " << i << " is " << out[i] << endl;
+                    return false;
+                }
+            }
+            return true;
+        };
+        for (const char* name : {"reg:squarederror", "binary:logitraw", "rank:pairwise"}) {
+            if (!check(name, 1, [](const float* m, size_t) { return m[0]; })) return 1;
+        }
+        for (const char* name : {"binary:logistic", "reg:logistic"}) {
+            if (!check(name, 1, [](const float* m, size_t) { return 1.0 / (1.0 + std::exp(-m[0])); })) {
+                return 1;
+            }
+        }
+        for (const char* name : {"count:poisson", "reg:gamma", "reg:tweedie", "survival:cox"}) {
+            if (!check(name, 1, [](const float* m, size_t) { return std::exp(m[0]); })) return 1;
+        }
+        if (!check("binary:hinge", 1, [](const float* m, size_t) { return m[0] > 0.0f ? 1.0 : 0.0; })) {
+            return 1;
+        }
+        // rows of 3 classes, the smaller index wins a tie of multi:softmax
+        auto softprob = [](const float* m, size_t g) {
+            double wmax = std::max(std::max(m[0], m[1]), m[2]), wsum = 0;
+            for (size_t c = 0; c < 3; ++c) wsum += std::exp(m[c] - wmax);
+            return std::exp(m[g] - wmax) / wsum;
+        };
+        auto argmax = [](const float* m, size_t) {
+            return static_cast<double>(std::max_element(m, m + 3) - m);
+        };
+        if (!check("multi:softprob", 3, softprob) || !check("multi:softmax", 3, argmax)) return 1;
+        cout << "objectives ok" << endl;
+    }
+
+    // libsvm text parsed in parallel chunks gives the rows of a sequential parse
+    {
+        CSRBatch seq, par;
+        LibSVMParser seq_parser;
+        LibSVMParser par_parser(std::make_shared<ThreadPool>(2));
+        if (!seq_parser.ParseFile("data/agaricus.txt", &seq).ok() ||
+            !par_parser.ParseFile("data/agaricus.txt", &par).ok() ||
+            seq.row_ptr != par.row_ptr || seq.col_idx != par.col_idx ||
+            seq.values != par.values || seq.labels != par.labels) {
+            cout << "libsvm parse mismatch" << endl;
+            return 1;
+        }
+        vector<float> file_preds(seq.num_row());
+        pred->PredictBatch(seq.row_ptr.data(), seq.col_idx.data(), seq.values.data(), seq.num_row(),
+                           file_preds.data(), false, 0);
+        for (size_t i = 0; i < seq.num_row(); i += 97) {
+            unordered_map<size_t, float> row;
+            for (size_t j = seq.row_ptr[i]; j < seq.row_ptr[i + 1]; ++j) row[seq.col_idx[j]] = seq.values[j];
+            if (file_preds[i] != pred->Predict(&row, false, 0)) {
+                cout << "libsvm prediction mismatch at row " << i << endl;
+                return 1;
+            }
+        }
+        status = seq_parser.Parse("1 3:1\n0 4:x\n", 12, &seq);
+        cout << "libsvm rows: " << par.num_row() << ", bad row: " << status.message << endl;
+        if (status.code != LoadStatus::kCorrupt) return 1;
+
+        // the streaming pipeline writes the predictions of the rows in input order
+        FILE* in = std::tmpfile();
+        FILE* out = std::tmpfile();
+        ifstream text("data/agaricus.txt");
+        string lines((istreambuf_iterator<char>(text)), istreambuf_iterator<char>());
+        std::fwrite(lines.data(), 1, lines.size(), in);
+        std::rewind(in);
+        ScorePipeline pipeline(*pred, std::make_shared<ThreadPool>(2), std::make_shared<ThreadPool>(2),
+                               false, 0, 4096);
+        if (!pipeline.Run(in, out).ok()) return 1;
+        string expect, streamed(std::ftell(out), '\0');
+        FormatPredictions(file_preds.data(), 1, 0, file_preds.size(), &expect);
+        std::rewind(out);
+        if (std::fread(&streamed[0], 1, streamed.size(), out) != streamed.size() || streamed != expect) {
+            cout << "pipeline output mismatch" << endl;
+            return 1;
+        }
+        // the text reads back as the predictions bit for bit
+        const char* line = expect.c_str();
+        for (size_t i = 0; i < file_preds.size(); ++i) {
+            char* line_end;
+            if (std::strtof(line, &line_end) != file_preds[i]) {
+                cout << "formatted prediction of row " << i << " reads back differently" << endl;
+                return 1;
+            }
+            line = line_end;
+        }
+        std::fclose(in);
+        std::fclose(out);
+        // a line longer than a block fails the run after the rows before it are written
+        in = std::tmpfile();
+        out = std::tmpfile();
+        string long_line = "1 1:1\n1";
+        for (int i = 0; i < 40; ++i) long_line += " 10:1";
+        long_line += "\n";
+        std::fwrite(long_line.data(), 1, long_line.size(), in);
+        std::rewind(in);
+        ScorePipeline short_blocks(*pred, nullptr, nullptr, false, 0, 64);
+        status = short_blocks.Run(in, out);
+        cout << "long line: " << status.message << endl;
+        if (status.code != LoadStatus::kCorrupt || std::ftell(out) == 0) return 1;
+        std::fclose(in);
+        std::fclose(out);
+        cout << "pipeline ok" << endl;
+    }
+
+    // margins of every row of agaricus.txt by single, CSR batch and dense prediction
+    CSRBatch agaricus;
+    LibSVMParser agaricus_parser;
+    if (!agaricus_parser.ParseFile("data/agaricus.txt", &agaricus).ok()) return 1;
+    vector<float> agaricus_dense(agaricus.num_row() * pred->NumFeature(), 0.0f);
+    for (size_t i = 0; i < agaricus.num_row(); ++i) {
+        for (size_t j = agaricus.row_ptr[i]; j < agaricus.row_ptr[i + 1]; ++j) {
+            agaricus_dense[i * pred->NumFeature() + agaricus.col_idx[j]] = agaricus.values[j];
+        }
+    }
+    auto agaricus_margins = [&](Predictor* p, vector<float>* single, vector<float>* batch,
+                                vector<float>* dense) {
+        single->resize(agaricus.num_row());
+        batch->resize(agaricus.num_row());
+        dense->resize(agaricus.num_row());
+        for (size_t i = 0; i < agaricus.num_row(); ++i) {
+            unordered_map<size_t, float> row;
+            for (size_t j = agaricus.row_ptr[i]; j < agaricus.row_ptr[i + 1]; ++j) {
+                row[agaricus.col_idx[j]] = agaricus.values[j];
+            }
+            (*single)[i] = p->Predict(&row, true, 0);
+        }
+        p->PredictBatch(agaricus.row_ptr.data(), agaricus.col_idx.data(), agaricus.values.data(),
+                        agaricus.num_row(), batch->data(), true, 0);
+        p->PredictDense(agaricus_dense.data(), agaricus.num_row(), dense->data(), true, 0);
+    };
+    vector<float> single, batch, dense;
+    agaricus_margins(pred, &single, &batch, &dense);
+
+    // every batch engine at every simd level gives the margins of the default engines
+    for (const char* engine : {"quick_scorer", "simd"}) {
+        for (const char* level : {"none", "avx2", "avx512"}) {
+            Predictor forced;
+            forced.Configure({{"batch_engine", engine}, {"simd", level}});
+            if (!forced.Load("data/0002.model").ok()) return 1;
+            vector<float> f_single, f_batch, f_dense;
+            agaricus_margins(&forced, &f_single, &f_batch, &f_dense);
+            if (f_single != single || f_batch != batch || f_dense != dense) {
+                cout << "batch_engine=" << engine << ", simd=" << level << " mismatch" << endl;
+                return 1;
+            }
+        }
+    }
+    cout << "batch engines ok" << endl;
+
+    // quantized bins give the margins of float thresholds bit for bit
+    {
+        Predictor quantized;
+        quantized.Configure({{"quantized", "1"}});
+        if (!quantized.Load("data/0002.model").ok() || !quantized.IsQuantized()) return 1;
+        vector<float> q_single, q_batch, q_dense;
+        agaricus_margins(&quantized, &q_single, &q_batch, &q_dense);
+        if (q_single != single || q_batch != batch || q_dense != dense) {
+            cout << "quantized prediction mismatch" << endl;
+            return 1;
+        }
+        cout << "quantized prediction ok" << endl;
+    }
+
+    // renumbered features give the margins of the model ids, also through compiled files
+    // saved either way and loaded either way
+    {
+        Predictor remapped, plain;
+        plain.Configure({{"remap_features", "0"}});
+        if (!remapped.Load("data/0002.model").ok() || !plain.Load("data/0002.model").ok() ||
+            !remapped.IsRemapped() || plain.IsRemapped() ||
+            remapped.SaveCompiled("0002.remapped.model") != 0 ||
+            plain.SaveCompiled("0002.plain.model") != 0) {
+            return 1;
+        }
+        for (const char* file : {"data/0002.model", "0002.remapped.model", "0002.plain.model"}) {
+            for (Predictor* p : {&remapped, &plain}) {
+                vector<float> r_single, r_batch, r_dense;
+                if (!p->Load(file).ok() || p->IsRemapped() != (p == &remapped)) return 1;
+                agaricus_margins(p, &r_single, &r_batch, &r_dense);
+                if (r_single != single || r_batch != batch || r_dense != dense) {
+                    cout << file << ": remap_features=" << (p == &remapped) << " mismatch" << endl;
+                    return 1;
+                }
+            }
+        }
+        std::remove("0002.remapped.model");
+        std::remove("0002.plain.model");
+        cout << "remapped features ok" << endl;
+    }
+
+    // 16 bit leaves keep the margins within the reported bound, and every entry point
+    // reads the same leaves
+    for (const char* format : {"fp16", "bf16", "int16"}) {
+        Predictor compact;
+        compact.Configure({{"leaf_precision", format}});
+        if (!compact.Load("data/0002.model").ok() || !(compact.MarginErrorBound() > 0.0f)) return 1;
+        // the bound holds up to the float rounding of the sums
+        const float bound = compact.MarginErrorBound() + 1e-5f;
+        vector<float> c_single, c_batch, c_dense;
+        agaricus_margins(&compact, &c_single, &c_batch, &c_dense);
+        for (size_t i = 0; i < agaricus.num_row(); ++i) {
+            if (c_batch[i] != c_single[i] || std::fabs(c_single[i] - single[i]) > bound ||
+                std::fabs(c_dense[i] - dense[i]) > bound) {
+                cout << format << " leaves: margin mismatch at row " << i << endl;
+                return 1;
+            }
+        }
+        cout << format << " leaves ok, margin error bound " << compact.MarginErrorBound() << endl;
+    }
+    // a leaf beyond the half float range keeps the float leaves, bfloat16 still holds it
+    {
+        vector<RegTree> trees = {Stump(0, 0.5f, -1.0f, 70000.0f)};
+        WriteModel("large_leaf.model", "reg:squarederror", 0, 1, trees, {0});
+        unordered_map<size_t, float> large = {{0, 1.0f}};
+        for (const char* format : {"fp16", "bf16"}) {
+            Predictor compact;
+            compact.Configure({{"leaf_precision", format}});
+            if (!compact.Load("large_leaf.model").ok()) return 1;
+            const bool half = std::string(format) == "fp16";
+            float margin = compact.Predict(&large, true, 0);
+            if ((compact.MarginErrorBound() == 0.0f) != half ||
+                std::fabs(margin - 70000.0f) > compact.MarginErrorBound()) {
+                cout << format << " leaves: large leaf predicted " << margin << endl;
+                return 1;
+            }
+        }
+        std::remove("large_leaf.model");
+        cout << "large leaves ok" << endl;
+    }
+    // every half and bfloat16 survives a round trip, and a float halfway between two
+    // of them rounds to the even one
+    for (uint32_t h = 0; h < 0x7C00; ++h) {
+        float value = CompactLeafForest::HalfToFloat(static_cast<uint16_t>(h));
+        float next = CompactLeafForest::HalfToFloat(static_cast<uint16_t>(h + 1));
+        uint16_t even = static_cast<uint16_t>(h & 1 ? h + 1 : h);
+        if (CompactLeafForest::FloatToHalf(value) != h ||
+            CompactLeafForest::FloatToHalf(-value) != (h | 0x8000) ||
+            CompactLeafForest::FloatToHalf(value + (next - value) / 2) != even) {
+            cout << "half conversion mismatch at " << h << endl;
+            return 1;
+        }
+    }
+    for (uint32_t h = 0; h < 0x7F80; ++h) {
+        float value = CompactLeafForest::BFloat16ToFloat(static_cast<uint16_t>(h));
+        uint32_t bits = (h << 16) | 0x8000;
+        float half_way;
+        std::memcpy(&half_way, &bits, sizeof(half_way));
+        if (CompactLeafForest::FloatToBFloat16(value) != h ||
+            CompactLeafForest::FloatToBFloat16(half_way) != (h & 1 ? h + 1 : h)) {
+            cout << "bfloat16 conversion mismatch at " << h << endl;
+            return 1;
+        }
+    }
+
+    // a saved compiled model is mapped back and must predict the same values,
+    // here through native code from the JIT where the platform supports it
+    if (pred->SaveCompiled("0002.flat.model") != 0) return 1;
+    Predictor* flat = new Predictor();
+    flat->Configure({{"jit", "1"}, {"quick_scorer", "0"}});
+    if (!flat->Load("0002.flat.model").ok()) return 1;
+#if XGBOOST_USE_JIT
+    if (!flat->HasNativeCode() || flat->HasCompiledCode()) {
+        cout << "jit did not translate the forest" << endl;
+        return 1;
+    }
+#endif
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (flat->Predict(&rows[i], false, 0) != pred->Predict(&rows[i], false, 0)) {
+            cout << "compiled model mismatch at row " << i << endl;
+            return 1;
+        }
+    }
+    // batches forced onto the native code get the same values, also where QuickScorer
+    // would take single predictions
+    for (const char* quick_scorer : {"0", "1"}) {
+        flat->Configure({{"batch_engine", "native"}, {"quick_scorer", quick_scorer}});
+        vector<float> flat_batch(rows.size()), expect(rows.size());
+        flat->PredictBatch(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                           flat_batch.data(), false, 0);
+        pred->PredictBatch(row_ptr.data(), col_idx.data(), values.data(), rows.size(),
+                           expect.data(), false, 0);
+        if (flat_batch != expect) {
+            cout << "compiled model batch mismatch, quick_scorer=" << quick_scorer << endl;
+            return 1;
+        }
+    }
+    cout << "compiled model ok" << endl;
+    // the last node of the file is a leaf in preorder, a split word on it is rejected
+    // before a vector kernel could gather through it
+    {
+        fstream file("0002.flat.model", ios::in | ios::out | ios::binary);
+        file.seekp(-static_cast<streamoff>(sizeof(FlatTree::Node)), ios::end);
+        unsigned sindex = 0x7FFFFFF0U;
+        file.write(reinterpret_cast<const char*>(&sindex), sizeof(sindex));
+    }
+    status = flat->Load("0002.flat.model");
+    cout << "leaf with a split word: " << status.message << endl;
+    if (status.code != LoadStatus::kCorrupt) return 1;
+    delete flat;
+    std::remove("0002.flat.model");
+
+    // a truncated model is rejected and the loaded model is kept
+    {
+        ifstream in("data/0002.model", ios::binary);
+        string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        ofstream out("0002.truncated.model", ios::binary);
+        out.write(bytes.data(), bytes.size() / 2);
+    }
+    status = pred->Load("0002.truncated.model");
+    std::remove("0002.truncated.model");
+    cout << "truncated model: " << status.message << endl;
+    if (status.code != LoadStatus::kTruncated || pred->Predict(&inst, false, 0) != pred_val1) {
+        return 1;
+    }
     delete pred;
 
+    // readers keep predicting while the model is reloaded
+    ModelHandle handle;
+    handle.Configure({{"nthread", "2"}});
+    if (!handle.Load("data/0002.model").ok()) return 1;
+    std::atomic<bool> stop(false);
+    std::atomic<int> mismatch(0);
+    vector<thread> readers;
+    for (int t = 0; t < 2; ++t) {
+        readers.emplace_back([&]() {
+            while (!stop) {
+                if (handle.Predict(&inst, false, 0) != pred_val1) ++mismatch;
+            }
+        });
+    }
+    for (int i = 0; i < 20; ++i) {
+        if (!handle.Load("data/0002.model").ok()) ++mismatch;
+    }
+    stop = true;
+    for (auto& reader : readers) reader.join();
+    handle.Reclaim();
+    cout << "hot reload: version " << handle.version() << ", retired " << handle.num_retired() << endl;
+    if (mismatch != 0 || handle.num_retired() != 0) return 1;
+
     return 0;
 }
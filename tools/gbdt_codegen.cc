@@ -0,0 +1,32 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file gbdt_codegen.cc
+ * \brief compile a model into a C++ translation unit
+ *
+ *  usage: gbdt_codegen model_file output.cc
+ *  Compile the output with -I include/ and link it into the program that
+ *  loads the model, Predictor then evaluates the trees through native code.
+ */
+#include <fstream>
+#include <iostream>
+#include "predictor.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " model_file output.cc" << std::endl;
+        return 1;
+    }
+    xgboost::Predictor pred;
+    xgboost::LoadStatus status = pred.Load(argv[1]);
+    if (!status.ok()) {
+        std::cerr << status.message << std::endl;
+        return 1;
+    }
+    std::ofstream os(argv[2]);
+    pred.GenerateCode(os);
+    if (!os) {
+        std::cerr << "cannot write " << argv[2] << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*!
+ * Copyright by Contributors 2017
+ * \file gbdt_score.cc
+ * \brief score a libsvm file with a model
+ *
+ *  usage: gbdt_score model_file data_file [output_file] [key=value ...]
+ *  Writes one line per row with the predictions of the row, to standard output
+ *  when no output file is given. A data_file of - reads standard input through
+ *  the streaming pipeline, see ScorePipeline. Keys:
+ *    nthread: threads used to parse, predict and format, <= 0 means all cores;
+ *      the pipeline splits them between its stages
+ *    output_margin: 1 writes raw margins instead of transformed predictions
+ *    ntree_limit: number of boosting rounds used, 0 means all
+ *    block_mb: megabytes of text parsed and scored at a time, also the longest line
+ *      the pipeline accepts
+ *    pipeline: 1 streams a data file through the pipeline as well
+ *  other keys are passed on to Predictor::Configure.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "libsvm_parser.h"
+#include "predictor.h"
+#include "score_pipeline.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " model_file data_file [output_file] [key=value ...]"
+                  << std::endl;
+        return 1;
+    }
+    int argi = 3;
+    std::string output_path;
+    if (argc > 3 && std::string(argv[3]).find('=') == std::string::npos) {
+        output_path = argv[3];
+        argi = 4;
+    }
+    int nthread = 0;
+    bool output_margin = false;
+    unsigned ntree_limit = 0;
+    size_t block_bytes = 16 << 20;
+    bool pipeline = false;
+    std::vector<std::pair<std::string, std::string> > cfg;
+    for (; argi < argc; ++argi) {
+        std::string arg(argv[argi]);
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "expected key=value: " << arg << std::endl;
+            return 1;
+        }
+        std::string key = arg.substr(0, eq), value = arg.substr(eq + 1);
+        if (key == "nthread") {
+            nthread = std::atoi(value.c_str());
+        } else if (key == "output_margin") {
+            output_margin = std::atoi(value.c_str()) != 0;
+        } else if (key == "ntree_limit") {
+            ntree_limit = static_cast<unsigned>(std::atoi(value.c_str()));
+        } else if (key == "block_mb") {
+            block_bytes = std::max(std::atoi(value.c_str()), 1) * (static_cast<size_t>(1) << 20);
+        } else if (key == "pipeline") {
+            pipeline = std::atoi(value.c_str()) != 0;
+        } else {
+            cfg.push_back(std::make_pair(key, value));
+        }
+    }
+
+    const std::string data_path(argv[2]);
+    pipeline = pipeline || data_path == "-";
+    if (nthread <= 0) nthread = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    // the batch mode runs its stages one after another on one pool. The pipeline runs them
+    // at the same time, and a pool runs one job at a time, so each stage gets its own pool:
+    // a quarter of the threads parse, an eighth format and the rest evaluate the trees
+    int parse_threads = nthread, format_threads = nthread, predict_threads = nthread;
+    if (pipeline) {
+        parse_threads = std::max(nthread / 4, 1);
+        format_threads = std::max(nthread / 8, 1);
+        predict_threads = std::max(nthread - parse_threads - format_threads, 1);
+    }
+    std::shared_ptr<xgboost::ThreadPool> pool, parse_pool, format_pool;
+    if (predict_threads != 1) pool = std::make_shared<xgboost::ThreadPool>(predict_threads);
+    if (!pipeline) {
+        parse_pool = pool;
+        format_pool = pool;
+    } else {
+        if (parse_threads != 1) parse_pool = std::make_shared<xgboost::ThreadPool>(parse_threads);
+        if (format_threads != 1) format_pool = std::make_shared<xgboost::ThreadPool>(format_threads);
+    }
+    xgboost::Predictor pred;
+    pred.Configure(cfg);
+    pred.SetThreadPool(pool);
+    xgboost::LoadStatus status = pred.Load(argv[1]);
+    if (!status.ok()) {
+        std::cerr << argv[1] << ": " << status.message << std::endl;
+        return 1;
+    }
+    FILE* out = stdout;
+    if (!output_path.empty()) {
+        out = std::fopen(output_path.c_str(), "wb");
+        if (out == nullptr) {
+            std::cerr << "cannot write " << output_path << std::endl;
+            return 1;
+        }
+    }
+
+    if (pipeline) {
+        FILE* in = data_path == "-" ? stdin : std::fopen(data_path.c_str(), "rb");
+        if (in == nullptr) {
+            std::cerr << "cannot open " << data_path << std::endl;
+            return 1;
+        }
+        // smaller blocks than the batch mode keep several batches in flight
+        xgboost::ScorePipeline scorer(pred, parse_pool, format_pool, output_margin, ntree_limit,
+                                      std::min<size_t>(block_bytes, 1 << 20));
+        status = scorer.Run(in, out);
+        if (in != stdin) std::fclose(in);
+        if (!status.ok()) {
+            std::cerr << data_path << ": " << status.message << std::endl;
+            return 1;
+        }
+        if (out != stdout && std::fclose(out) != 0) {
+            std::cerr << "write failed" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    xgboost::MappedFile data;
+    if (!data.Open(data_path)) {
+        std::cerr << "cannot open " << data_path << std::endl;
+        return 1;
+    }
+
+    xgboost::LibSVMParser parser(parse_pool);
+    xgboost::CSRBatch batch;
+    std::vector<float> preds;
+    const size_t nout = pred.NumOutput(output_margin);
+    const size_t nthread_used = pool ? static_cast<size_t>(pool->num_threads()) : 1;
+    std::vector<std::string> text(nthread_used * 4);
+    size_t pos = 0, line = 1;
+    while (pos < data.size()) {
+        size_t end = xgboost::LibSVMParser::NextLine(data.data(), data.size(),
+                                                     std::min(pos + block_bytes, data.size()) - 1);
+        status = parser.Parse(data.data() + pos, end - pos, &batch, line);
+        if (!status.ok()) {
+            std::cerr << data_path << ": " << status.message << std::endl;
+            return 1;
+        }
+        line += parser.num_line();
+        pos = end;
+        const size_t nrow = batch.num_row();
+        preds.resize(nrow * nout);
+        pred.PredictBatch(batch.row_ptr.data(), batch.col_idx.data(), batch.values.data(), nrow,
+                          preds.data(), output_margin, ntree_limit);
+        // format slices of rows in parallel, then write them in order
+        const size_t nslice = std::min(text.size(), nrow);
+        auto format = [&](size_t k, int) {
+            xgboost::FormatPredictions(preds.data(), nout, nrow * k / nslice, nrow * (k + 1) / nslice,
+                                       &text[k]);
+        };
+        if (pool) {
+            pool->ParallelFor(nslice, format);
+        } else {
+            for (size_t k = 0; k < nslice; ++k) format(k, 0);
+        }
+        for (size_t k = 0; k < nslice; ++k) {
+            if (std::fwrite(text[k].data(), 1, text[k].size(), out) != text[k].size()) {
+                std::cerr << "write failed" << std::endl;
+                return 1;
+            }
+        }
+    }
+    if (out != stdout ? std::fclose(out) != 0 : std::fflush(out) != 0) {
+        std::cerr << "write failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}